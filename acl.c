@@ -88,7 +88,7 @@ int acl_add(plist_t *rules, char *spec, enum acl_t acl) {
 			syslog(LOG_ERR, "ACL only ipv4 source addresses are supported (%s)\n", spec);
 			free(aux);
 			free(spec);
-			freeaddrinfo(addresses);
+			so_freeaddr(addresses);
 			return 0;
 		}
 
@@ -104,7 +104,7 @@ int acl_add(plist_t *rules, char *spec, enum acl_t acl) {
 	*rules = plist_add(*rules, acl, (char *)aux);
 
 	free(spec);
-	freeaddrinfo(addresses);
+	so_freeaddr(addresses);
 	return 1;
 }
 
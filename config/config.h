@@ -0,0 +1,12 @@
+#ifndef CONFIGURE_CONFIG_H
+#define CONFIGURE_CONFIG_H
+
+#define config_endian 1
+#define config_strdup 1
+#define config_socklen_t 1
+#define config_gethostname 1
+#define config_arc4random_buf 1
+#define config_strlcat 0
+#define config_strlcpy 0
+
+#endif // CONFIGURE_CONFIG_H
@@ -0,0 +1,633 @@
+/*
+ * These are the parent connection pool routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE				/* sched_getcpu() */
+#include <sched.h>
+#include <sys/epoll.h>
+#endif
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "utils.h"
+#include "socket.h"
+#include "auth.h"
+#include "connpool.h"
+
+#define POOL_SHARDS_MAX	64
+#define REAPER_EVENTS	64
+#define REAPER_SWEEP	1000			/* ms between idle time checks */
+#define WARM_INTERVAL	1			/* s between pool refills */
+
+extern int debug;
+
+/*
+ * Connections to parent proxies which went through NTLM authentication are
+ * kept for reuse. There is one pool per parent (hostname:port) and
+ * credential identity (domain\user), so a socket is only ever handed to a
+ * request going to the same parent on behalf of the same account. Proxies
+ * with equal address in different PAC proxy lists share a pool.
+ *
+ * A pool is split into per-CPU shards of fixed slots. Threads store into
+ * the shard of the CPU they run on and take from it first, stealing from
+ * the other shards only when it's empty. Slots change hands by CAS on their
+ * state, so neither path takes a lock. Within a shard, the most recently
+ * stored connection is reused first (it is the least likely to have been
+ * closed by the parent) and the oldest one is evicted when the shard is
+ * full.
+ *
+ * Liveness is not probed on the request path. On Linux, a reaper thread
+ * watches all idle connections for EPOLLRDHUP and closes those the parent
+ * has shut down, as well as those idle for longer than pool_idle seconds.
+ * Elsewhere, connpool_get() checks both itself.
+ *
+ * With warming enabled, another thread keeps at least warm_count idle
+ * connections in every pool which has served a request, opening and
+ * authenticating them in advance through the "warm" callback with a
+ * request for warm_url. That one is configured, never taken from client
+ * requests, so warming doesn't tell anybody what users browse. When the
+ * parent announces a keep-alive timeout, connections of its pools are
+ * dropped a second before it expires rather than after PoolIdleTime.
+ */
+
+enum slot_state_t { SLOT_EMPTY, SLOT_BUSY, SLOT_IDLE };
+
+struct connpool_slot_s {
+	int state;				/* slot_state_t, changed by CAS */
+	int fd;
+	struct auth_s *creds;
+	unsigned long seq;			/* store order, for LIFO */
+	time_t since;
+};
+
+struct connpool_s {
+	char *key;
+	char *parent;
+	int port;
+	int timeout;				/* parent's keep-alive timeout */
+	struct connpool_slot_s **shards;
+	unsigned long seq;
+	struct connpool_s *next;
+};
+
+static int shard_count = 1;
+static int shard_size = DEFAULT_POOL_SIZE;
+static int pool_idle = DEFAULT_POOL_IDLE;
+
+static struct connpool_s *pools = NULL;
+static pthread_mutex_t pools_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int stopping = 0;
+
+static int reaper_fd = -1;
+static unsigned long reaped = 0;
+
+static int warm_count = 0;
+static char *warm_url = NULL;
+static int (*warm)(const char *parent, int port, const char *url, struct auth_s *creds, int *timeout) = NULL;
+
+/*
+ * Shard of the calling thread: the current CPU where we can tell, a hash
+ * of the thread's stack address otherwise.
+ */
+static int shard_self(void) {
+	unsigned long h;
+	int here;
+
+#ifdef __linux__
+	here = sched_getcpu();
+	if (here >= 0)
+		return here & (shard_count - 1);
+#endif
+	h = (unsigned long)&here >> 12;
+	h *= 2654435761UL;
+
+	return (int)(h >> 16) & (shard_count - 1);
+}
+
+static void reaper_add(struct connpool_slot_s *slot) {
+#ifdef __linux__
+	struct epoll_event ev;
+
+	if (reaper_fd < 0)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLRDHUP;
+	ev.data.ptr = slot;
+	if (epoll_ctl(reaper_fd, EPOLL_CTL_ADD, slot->fd, &ev) && debug)
+		printf("connpool: cannot watch %d: %s\n", slot->fd, strerror(errno));
+#else
+	(void)slot;
+#endif
+}
+
+static void reaper_del(int fd) {
+#ifdef __linux__
+	if (reaper_fd >= 0)
+		epoll_ctl(reaper_fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+	(void)fd;
+#endif
+}
+
+/*
+ * How long connections may stay in the pool, 0 for no limit.
+ */
+static int pool_limit(const struct connpool_s *pool) {
+	int timeout = __atomic_load_n(&pool->timeout, __ATOMIC_RELAXED);
+
+	if (timeout > 0 && (!pool_idle || timeout - 1 < pool_idle))
+		return MAX(timeout - 1, 1);
+
+	return pool_idle;
+}
+
+/*
+ * Claim the idle slot with the newest (or oldest) connection in a shard.
+ *
+ * Returns: the slot, now SLOT_BUSY and owned by the caller, or NULL.
+ */
+static struct connpool_slot_s *shard_take(struct connpool_slot_s *slots, int oldest) {
+	struct connpool_slot_s *best;
+	unsigned long seq;
+	unsigned long bestseq = 0;
+	int state;
+	int i;
+
+	for (;;) {
+		best = NULL;
+		for (i = 0; i < shard_size; ++i) {
+			if (__atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE) != SLOT_IDLE)
+				continue;
+			seq = __atomic_load_n(&slots[i].seq, __ATOMIC_RELAXED);
+			if (!best || (oldest ? seq < bestseq : seq > bestseq)) {
+				best = &slots[i];
+				bestseq = seq;
+			}
+		}
+		if (!best)
+			return NULL;
+
+		state = SLOT_IDLE;
+		if (__atomic_compare_exchange_n(&best->state, &state, SLOT_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return best;
+	}
+}
+
+/*
+ * Close the connection of a claimed slot and mark it empty.
+ */
+static void slot_close(struct connpool_slot_s *slot) {
+	so_close(slot->fd);
+	free(slot->creds);
+	slot->creds = NULL;
+	__atomic_store_n(&slot->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+}
+
+#ifdef __linux__
+/*
+ * Close an idle connection if the parent has shut it down or, with "now"
+ * given, if it's been idle for more than "limit" seconds. Events may be
+ * stale - the slot could have been reused since - so the connection is
+ * checked before closing.
+ */
+static void slot_reap(struct connpool_slot_s *slot, int limit, time_t now) {
+	int state = SLOT_IDLE;
+
+	if (!__atomic_compare_exchange_n(&slot->state, &state, SLOT_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	if (now ? now - slot->since <= limit : !so_closed(slot->fd)) {
+		__atomic_store_n(&slot->state, SLOT_IDLE, __ATOMIC_RELEASE);
+		return;
+	}
+
+	if (debug)
+		printf("connpool: reaping %s connection %d\n", now ? "expired" : "closed", slot->fd);
+	slot_close(slot);
+	__atomic_add_fetch(&reaped, 1, __ATOMIC_RELAXED);
+}
+
+static void *reaper_thread(void *unused) {
+	struct epoll_event events[REAPER_EVENTS];
+	struct connpool_s *pool;
+	time_t swept = time(NULL);
+	time_t now;
+	int limit;
+	int i;
+	int j;
+	int n;
+
+	(void)unused;
+	for (;;) {
+		n = epoll_wait(reaper_fd, events, REAPER_EVENTS, REAPER_SWEEP);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Serious error during pool epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+
+		/*
+		 * Pools are only freed on exit, under pools_mtx.
+		 */
+		pthread_mutex_lock(&pools_mtx);
+		if (stopping) {
+			pthread_mutex_unlock(&pools_mtx);
+			break;
+		}
+
+		for (i = 0; i < n; ++i)
+			slot_reap((struct connpool_slot_s *)events[i].data.ptr, 0, 0);
+
+		now = time(NULL);
+		if (now != swept) {
+			for (pool = pools; pool; pool = pool->next) {
+				limit = pool_limit(pool);
+				if (!limit)
+					continue;
+				for (i = 0; i < shard_count; ++i)
+					for (j = 0; j < shard_size; ++j)
+						slot_reap(&pool->shards[i][j], limit, now);
+			}
+			swept = now;
+		}
+		pthread_mutex_unlock(&pools_mtx);
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Set the limits of all pools: at most "size" idle connections per pool
+ * (0 disables reuse), each idle for at most "idle" seconds (0 for no limit).
+ * Start the reaper, if available.
+ */
+void connpool_init(int size, int idle) {
+	long cpus = 1;
+
+	size = MAX(size, 0);
+	pool_idle = MAX(idle, 0);
+
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#endif
+	shard_count = 1;
+	while (shard_count * 2 <= MIN(cpus, MIN(size, POOL_SHARDS_MAX)))
+		shard_count *= 2;
+	shard_size = (size + shard_count - 1) / shard_count;
+
+	if (debug)
+		printf("connpool: %d shards of %d connections\n", shard_count, shard_size);
+
+#ifdef __linux__
+	if (shard_size) {
+		pthread_attr_t attr;
+		pthread_t pthr;
+		int rc;
+
+		reaper_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (reaper_fd < 0) {
+			syslog(LOG_ERR, "Cannot create epoll instance for pooled connections: %s\n", strerror(errno));
+			return;
+		}
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		rc = pthread_create(&pthr, &attr, reaper_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (rc) {
+			syslog(LOG_ERR, "Cannot start pool reaper thread: %d\n", rc);
+			close(reaper_fd);
+			reaper_fd = -1;
+		}
+	}
+#endif
+}
+
+/*
+ * Return the pool for the given parent and credentials, creating it if
+ * needed. Pools live until connpool_free(), so the result can be kept.
+ */
+struct connpool_s *connpool_find(const char *hostname, int port, const struct auth_s *creds) {
+	struct connpool_s *pool;
+	char *key;
+	int i;
+
+	key = zmalloc(strlen(hostname) + 2 * MINIBUF_SIZE + 16);
+	sprintf(key, "%s\\%s@%s:%d", creds ? creds->domain : "", creds ? creds->user : "", hostname, port);
+
+	pthread_mutex_lock(&pools_mtx);
+	for (pool = pools; pool; pool = pool->next) {
+		if (!strcmp(pool->key, key))
+			break;
+	}
+
+	if (!pool) {
+		pool = (struct connpool_s *)zmalloc(sizeof(struct connpool_s));
+		pool->key = key;
+		key = NULL;
+		pool->parent = strdup(hostname);
+		pool->port = port;
+		pool->shards = (struct connpool_slot_s **)zmalloc(shard_count * sizeof(struct connpool_slot_s *));
+		for (i = 0; i < shard_count; ++i)
+			pool->shards[i] = (struct connpool_slot_s *)zmalloc(MAX(shard_size, 1) * sizeof(struct connpool_slot_s));
+		pool->next = pools;
+		pools = pool;
+	}
+	pthread_mutex_unlock(&pools_mtx);
+
+	free(key);
+
+	return pool;
+}
+
+/*
+ * Take the most recently stored connection from the pool and copy the
+ * credentials it was authenticated with into "creds".
+ *
+ * Returns: socket descriptor, or -1 if the pool has none.
+ */
+int connpool_get(struct connpool_s *pool, struct auth_s *creds) {
+	struct connpool_slot_s *slot;
+	struct auth_s *tmp;
+	time_t since;
+	int limit;
+	int self;
+	int fd;
+	int i;
+
+	if (!pool || !shard_size)
+		return -1;
+
+	limit = pool_limit(pool);
+	self = shard_self();
+	for (i = 0; i < shard_count; ++i) {
+		while ((slot = shard_take(pool->shards[(self + i) & (shard_count - 1)], 0))) {
+			fd = slot->fd;
+			tmp = slot->creds;
+			since = slot->since;
+			slot->creds = NULL;
+			reaper_del(fd);
+			__atomic_store_n(&slot->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+
+			if ((limit && time(NULL) - since > limit)
+					|| (reaper_fd < 0 && so_closed(fd))) {
+				so_close(fd);
+				free(tmp);
+				continue;
+			}
+
+			copy_auth(creds, tmp, /* fullcopy */ 1);
+			free(tmp);
+			return fd;
+		}
+	}
+
+	return -1;
+}
+
+static void shard_put(struct connpool_s *pool, struct connpool_slot_s *slots, int fd, struct auth_s *creds) {
+	struct connpool_slot_s *slot = NULL;
+	int state;
+	int i;
+
+	for (i = 0; i < shard_size && !slot; ++i) {
+		state = SLOT_EMPTY;
+		if (__atomic_compare_exchange_n(&slots[i].state, &state, SLOT_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			slot = &slots[i];
+	}
+
+	if (!slot) {
+		slot = shard_take(slots, 1);
+		if (!slot) {
+			so_close(fd);
+			free(creds);
+			return;
+		}
+		if (debug)
+			printf("connpool: %s full, evicting %d\n", pool->key, slot->fd);
+		so_close(slot->fd);
+		free(slot->creds);
+	}
+
+	slot->fd = fd;
+	slot->creds = creds;
+	slot->since = time(NULL);
+	__atomic_store_n(&slot->seq, __atomic_add_fetch(&pool->seq, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	reaper_add(slot);
+	__atomic_store_n(&slot->state, SLOT_IDLE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Store an authenticated connection for reuse. The pool takes ownership
+ * of both the descriptor and "creds"; if the shard is full, its oldest
+ * connection is closed to make room.
+ */
+void connpool_put(struct connpool_s *pool, int fd, struct auth_s *creds) {
+	if (!pool || !shard_size) {
+		so_close(fd);
+		free(creds);
+		return;
+	}
+
+	shard_put(pool, pool->shards[shard_self()], fd, creds);
+}
+
+/*
+ * Close all idle connections of one pool, e.g. when its parent stopped
+ * working.
+ */
+void connpool_flush(struct connpool_s *pool) {
+	struct connpool_slot_s *slot;
+	int i;
+
+	if (!pool || !shard_size)
+		return;
+
+	for (i = 0; i < shard_count; ++i) {
+		while ((slot = shard_take(pool->shards[i], 0)))
+			slot_close(slot);
+	}
+}
+
+static int pool_idle_count(const struct connpool_s *pool) {
+	int count = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < shard_count; ++i)
+		for (j = 0; j < shard_size; ++j)
+			if (__atomic_load_n(&pool->shards[i][j].state, __ATOMIC_ACQUIRE) == SLOT_IDLE)
+				count++;
+
+	return count;
+}
+
+/*
+ * Top up the pools. Nothing of a pool is touched while warming up a
+ * connection for it, because connpool_free() may run in the meantime;
+ * pools_mtx and "stopping" tell whether it's still there.
+ */
+static void *warm_thread(void *unused) {
+	struct connpool_s *pool;
+	struct auth_s *creds;
+	char *parent;
+	int timeout;
+	int tries;
+	int port;
+	int fd;
+
+	(void)unused;
+	for (;;) {
+		sleep(WARM_INTERVAL);
+
+		pthread_mutex_lock(&pools_mtx);
+		pool = pools;
+		tries = 0;
+		while (pool && !stopping) {
+			/*
+			 * At most warm_count attempts per pool and round, in case
+			 * the parent drops our connections as soon as we make them.
+			 */
+			if (tries >= warm_count || pool_idle_count(pool) >= warm_count) {
+				pool = pool->next;
+				tries = 0;
+				continue;
+			}
+			tries++;
+
+			parent = strdup(pool->parent);
+			port = pool->port;
+			pthread_mutex_unlock(&pools_mtx);
+
+			creds = new_auth();
+			timeout = 0;
+			fd = warm(parent, port, warm_url, creds, &timeout);
+			free(parent);
+
+			pthread_mutex_lock(&pools_mtx);
+			if (fd < 0 || stopping) {
+				if (fd >= 0)
+					so_close(fd);
+				free(creds);
+				pool = pool->next;
+				tries = 0;
+				continue;
+			}
+
+			if (debug)
+				printf("connpool: warmed up %d for %s\n", fd, pool->key);
+			if (timeout > 0)
+				__atomic_store_n(&pool->timeout, timeout, __ATOMIC_RELAXED);
+
+			/*
+			 * Spread them over the shards, a single one might be too
+			 * small to hold warm_count.
+			 */
+			shard_put(pool, pool->shards[tries % shard_count], fd, creds);
+		}
+		if (stopping) {
+			pthread_mutex_unlock(&pools_mtx);
+			break;
+		}
+		pthread_mutex_unlock(&pools_mtx);
+	}
+
+	return NULL;
+}
+
+/*
+ * Keep "count" idle connections in each pool in use, opened by "fn" with a
+ * request for "url". It returns a connection to parent:port authenticated
+ * that way (or -1) and fills in the credentials used and the parent's
+ * keep-alive timeout, if announced.
+ *
+ * Returns: 1 if warming was started, 0 otherwise.
+ */
+int connpool_warm_start(int count, const char *url, int (*fn)(const char *parent, int port, const char *url, struct auth_s *creds, int *timeout)) {
+	pthread_attr_t attr;
+	pthread_t pthr;
+	int rc;
+
+	if (count <= 0 || !shard_size)
+		return 0;
+
+	warm_count = MIN(count, shard_size * shard_count);
+	warm_url = strdup(url);
+	warm = fn;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&pthr, &attr, warm_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		syslog(LOG_ERR, "Cannot start pool warming thread: %d\n", rc);
+		warm_count = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+void connpool_dump(void) {
+	struct connpool_s *pool;
+	int i;
+	int j;
+
+	pthread_mutex_lock(&pools_mtx);
+	for (pool = pools; pool; pool = pool->next) {
+		printf("Pool %s:", pool->key);
+		for (i = 0; i < shard_count; ++i)
+			for (j = 0; j < shard_size; ++j)
+				if (__atomic_load_n(&pool->shards[i][j].state, __ATOMIC_ACQUIRE) == SLOT_IDLE)
+					printf(" %d", pool->shards[i][j].fd);
+		printf("\n");
+	}
+	printf("Pool connections reaped: %lu\n", __atomic_load_n(&reaped, __ATOMIC_RELAXED));
+	pthread_mutex_unlock(&pools_mtx);
+}
+
+void connpool_free(void) {
+	struct connpool_s *pool;
+	int i;
+
+	pthread_mutex_lock(&pools_mtx);
+	stopping = 1;
+	while (pools) {
+		pool = pools;
+		pools = pool->next;
+		connpool_flush(pool);
+		for (i = 0; i < shard_count; ++i)
+			free(pool->shards[i]);
+		free(pool->shards);
+		free(pool->parent);
+		free(pool->key);
+		free(pool);
+	}
+	pthread_mutex_unlock(&pools_mtx);
+}
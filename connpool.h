@@ -0,0 +1,39 @@
+/*
+ * These are the parent connection pool routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _CONNPOOL_H
+#define _CONNPOOL_H
+
+#include "auth.h"
+
+#define DEFAULT_POOL_SIZE	32
+#define DEFAULT_POOL_IDLE	60
+
+struct connpool_s;
+
+extern void connpool_init(int size, int idle);
+extern struct connpool_s *connpool_find(const char *hostname, int port, const struct auth_s *creds);
+extern int connpool_get(struct connpool_s *pool, struct auth_s *creds);
+extern void connpool_put(struct connpool_s *pool, int fd, struct auth_s *creds);
+extern void connpool_flush(struct connpool_s *pool);
+extern int connpool_warm_start(int count, const char *url, int (*fn)(const char *parent, int port, const char *url, struct auth_s *creds, int *timeout));
+extern void connpool_dump(void);
+extern void connpool_free(void);
+
+#endif /* _CONNPOOL_H */
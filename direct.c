@@ -49,8 +49,8 @@ int host_connect(const char *hostname, int port) {
 		return -1;
 	}
 
-	fd = so_connect(addresses);
-	freeaddrinfo(addresses);
+	fd = so_connect(addresses, connect_timeout);
+	so_freeaddr(addresses);
 	return fd;
 }
 
@@ -299,11 +299,8 @@ rr_data_t direct_request(void *cdata, rr_data_const_t request) {
 				 * Convert full proxy request URL into a relative URL
 				 * Host header is already inserted by headers_recv()
 				 */
-				if (data[0]->rel_url) {
-					if (data[0]->url)
-						free(data[0]->url);
-					data[0]->url = strdup(data[0]->rel_url);
-				}
+				if (data[0]->rel_url)
+					rr_strset(data[0], &data[0]->url, data[0]->rel_url);
 
 				/*
 				 * Force proxy keep-alive if the client can handle it (HTTP >= 1.1)
@@ -336,8 +333,8 @@ rr_data_t direct_request(void *cdata, rr_data_const_t request) {
 				data[1]->empty = 0;
 				data[1]->req = 0;
 				data[1]->code = 200;
-				data[1]->msg = strdup("Connection established");
-				data[1]->http = strdup(data[0]->http);
+				data[1]->msg = rr_strdup(data[1], "Connection established");
+				data[1]->http = rr_strdup(data[1], data[0]->http);
 
 				if (headers_send(cd, data[1]))
 					tunnel(cd, sd);
@@ -356,7 +353,7 @@ rr_data_t direct_request(void *cdata, rr_data_const_t request) {
 				if (hlist_subcmp(data[1]->headers, "Connection", "close")) {
 					if (debug)
 						printf("Reconnect before WWW auth\n");
-					close(sd);
+					so_close(sd);
 					/*
 					 * Make sure nobody tries to read the body, particularly http_body_drop():
 					 * now that we closed the socket, it would wait indefinitely.
@@ -413,7 +410,7 @@ rr_data_t direct_request(void *cdata, rr_data_const_t request) {
 				 * reopen it. We must also reset response data.
 				 */
 				if (so_closed(sd)) {
-					close(sd);
+					so_close(sd);
 					sd = host_connect(data[0]->hostname, data[0]->port);
 					if (sd < 0) {
 						tmp = gen_502_page(data[0]->http, "Connection to remote server failed");
@@ -470,8 +467,7 @@ rr_data_t direct_request(void *cdata, rr_data_const_t request) {
 				 * the body is sent at the end of the NTLM challenge with the correct method
 				 */
 				rr_data_t auth = dup_rr_data(data[0]);
-				free(auth->method);
-				auth->method = strdup("HEAD");
+				rr_strset(auth, &auth->method, "HEAD");
 				auth->headers = hlist_mod(auth->headers, "Content-Length", "0", 1);
 				auth->headers = hlist_del(auth->headers, "Transfer-Encoding");
 
@@ -485,16 +481,9 @@ rr_data_t direct_request(void *cdata, rr_data_const_t request) {
 				free_rr_data(&auth);
 			} else {
 				/*
-				* Send headers
+				* Send headers and body
 				*/
-				if (!headers_send(*wsocket[loop], data[loop])) {
-					free_rr_data(&data[0]);
-					free_rr_data(&data[1]);
-					rc = (void *)-1;
-					goto bailout;
-				}
-
-				if (!http_body_send(*wsocket[loop], *rsocket[loop], data[0], data[1])) {
+				if (!http_message_send(*wsocket[loop], *rsocket[loop], data[loop], data[0], data[1])) {
 					free_rr_data(&data[0]);
 					free_rr_data(&data[1]);
 					rc = (void *)-1;
@@ -515,7 +504,7 @@ bailout:
 		free(hostname);
 
 	if (sd >= 0) {
-		close(sd);
+		so_close(sd);
 	}
 
 	return rc;
@@ -552,9 +541,9 @@ void direct_tunnel(void *thread_data) {
 bailout:
 	free(hostname);
 	if(sd >= 0) {
-		close(sd);
+		so_close(sd);
 	}
-	close(cd);
+	so_close(cd);
 
 	return;
 }
@@ -0,0 +1,391 @@
+/*
+ * These are the name resolution routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "utils.h"
+#include "dns.h"
+#include "dnsstub.h"
+
+#define DNS_WAYS	4
+
+extern int debug;
+
+/*
+ * Resolved names are cached for dns_ttl seconds, failed ones (no such
+ * name, no address) for dns_negative_ttl seconds. getaddrinfo() doesn't
+ * tell the real TTL, so these are the upper bounds; dns_cache_put() callers
+ * which know better pass their own, and so does the stub resolver.
+ *
+ * The cache is a set-associative table: a name hashes to a set of DNS_WAYS
+ * entries and, when the set is full, replaces the one closest to expiry.
+ * Its size is thus fixed up front. Each entry is protected by a sequence
+ * counter (seqlock): writers, serialized by dns_mtx, make it odd while
+ * they update the entry, readers copy the entry and retry if the counter
+ * changed meanwhile. Lookups therefore never block or write shared memory,
+ * apart from the statistics.
+ */
+
+struct dns_entry_s {
+	unsigned int seq;
+	unsigned int hash;
+	time_t expires;
+	int count;				/* 0 for a negative entry */
+	char name[DNS_NAME_MAX];
+	struct dns_addr_s addrs[DNS_ADDRS_MAX];
+};
+
+static struct dns_entry_s *cache = NULL;
+static unsigned int cache_mask = 0;
+static pthread_mutex_t dns_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int dns_ttl = DEFAULT_DNS_TTL;
+static int dns_negative_ttl = DEFAULT_DNS_NEGATIVE_TTL;
+
+static unsigned long hits = 0;
+static unsigned long negative = 0;
+static unsigned long misses = 0;
+static unsigned int entries = 0;
+
+/*
+ * Lower-case copy of the name into buf and its FNV-1a hash.
+ *
+ * Returns: 0 if the name is too long to be cached.
+ */
+static int dns_key(const char *hostname, char *buf, unsigned int *hash) {
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; hostname[i]; ++i) {
+		if (i == DNS_NAME_MAX - 1)
+			return 0;
+		buf[i] = tolower((unsigned char)hostname[i]);
+		h = (h ^ (unsigned char)buf[i]) * 16777619u;
+	}
+	buf[i] = 0;
+	*hash = h;
+
+	return 1;
+}
+
+/*
+ * Find a live entry for the name and copy it out.
+ */
+static int dns_cache_get(const char *name, unsigned int hash, struct dns_entry_s *copy) {
+	struct dns_entry_s *set;
+	unsigned int seq;
+	time_t now;
+	int copied;
+	int i;
+
+	set = &cache[(hash & cache_mask) * DNS_WAYS];
+	now = time(NULL);
+	for (i = 0; i < DNS_WAYS; ++i) {
+		copied = 0;
+		for (;;) {
+			seq = __atomic_load_n(&set[i].seq, __ATOMIC_ACQUIRE);
+			if (seq & 1)
+				continue;
+			if (__atomic_load_n(&set[i].hash, __ATOMIC_RELAXED) != hash)
+				break;
+			memcpy(copy, &set[i], sizeof(struct dns_entry_s));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&set[i].seq, __ATOMIC_RELAXED) == seq) {
+				copied = 1;
+				break;
+			}
+		}
+
+		if (copied && copy->expires > now && !strcmp(copy->name, name))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Store a positive (count > 0) or negative result for a name.
+ */
+static void dns_cache_store(const char *name, unsigned int hash, const struct dns_addr_s *addrs, int count, int ttl) {
+	struct dns_entry_s *set;
+	struct dns_entry_s *e = NULL;
+	time_t now;
+	int i;
+
+	if (!cache || ttl <= 0)
+		return;
+
+	set = &cache[(hash & cache_mask) * DNS_WAYS];
+	now = time(NULL);
+
+	pthread_mutex_lock(&dns_mtx);
+	for (i = 0; i < DNS_WAYS && !e; ++i) {
+		if (set[i].hash == hash && !strcmp(set[i].name, name))
+			e = &set[i];
+	}
+	for (i = 0; i < DNS_WAYS && !e; ++i) {
+		if (!set[i].expires)
+			entries++;
+		if (set[i].expires <= now)
+			e = &set[i];
+	}
+	if (!e) {
+		e = &set[0];
+		for (i = 1; i < DNS_WAYS; ++i) {
+			if (set[i].expires < e->expires)
+				e = &set[i];
+		}
+	}
+
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->hash = hash;
+	e->expires = now + ttl;
+	e->count = MIN(count, DNS_ADDRS_MAX);
+	strlcpy(e->name, name, DNS_NAME_MAX);
+	if (e->count)
+		memcpy(e->addrs, addrs, e->count * sizeof(struct dns_addr_s));
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dns_mtx);
+}
+
+/*
+ * Allocate the cache for "size" names. Until called, or with size 0,
+ * every lookup goes to the resolver.
+ */
+void dns_init(int size, int ttl, int negative_ttl) {
+	unsigned int sets = 1;
+
+	dns_ttl = MAX(ttl, 0);
+	dns_negative_ttl = MAX(negative_ttl, 0);
+	if (size <= 0 || !dns_ttl)
+		return;
+
+	while (sets * DNS_WAYS < (unsigned int)size)
+		sets <<= 1;
+	cache = (struct dns_entry_s *)zmalloc(sets * DNS_WAYS * sizeof(struct dns_entry_s));
+	cache_mask = sets - 1;
+
+	if (debug)
+		printf("DNS cache: %u entries, TTL %d/%d s\n", sets * DNS_WAYS, dns_ttl, dns_negative_ttl);
+}
+
+/*
+ * Build an addrinfo list for the addresses and port. The list is a single
+ * block, to be freed with dns_free().
+ */
+struct addrinfo *dns_addrinfo(const struct dns_addr_s *addrs, int count, int port) {
+	struct addrinfo *list;
+	struct sockaddr_in6 *storage;
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	int i;
+
+	if (count <= 0)
+		return NULL;
+
+	list = (struct addrinfo *)zmalloc(count * (sizeof(struct addrinfo) + sizeof(struct sockaddr_in6)));
+	storage = (struct sockaddr_in6 *)(list + count);
+	for (i = 0; i < count; ++i) {
+		list[i].ai_family = addrs[i].family;
+		list[i].ai_socktype = SOCK_STREAM;
+		list[i].ai_protocol = IPPROTO_TCP;
+		list[i].ai_addr = (struct sockaddr *)&storage[i];
+		list[i].ai_next = (i + 1 < count ? &list[i + 1] : NULL);
+		if (addrs[i].family == AF_INET6) {
+			sin6 = &storage[i];
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = htons(port);
+			memcpy(&sin6->sin6_addr, addrs[i].addr, 16);
+			list[i].ai_addrlen = sizeof(struct sockaddr_in6);
+		} else {
+			sin = (struct sockaddr_in *)&storage[i];
+			sin->sin_family = AF_INET;
+			sin->sin_port = htons(port);
+			memcpy(&sin->sin_addr, addrs[i].addr, 4);
+			list[i].ai_addrlen = sizeof(struct sockaddr_in);
+		}
+	}
+
+	return list;
+}
+
+/*
+ * Collect IPv4 and IPv6 addresses of a getaddrinfo() result, in order.
+ *
+ * Returns: number of addresses stored.
+ */
+static int dns_collect(const struct addrinfo *p, struct dns_addr_s *addrs, int max, int *ports) {
+	int count = 0;
+
+	for (; p && count < max; p = p->ai_next) {
+		if (p->ai_family == AF_INET) {
+			addrs[count].family = AF_INET;
+			memcpy(addrs[count].addr, &((struct sockaddr_in *)p->ai_addr)->sin_addr, 4);
+			if (ports)
+				ports[count] = ntohs(((struct sockaddr_in *)p->ai_addr)->sin_port);
+			count++;
+		} else if (p->ai_family == AF_INET6) {
+			addrs[count].family = AF_INET6;
+			memcpy(addrs[count].addr, &((struct sockaddr_in6 *)p->ai_addr)->sin6_addr, 16);
+			if (ports)
+				ports[count] = ntohs(((struct sockaddr_in6 *)p->ai_addr)->sin6_port);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Convert a getaddrinfo() result into a list freed with dns_free().
+ */
+struct addrinfo *dns_copy(const struct addrinfo *list) {
+	struct dns_addr_s addrs[DNS_ADDRS_MAX];
+	int ports[DNS_ADDRS_MAX];
+	struct addrinfo *copy;
+	int count;
+
+	count = dns_collect(list, addrs, DNS_ADDRS_MAX, ports);
+	copy = dns_addrinfo(addrs, count, count ? ports[0] : 0);
+
+	return copy;
+}
+
+void dns_free(struct addrinfo *addresses) {
+	free(addresses);
+}
+
+/*
+ * Add a result obtained elsewhere (count 0 for a failed name).
+ */
+void dns_cache_put(const char *hostname, const struct dns_addr_s *addrs, int count, int ttl) {
+	char name[DNS_NAME_MAX];
+	unsigned int hash;
+
+	if (!cache || !dns_key(hostname, name, &hash))
+		return;
+
+	dns_cache_store(name, hash, addrs, count, MIN(ttl, count ? dns_ttl : dns_negative_ttl));
+}
+
+static int dns_literal(const char *hostname) {
+	unsigned char buf[sizeof(struct in6_addr)];
+
+	return inet_pton(AF_INET, hostname, buf) == 1 || inet_pton(AF_INET6, hostname, buf) == 1;
+}
+
+/*
+ * Resolve hostname, from the cache if possible, and return its addresses
+ * with the given port.
+ *
+ * Returns: 1 if OK, 0 otherwise. The caller frees addresses with dns_free().
+ */
+int dns_resolve(const char *hostname, int port, struct addrinfo **addresses) {
+	struct dns_addr_s addrs[DNS_ADDRS_MAX];
+	struct dns_entry_s entry;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char name[DNS_NAME_MAX];
+	unsigned int hash = 0;
+	int cached;
+	int count;
+	int rc;
+
+	*addresses = NULL;
+	cached = cache && dns_key(hostname, name, &hash);
+	if (cached && dns_cache_get(name, hash, &entry)) {
+		if (!entry.count) {
+			__atomic_add_fetch(&negative, 1, __ATOMIC_RELAXED);
+			if (debug)
+				printf("dns_resolve: %s failed (cached)\n", hostname);
+			return 0;
+		}
+		__atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+		*addresses = dns_addrinfo(entry.addrs, entry.count, port);
+		return 1;
+	}
+	if (cached)
+		__atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+
+	/*
+	 * Qualified names go to the stub resolver, if enabled. Short names
+	 * need the search list and the hosts file, and literals no lookup at
+	 * all - getaddrinfo() knows these. So does it when the stub fails or
+	 * finds no address: the name may still be in the hosts file or need
+	 * the search list, so only getaddrinfo()'s answer is cached negative.
+	 */
+	if (dnsstub_enabled() && strchr(hostname, '.') && !dns_literal(hostname)) {
+		count = dnsstub_resolve(hostname, addrs, DNS_ADDRS_MAX, &rc);
+		if (count > 0) {
+			if (cached)
+				dns_cache_store(name, hash, addrs, count, MIN(rc, dns_ttl));
+			*addresses = dns_addrinfo(addrs, count, port);
+			return 1;
+		}
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo(hostname, NULL, &hints, &res);
+	if (rc != 0) {
+		if (debug)
+			printf("dns_resolve: %s failed: %s (%d)\n", hostname, gai_strerror(rc), rc);
+		/*
+		 * Cache only definite answers, not resolver trouble.
+		 */
+		if (cached && (rc == EAI_NONAME
+#ifdef EAI_NODATA
+				|| rc == EAI_NODATA
+#endif
+				))
+			dns_cache_store(name, hash, NULL, 0, dns_negative_ttl);
+		return 0;
+	}
+
+	count = dns_collect(res, addrs, DNS_ADDRS_MAX, NULL);
+	freeaddrinfo(res);
+	if (!count)
+		return 0;
+
+	if (cached)
+		dns_cache_store(name, hash, addrs, count, dns_ttl);
+	*addresses = dns_addrinfo(addrs, count, port);
+
+	return 1;
+}
+
+void dns_stats(struct dns_stats_s *stats) {
+	stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+	stats->negative = __atomic_load_n(&negative, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&dns_mtx);
+	stats->entries = entries;
+	pthread_mutex_unlock(&dns_mtx);
+}
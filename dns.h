@@ -0,0 +1,58 @@
+/*
+ * These are the name resolution routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _DNS_H
+#define _DNS_H
+
+#include <netdb.h>
+
+#define DEFAULT_DNS_CACHE_SIZE	1024
+#define DEFAULT_DNS_TTL		60
+#define DEFAULT_DNS_NEGATIVE_TTL	10
+
+#define DNS_NAME_MAX		256
+#define DNS_ADDRS_MAX		8
+
+/*
+ * Address of a resolved name, without port.
+ */
+struct dns_addr_s {
+	unsigned short family;			/* AF_INET or AF_INET6 */
+	unsigned char addr[16];
+};
+
+/*
+ * Snapshot of the cache counters, see dns_stats().
+ */
+struct dns_stats_s {
+	unsigned long hits;
+	unsigned long negative;			/* hits on failed names */
+	unsigned long misses;
+	unsigned int entries;
+};
+
+extern void dns_init(int size, int ttl, int negative_ttl);
+extern int dns_resolve(const char *hostname, int port, struct addrinfo **addresses);
+extern void dns_cache_put(const char *hostname, const struct dns_addr_s *addrs, int count, int ttl);
+extern struct addrinfo *dns_addrinfo(const struct dns_addr_s *addrs, int count, int port);
+extern struct addrinfo *dns_copy(const struct addrinfo *list);
+extern void dns_free(struct addrinfo *addresses);
+extern void dns_stats(struct dns_stats_s *stats);
+
+#endif /* _DNS_H */
@@ -0,0 +1,646 @@
+/*
+ * These are the DNS stub resolver routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "utils.h"
+#include "dns.h"
+#include "dnsstub.h"
+
+#define STUB_SERVERS	3			/* MAXNS of resolv.conf */
+#define STUB_INFLIGHT	256
+#define STUB_PACKET	1500
+#define STUB_TIMEOUT	2			/* s per try, unless set in resolv.conf */
+#define STUB_ATTEMPTS	2			/* rounds over all servers */
+#define STUB_NAME_MAX	253			/* RFC 1035, without the root dot */
+#define STUB_QUERY	(12 + STUB_NAME_MAX + 2 + 4)	/* header, name, QTYPE, QCLASS */
+
+#define QTYPE_A		1
+#define QTYPE_AAAA	28
+#define QCLASS_IN	1
+
+#define RCODE_NOERROR	0
+#define RCODE_NXDOMAIN	3
+
+extern int debug;
+
+/*
+ * A minimal asynchronous DNS client, an alternative to the blocking
+ * getaddrinfo(). It reads the name servers and the timeout/attempts options
+ * of resolv.conf, and nothing else: no search domains, no hosts file. That's
+ * why dns_resolve() only uses it for names with a dot in them and falls back
+ * to getaddrinfo() whenever it doesn't get a definite answer.
+ *
+ * A single thread runs all lookups. Each one has its own UDP socket (and
+ * thus source port) with the A and AAAA queries sent back to back, waiting
+ * for both. Unanswered queries are re-sent to the next server after the
+ * timeout. Concurrent lookups of the same name share one set of queries;
+ * every caller gets its completion callback.
+ */
+
+struct waiter_s {
+	dnsstub_cb_t cb;
+	void *arg;
+	struct waiter_s *next;
+};
+
+struct lookup_s {
+	char name[DNS_NAME_MAX];
+	int fd;
+	int server;				/* index of the server asked */
+	int tries;
+	long long deadline;			/* ms, see stub_clock() */
+	unsigned short id[2];			/* A, AAAA */
+	int pending[2];
+	int retry;				/* server failed, ask the next one */
+	int failed;				/* no usable answer at all */
+	int count[2];
+	struct dns_addr_s addrs[2][DNS_ADDRS_MAX];
+	int ttl;
+	struct waiter_s *waiters;
+	struct lookup_s *next;
+};
+
+static struct sockaddr_storage servers[STUB_SERVERS];
+static socklen_t serverlen[STUB_SERVERS];
+static int nservers = 0;
+static int timeout_ms = STUB_TIMEOUT * 1000;
+static int attempts = STUB_ATTEMPTS;
+
+static struct lookup_s *lookups = NULL;
+static int inflight = 0;
+static int wake[2] = {-1, -1};
+static int enabled = 0;
+static pthread_mutex_t stub_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static long long stub_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Encode a query for name and qtype into buf, which must hold STUB_QUERY
+ * bytes.
+ *
+ * Returns: length, or 0 if the name can't be encoded.
+ */
+static int stub_encode(unsigned char *buf, unsigned short id, const char *name, int qtype) {
+	const char *label;
+	const char *dot;
+	int off = 12;
+	size_t len;
+
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;					/* RD */
+	buf[5] = 1;					/* QDCOUNT */
+
+	if (strlen(name) > STUB_NAME_MAX)
+		return 0;
+
+	for (label = name; *label; label = dot + 1) {
+		dot = strchr(label, '.');
+		if (!dot)
+			dot = label + strlen(label);
+		len = dot - label;
+		if (!len || len > 63 || off + len + 1 + 5 > STUB_QUERY)
+			return 0;
+		buf[off++] = len;
+		memcpy(buf + off, label, len);
+		off += len;
+		if (!*dot)
+			break;
+	}
+	buf[off++] = 0;
+	buf[off++] = 0;
+	buf[off++] = qtype;
+	buf[off++] = 0;
+	buf[off++] = QCLASS_IN;
+
+	return off;
+}
+
+/*
+ * Decode a (possibly compressed) name at *off into buf, dot-separated,
+ * and move *off past it.
+ *
+ * Returns: 1 if OK, 0 for a malformed name.
+ */
+static int stub_name(const unsigned char *msg, int len, int *off, char *buf) {
+	int pos = *off;
+	int out = 0;
+	int jumps = 0;
+	int c;
+
+	*off = -1;
+	while (pos < len) {
+		c = msg[pos];
+		if (!c) {
+			if (*off < 0)
+				*off = pos + 1;
+			buf[out ? out - 1 : 0] = 0;
+			return 1;
+		}
+		if ((c & 0xc0) == 0xc0) {
+			if (pos + 1 >= len || ++jumps > 16)
+				return 0;
+			if (*off < 0)
+				*off = pos + 2;
+			pos = ((c & 0x3f) << 8) | msg[pos + 1];
+			continue;
+		}
+		if (c & 0xc0 || pos + 1 + c >= len || out + c + 1 >= DNS_NAME_MAX)
+			return 0;
+		memcpy(buf + out, msg + pos + 1, c);
+		out += c;
+		buf[out++] = '.';
+		pos += c + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Process one reply datagram for lookup q.
+ */
+static void stub_parse(struct lookup_s *q, const unsigned char *msg, int len) {
+	char name[DNS_NAME_MAX];
+	unsigned int ttl;
+	int type;
+	int rdlen;
+	int rcode;
+	int off;
+	int qd;
+	int an;
+	int t;
+
+	if (len < 12 || !(msg[2] & 0x80))
+		return;
+
+	t = ((msg[0] << 8) | msg[1]);
+	if (q->pending[0] && t == q->id[0])
+		t = 0;
+	else if (q->pending[1] && t == q->id[1])
+		t = 1;
+	else
+		return;
+
+	qd = (msg[4] << 8) | msg[5];
+	an = (msg[6] << 8) | msg[7];
+	off = 12;
+	if (qd != 1 || !stub_name(msg, len, &off, name) || off + 4 > len
+			|| strcasecmp(name, q->name)
+			|| ((msg[off] << 8) | msg[off + 1]) != (t ? QTYPE_AAAA : QTYPE_A))
+		return;
+	off += 4;
+
+	/*
+	 * Truncated - we don't do TCP, let getaddrinfo() handle it.
+	 */
+	if (msg[2] & 0x02) {
+		q->failed = 1;
+		q->pending[0] = q->pending[1] = 0;
+		return;
+	}
+
+	rcode = msg[3] & 0x0f;
+	if (rcode == RCODE_NXDOMAIN) {
+		q->pending[0] = q->pending[1] = 0;
+		return;
+	}
+	if (rcode != RCODE_NOERROR) {
+		q->retry = 1;
+		return;
+	}
+
+	while (an-- > 0) {
+		if (!stub_name(msg, len, &off, name) || off + 10 > len)
+			break;
+		type = (msg[off] << 8) | msg[off + 1];
+		ttl = ((unsigned int)msg[off + 4] << 24) | (msg[off + 5] << 16) | (msg[off + 6] << 8) | msg[off + 7];
+		rdlen = (msg[off + 8] << 8) | msg[off + 9];
+		off += 10;
+		if (off + rdlen > len)
+			break;
+
+		/*
+		 * A recursive server puts the CNAME chain in front of the
+		 * addresses, so any A/AAAA record of the answer is ours.
+		 */
+		if (((msg[off - 8] << 8) | msg[off - 7]) == QCLASS_IN && q->count[t] < DNS_ADDRS_MAX
+				&& ((t == 0 && type == QTYPE_A && rdlen == 4) || (t == 1 && type == QTYPE_AAAA && rdlen == 16))) {
+			q->addrs[t][q->count[t]].family = t ? AF_INET6 : AF_INET;
+			memcpy(q->addrs[t][q->count[t]].addr, msg + off, rdlen);
+			q->count[t]++;
+			if (ttl < (unsigned int)q->ttl)
+				q->ttl = ttl;
+		}
+		off += rdlen;
+	}
+	q->pending[t] = 0;
+}
+
+/*
+ * (Re)open the socket of lookup q to its current server and send the
+ * queries still unanswered.
+ */
+static int stub_send(struct lookup_s *q) {
+	unsigned char buf[STUB_QUERY];
+	int len;
+	int t;
+
+	if (q->fd >= 0)
+		close(q->fd);
+
+	q->fd = socket(servers[q->server].ss_family, SOCK_DGRAM, 0);
+	if (q->fd < 0)
+		return 0;
+	if (fcntl(q->fd, F_SETFL, fcntl(q->fd, F_GETFL, 0) | O_NONBLOCK) < 0
+			|| fcntl(q->fd, F_SETFD, FD_CLOEXEC) < 0
+			|| connect(q->fd, (struct sockaddr *)&servers[q->server], serverlen[q->server]) < 0)
+		return 0;
+
+	for (t = 0; t < 2; ++t) {
+		if (!q->pending[t])
+			continue;
+		len = stub_encode(buf, q->id[t], q->name, t ? QTYPE_AAAA : QTYPE_A);
+		if (!len || send(q->fd, buf, len, 0) != len)
+			return 0;
+	}
+	q->tries++;
+	q->retry = 0;
+	q->deadline = stub_clock() + timeout_ms;
+
+	return 1;
+}
+
+/*
+ * Deliver the result of a finished lookup and free it.
+ */
+static void stub_finish(struct lookup_s *q) {
+	struct dns_addr_s addrs[DNS_ADDRS_MAX];
+	struct waiter_s *w;
+	int n4;
+	int n6;
+	int status;
+
+	/*
+	 * IPv4 first, but leave room for some IPv6 addresses.
+	 */
+	n6 = MIN(q->count[1], DNS_ADDRS_MAX - MIN(q->count[0], DNS_ADDRS_MAX / 2));
+	n4 = MIN(q->count[0], DNS_ADDRS_MAX - n6);
+	memcpy(addrs, q->addrs[0], n4 * sizeof(struct dns_addr_s));
+	memcpy(addrs + n4, q->addrs[1], n6 * sizeof(struct dns_addr_s));
+
+	status = q->failed ? -1 : (n4 + n6 > 0);
+	if (debug)
+		printf("dnsstub: %s: status %d, %d addresses, TTL %d\n", q->name, status, n4 + n6, q->ttl);
+
+	while ((w = q->waiters)) {
+		q->waiters = w->next;
+		w->cb(w->arg, status, addrs, n4 + n6, q->ttl);
+		free(w);
+	}
+
+	if (q->fd >= 0)
+		close(q->fd);
+	free(q);
+}
+
+static void stub_receive(struct lookup_s *q) {
+	unsigned char buf[STUB_PACKET];
+	ssize_t len;
+
+	while ((len = recv(q->fd, buf, sizeof(buf), 0)) >= 0)
+		stub_parse(q, buf, len);
+
+	if (errno != EAGAIN && errno != EINTR)
+		q->retry = 1;				/* e.g. ICMP port unreachable */
+}
+
+static void *stub_thread(void *unused) {
+	struct pollfd pfd[STUB_INFLIGHT + 1];
+	struct lookup_s *map[STUB_INFLIGHT + 1];
+	struct lookup_s **pq;
+	struct lookup_s *q;
+	struct lookup_s *done;
+	long long now;
+	char drain[64];
+	int timeout;
+	int rc;
+	int i;
+	int n;
+
+	(void)unused;
+	for (;;) {
+		pthread_mutex_lock(&stub_mtx);
+		pfd[0].fd = wake[0];
+		pfd[0].events = POLLIN;
+		n = 1;
+		timeout = -1;
+		now = stub_clock();
+		for (q = lookups; q; q = q->next) {
+			pfd[n].fd = q->fd;
+			pfd[n].events = POLLIN;
+			map[n++] = q;
+			if (timeout < 0 || q->deadline - now < timeout)
+				timeout = MAX(q->deadline - now, 0);
+		}
+		pthread_mutex_unlock(&stub_mtx);
+
+		rc = poll(pfd, n, timeout);
+		if (rc < 0 && errno != EINTR) {
+			syslog(LOG_ERR, "Serious error during DNS poll: %s\n", strerror(errno));
+			break;
+		}
+
+		if (rc > 0 && pfd[0].revents)
+			while (read(wake[0], drain, sizeof(drain)) > 0)
+				;
+
+		/*
+		 * Only this thread removes lookups, so map[] is still valid.
+		 */
+		done = NULL;
+		pthread_mutex_lock(&stub_mtx);
+		for (i = 1; rc > 0 && i < n; ++i) {
+			if (pfd[i].revents)
+				stub_receive(map[i]);
+		}
+
+		now = stub_clock();
+		pq = &lookups;
+		while ((q = *pq)) {
+			if (q->pending[0] || q->pending[1]) {
+				if (!q->retry && now < q->deadline) {
+					pq = &q->next;
+					continue;
+				}
+				q->server = (q->server + 1) % nservers;
+				if (q->tries < attempts * nservers && stub_send(q)) {
+					pq = &q->next;
+					continue;
+				}
+				q->failed = 1;
+			}
+			*pq = q->next;
+			q->next = done;
+			done = q;
+			inflight--;
+		}
+		pthread_mutex_unlock(&stub_mtx);
+
+		while ((q = done)) {
+			done = q->next;
+			stub_finish(q);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Read name servers and options from resolv.conf and start the resolver
+ * thread.
+ *
+ * Returns: 1 if the stub resolver is usable, 0 otherwise.
+ */
+int dnsstub_init(const char *conf) {
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	pthread_attr_t attr;
+	pthread_t pthr;
+	char line[512];
+	char *tok;
+	char *save;
+	FILE *fp;
+	int rc;
+
+	fp = fopen(conf, "r");
+	if (!fp) {
+		syslog(LOG_ERR, "Cannot open %s: %s\n", conf, strerror(errno));
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		tok = strtok_r(line, " \t\r\n", &save);
+		if (!tok || *tok == '#' || *tok == ';')
+			continue;
+
+		if (!strcmp(tok, "nameserver") && nservers < STUB_SERVERS) {
+			tok = strtok_r(NULL, " \t\r\n", &save);
+			if (!tok)
+				continue;
+			memset(&servers[nservers], 0, sizeof(servers[nservers]));
+			sin = (struct sockaddr_in *)&servers[nservers];
+			sin6 = (struct sockaddr_in6 *)&servers[nservers];
+			if (inet_pton(AF_INET, tok, &sin->sin_addr) == 1) {
+				sin->sin_family = AF_INET;
+				sin->sin_port = htons(53);
+				serverlen[nservers++] = sizeof(struct sockaddr_in);
+			} else if (inet_pton(AF_INET6, tok, &sin6->sin6_addr) == 1) {
+				sin6->sin6_family = AF_INET6;
+				sin6->sin6_port = htons(53);
+				serverlen[nservers++] = sizeof(struct sockaddr_in6);
+			}
+		} else if (!strcmp(tok, "options")) {
+			while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+				if (!strncmp(tok, "timeout:", 8))
+					timeout_ms = MAX(atoi(tok + 8), 1) * 1000;
+				else if (!strncmp(tok, "attempts:", 9))
+					attempts = MAX(atoi(tok + 9), 1);
+			}
+		}
+	}
+	fclose(fp);
+
+	if (!nservers) {
+		syslog(LOG_ERR, "No usable name server in %s\n", conf);
+		return 0;
+	}
+
+	if (pipe(wake)) {
+		syslog(LOG_ERR, "Cannot create DNS resolver pipe: %s\n", strerror(errno));
+		return 0;
+	}
+	fcntl(wake[0], F_SETFL, fcntl(wake[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(wake[1], F_SETFL, fcntl(wake[1], F_GETFL, 0) | O_NONBLOCK);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&pthr, &attr, stub_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		syslog(LOG_ERR, "Cannot start DNS resolver thread: %d\n", rc);
+		return 0;
+	}
+
+	if (debug)
+		printf("dnsstub: %d servers, timeout %d ms, %d attempts\n", nservers, timeout_ms, attempts);
+	enabled = 1;
+
+	return 1;
+}
+
+int dnsstub_enabled(void) {
+	return enabled;
+}
+
+/*
+ * Start resolving hostname; cb(arg, ...) is called once done.
+ *
+ * Returns: 0 if the lookup was started (or joined), -1 if it couldn't be,
+ * in which case cb won't be called.
+ */
+int dnsstub_query(const char *hostname, dnsstub_cb_t cb, void *arg) {
+	struct waiter_s *w;
+	struct lookup_s *q;
+	uint64_t ids;
+	size_t len;
+
+	len = strlen(hostname);
+	if (len && hostname[len - 1] == '.')
+		len--;
+	if (!enabled || !len || len > STUB_NAME_MAX)
+		return -1;
+
+	w = (struct waiter_s *)zmalloc(sizeof(struct waiter_s));
+	w->cb = cb;
+	w->arg = arg;
+
+	pthread_mutex_lock(&stub_mtx);
+	for (q = lookups; q; q = q->next) {
+		if (strlen(q->name) == len && !strncasecmp(q->name, hostname, len))
+			break;
+	}
+
+	if (!q) {
+		if (inflight >= STUB_INFLIGHT) {
+			pthread_mutex_unlock(&stub_mtx);
+			free(w);
+			return -1;
+		}
+
+		q = (struct lookup_s *)zmalloc(sizeof(struct lookup_s));
+		memcpy(q->name, hostname, len);
+		q->fd = -1;
+		ids = getrandom64();
+		q->id[0] = ids & 0xffff;
+		q->id[1] = (ids >> 16) & 0xffff;
+		if (q->id[1] == q->id[0])
+			q->id[1] ^= 1;
+		q->pending[0] = q->pending[1] = 1;
+		q->ttl = INT_MAX;
+		if (!stub_send(q)) {
+			pthread_mutex_unlock(&stub_mtx);
+			if (q->fd >= 0)
+				close(q->fd);
+			free(q);
+			free(w);
+			return -1;
+		}
+		q->next = lookups;
+		lookups = q;
+		inflight++;
+		if (write(wake[1], "", 1) < 0 && debug)
+			printf("dnsstub: wakeup failed: %s\n", strerror(errno));
+	}
+
+	w->next = q->waiters;
+	q->waiters = w;
+	pthread_mutex_unlock(&stub_mtx);
+
+	return 0;
+}
+
+struct stub_wait_s {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	int done;
+	int status;
+	int count;
+	int ttl;
+	int max;
+	struct dns_addr_s *addrs;
+};
+
+static void stub_wakeup(void *arg, int status, const struct dns_addr_s *addrs, int count, int ttl) {
+	struct stub_wait_s *w = (struct stub_wait_s *)arg;
+
+	pthread_mutex_lock(&w->mtx);
+	w->status = status;
+	w->count = MIN(count, w->max);
+	memcpy(w->addrs, addrs, w->count * sizeof(struct dns_addr_s));
+	w->ttl = ttl;
+	w->done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+/*
+ * Blocking lookup of hostname, for callers which have nothing else to do
+ * in the meantime.
+ *
+ * Returns: number of addresses stored (TTL in *ttl), 0 if the name doesn't
+ * exist or has no address, -1 if there's no answer.
+ */
+int dnsstub_resolve(const char *hostname, struct dns_addr_s *addrs, int max, int *ttl) {
+	struct stub_wait_s w;
+
+	memset(&w, 0, sizeof(w));
+	pthread_mutex_init(&w.mtx, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	w.addrs = addrs;
+	w.max = max;
+
+	if (dnsstub_query(hostname, stub_wakeup, &w) < 0) {
+		w.done = 1;
+		w.status = -1;
+	}
+
+	pthread_mutex_lock(&w.mtx);
+	while (!w.done)
+		pthread_cond_wait(&w.cond, &w.mtx);
+	pthread_mutex_unlock(&w.mtx);
+
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.mtx);
+
+	*ttl = w.ttl;
+
+	return w.status > 0 ? w.count : w.status;
+}
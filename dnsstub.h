@@ -0,0 +1,41 @@
+/*
+ * These are the DNS stub resolver routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _DNSSTUB_H
+#define _DNSSTUB_H
+
+#include "dns.h"
+
+#ifndef RESOLV_CONF
+#define RESOLV_CONF		"/etc/resolv.conf"
+#endif
+
+/*
+ * Completion callback: status is 1 with addresses, 0 if the name doesn't
+ * exist or has no address, -1 if the servers didn't give an answer. It runs
+ * on the resolver thread and must not block.
+ */
+typedef void (*dnsstub_cb_t)(void *arg, int status, const struct dns_addr_s *addrs, int count, int ttl);
+
+extern int dnsstub_init(const char *conf);
+extern int dnsstub_enabled(void);
+extern int dnsstub_query(const char *hostname, dnsstub_cb_t cb, void *arg);
+extern int dnsstub_resolve(const char *hostname, struct dns_addr_s *addrs, int max, int *ttl);
+
+#endif /* _DNSSTUB_H */
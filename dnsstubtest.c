@@ -0,0 +1,109 @@
+/*
+ * Regression test of the DNS stub query encoder (make dnsstubtest)
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * The encoder is static, so the test is built on dnsstub.c itself
+ */
+#include "dnsstub.c"
+
+#define GUARD		16
+
+int debug = 0;
+
+static int failed = 0;
+
+static void check(int cond, const char *what) {
+	if (!cond) {
+		printf("dnsstubtest: FAILED: %s\n", what);
+		failed = 1;
+	}
+}
+
+/*
+ * A name of "len" characters in labels of at most 63, like aaa.bbb.ccc
+ */
+static void make_name(char *name, int len) {
+	int i;
+
+	for (i = 0; i < len; ++i)
+		name[i] = (i % 64 == 63) ? '.' : 'a' + i / 64;
+	name[len] = 0;
+}
+
+/*
+ * Encode "name" into a buffer of exactly STUB_QUERY bytes followed by a
+ * guard area, which must stay untouched.
+ *
+ * Returns: length of the query, 0 if it was refused or -1 on overflow.
+ */
+static int encode(const char *name) {
+	unsigned char buf[STUB_QUERY + GUARD];
+	int len;
+	int i;
+
+	memset(buf, 0xa5, sizeof(buf));
+	len = stub_encode(buf, 0x1234, name, QTYPE_AAAA);
+	for (i = STUB_QUERY; i < STUB_QUERY + GUARD; ++i) {
+		if (buf[i] != 0xa5)
+			return -1;
+	}
+
+	return len;
+}
+
+int main(void) {
+	unsigned char buf[STUB_QUERY];
+	char name[DNS_NAME_MAX + 8];
+	char back[DNS_NAME_MAX];
+	int len;
+	int off;
+
+	/*
+	 * The longest name allowed, in four labels, fills the query exactly
+	 */
+	make_name(name, STUB_NAME_MAX);
+	len = encode(name);
+	check(len == STUB_QUERY, "maximum-length name");
+
+	len = stub_encode(buf, 0x1234, name, QTYPE_A);
+	off = 12;
+	check(len == STUB_QUERY && stub_name(buf, len, &off, back) && !strcmp(back, name),
+		"maximum-length name decoding");
+	check(off == len - 4 && buf[off + 1] == QTYPE_A && buf[off + 3] == QCLASS_IN,
+		"maximum-length name QTYPE/QCLASS");
+
+	/*
+	 * Anything longer is refused, up to what dnsstub_query() used to let through
+	 */
+	for (len = STUB_NAME_MAX + 1; len <= DNS_NAME_MAX - 1; ++len) {
+		make_name(name, len);
+		check(encode(name) == 0, "overlong name accepted");
+	}
+
+	check(encode("example.com") == 12 + 13 + 4, "short name");
+	check(encode("a..b") == 0, "empty label accepted");
+	make_name(name, 64);
+	name[63] = 'x';
+	check(encode(name) == 0, "64-character label accepted");
+
+	if (!failed)
+		printf("dnsstubtest: all encoder checks passed\n");
+
+	return failed;
+}
@@ -0,0 +1,716 @@
+/*
+ * These are the event-driven request routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "utils.h"
+#include "globals.h"
+#include "socket.h"
+#include "http.h"
+#include "auth.h"
+#include "connpool.h"
+#include "proxy.h"
+#include "engine.h"
+
+#define ENGINE_EVENTS	64
+#define ENGINE_BUFSIZE	16384
+
+/*
+ * Non-blocking alternative to forward_request() (RequestEngine events).
+ *
+ * A worker serves a request in a sequence of blocking calls. Here the same
+ * steps are explicit states of each client connection, and a single thread
+ * drives all of them with epoll:
+ *
+ *   E_REQUEST	read the request headers from the client
+ *   E_SEND	send the request to the parent, over a pooled connection
+ *   E_RESPONSE	read the response headers from the parent
+ *   E_REPLY	send them to the client
+ *   E_BODY	relay the response body
+ *
+ * after which the parent connection goes back to the pool and the client
+ * to E_REQUEST. Parent connections are only taken from the pool, already
+ * authenticated: proxy_authenticate() and everything else the engine does
+ * not handle (direct requests, CONNECT, request bodies, PAC cache misses,
+ * stale connections) is left to proxy_thread() on a worker, which gets
+ * the request as read so far and parks the client here again afterwards.
+ *
+ * The descriptors of a connection belong to the engine while it is here
+ * and are non-blocking in the meantime. Each connection waits for a single
+ * event at a time, registered one-shot.
+ */
+
+enum engine_state {
+	E_REQUEST,
+	E_SEND,
+	E_RESPONSE,
+	E_REPLY,
+	E_BODY
+};
+
+/*
+ * Where we are in a chunked body, see engine_chunks()
+ */
+enum chunk_state {
+	CH_SIZE,
+	CH_EXT,
+	CH_DATA,
+	CH_TRAILER,
+	CH_DONE
+};
+
+struct engine_conn_s {
+	enum engine_state state;
+	struct thread_arg_s *arg;		/* the client, arg->fd */
+	int sd;					/* parent connection or -1 */
+	int cd_added;				/* descriptors registered with epoll */
+	int sd_added;
+	struct connpool_s *pool;
+	struct auth_s *creds;
+	rr_data_t request;
+	rr_data_t response;
+	int keep_alive;				/* client asked for proxy keep-alive */
+	int proxy_alive;			/* parent connection can be pooled */
+	char *buf;				/* data to write, buf[pos..len) */
+	int len;
+	int pos;
+	length_t left;				/* body to relay, -1 until EOF */
+	int chunked;
+	enum chunk_state chunk;
+	length_t chunk_left;
+	int chunk_line;
+};
+
+static int epfd = -1;
+static unsigned long clients = 0;
+static unsigned long requests = 0;
+static unsigned long handoffs = 0;
+static int (*dispatch)(void *(*fn)(void *), void *arg) = NULL;
+static void *(*resume)(void *) = NULL;
+static int (*direct)(const char *hostname) = NULL;
+
+#ifdef __linux__
+static void engine_blocking(int fd, int blocking) {
+	int flags;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	if (flags >= 0)
+		fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+/*
+ * Wait for "events" on one of the connection's descriptors.
+ *
+ * Returns: 1 if OK, 0 on error
+ */
+static int engine_wait(struct engine_conn_s *c, int fd, uint32_t events) {
+	struct epoll_event ev;
+	int *added = (fd == c->sd ? &c->sd_added : &c->cd_added);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = c;
+
+	if (epoll_ctl(epfd, *added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev)) {
+		syslog(LOG_ERR, "Cannot watch descriptor %d: %s\n", fd, strerror(errno));
+		return 0;
+	}
+	*added = 1;
+
+	return 1;
+}
+
+static void engine_forget(int fd, int *added) {
+	if (*added) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		*added = 0;
+	}
+}
+
+/*
+ * Finish the current request: the parent connection goes back to its pool
+ * if "reuse" and it is still clean, otherwise it is closed.
+ */
+static void engine_release(struct engine_conn_s *c, int reuse) {
+	if (c->sd >= 0) {
+		engine_forget(c->sd, &c->sd_added);
+		if (reuse && !so_pending(c->sd) && !so_closed(c->sd)) {
+			engine_blocking(c->sd, 1);
+			connpool_put(c->pool, c->sd, c->creds);
+			c->creds = NULL;
+		} else {
+			so_close(c->sd);
+		}
+		c->sd = -1;
+	}
+
+	free(c->creds);
+	c->creds = NULL;
+	free(c->buf);
+	c->buf = NULL;
+	c->len = c->pos = 0;
+	free_rr_data(&c->response);
+}
+
+static void engine_close(struct engine_conn_s *c) {
+	engine_release(c, 0);
+	free_rr_data(&c->request);
+	engine_forget(c->arg->fd, &c->cd_added);
+	so_close(c->arg->fd);
+	free(c->arg);
+	free(c);
+	__atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Give the client to a worker, along with the request if we have read it
+ * already. The worker parks the client here again when it's done.
+ */
+static void engine_handoff(struct engine_conn_s *c) {
+	struct thread_arg_s *arg = c->arg;
+
+	engine_release(c, 0);
+	engine_forget(arg->fd, &c->cd_added);
+	engine_blocking(arg->fd, 1);
+	if (c->request && c->request->empty)
+		free_rr_data(&c->request);
+	arg->request = c->request;
+	free(c);
+	__atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&handoffs, 1, __ATOMIC_RELAXED);
+
+	if (debug)
+		printf("engine: handing client %d over to the workers\n", arg->fd);
+
+	if (dispatch(resume, arg)) {
+		syslog(LOG_ERR, "Cannot hand client %d over to the workers\n", arg->fd);
+		free_rr_data(&arg->request);
+		so_close(arg->fd);
+		free(arg);
+	}
+}
+
+/*
+ * The parent closed a pooled connection before replying. Like
+ * forward_request(), send the request again on a new one if that's safe.
+ */
+static void engine_retry(struct engine_conn_s *c) {
+	if (debug)
+		printf("engine: pooled connection %d is stale\n", c->sd);
+
+	if (http_idempotent(c->request))
+		engine_handoff(c);
+	else
+		engine_close(c);
+}
+
+/*
+ * Can we forward the request ourselves? Plain requests without a body,
+ * going to a parent proxy.
+ */
+static int engine_simple(rr_data_const_t request) {
+	const char *tmp;
+
+	if (CONNECT(request) || hlist_in(request->headers, "Transfer-Encoding")
+			|| hlist_in(request->headers, "Proxy-Authorization"))
+		return 0;
+
+	tmp = hlist_get(request->headers, "Content-Length");
+	if (tmp && atoll(tmp))
+		return 0;
+
+	return !direct(request->hostname);
+}
+
+/*
+ * Follow the chunked encoding through "len" bytes of the body, which are
+ * relayed as they are. We only need to know where the body ends.
+ *
+ * Returns: number of bytes up to the end of the body, -1 on format error
+ */
+static int engine_chunks(struct engine_conn_s *c, const char *p, int len) {
+	int i;
+	int n;
+
+	for (i = 0; i < len && c->chunk != CH_DONE; ++i) {
+		switch (c->chunk) {
+			case CH_DATA:
+				n = (int)MIN(c->chunk_left, (length_t)(len - i));
+				c->chunk_left -= n;
+				i += n - 1;
+				if (!c->chunk_left)
+					c->chunk = CH_SIZE;
+				break;
+			case CH_SIZE:
+				if (p[i] >= '0' && p[i] <= '9')
+					n = p[i] - '0';
+				else if ((p[i] | 0x20) >= 'a' && (p[i] | 0x20) <= 'f')
+					n = (p[i] | 0x20) - 'a' + 10;
+				else
+					n = -1;
+
+				if (n >= 0) {
+					if (c->chunk_left >= ((length_t)1 << 56))
+						return -1;
+					c->chunk_left = c->chunk_left * 16 + n;
+					c->chunk_line++;
+					break;
+				}
+				if (!c->chunk_line)
+					return -1;
+				c->chunk = CH_EXT;
+				/* fall through */
+			case CH_EXT:
+				if (p[i] == '\n') {
+					if (c->chunk_left) {
+						c->chunk_left += 2;	/* CRLF after the data */
+						c->chunk = CH_DATA;
+					} else {
+						c->chunk = CH_TRAILER;
+					}
+					c->chunk_line = 0;
+				}
+				break;
+			case CH_TRAILER:
+				if (p[i] == '\n') {
+					if (!c->chunk_line)
+						c->chunk = CH_DONE;
+					c->chunk_line = 0;
+				} else if (p[i] != '\r') {
+					c->chunk_line++;
+				}
+				break;
+			case CH_DONE:
+				break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Prepare the request we just read, unless a worker has to take it.
+ *
+ * Returns: 1 to go on with E_SEND, 0 if the client is gone
+ */
+static int engine_request(struct engine_conn_s *c) {
+	char saddr[INET6_ADDRSTRLEN] = {0};
+	hlist_const_t tl;
+
+	c->keep_alive = hlist_subcmp(c->request->headers, "Proxy-Connection", "keep-alive");
+	if (!engine_simple(c->request)) {
+		engine_handoff(c);
+		return 0;
+	}
+
+	c->creds = new_auth();
+	c->sd = proxy_pooled(c->creds, c->request->url, c->request->hostname, &c->pool);
+	if (c->sd < 0) {
+		engine_handoff(c);
+		return 0;
+	}
+	engine_blocking(c->sd, 0);
+
+	INET_NTOP(&c->arg->addr, saddr, INET6_ADDRSTRLEN);
+	syslog(LOG_DEBUG, "%s %s %s", saddr, c->request->method, c->request->url);
+
+	/*
+	 * Same changes as forward_request() makes
+	 */
+	for (tl = header_list; tl; tl = tl->next)
+		c->request->headers = hlist_mod(c->request->headers, tl->key, tl->value, 1);
+	if (c->request->http_version >= 11)
+		c->request->headers = hlist_mod(c->request->headers, "Proxy-Connection", "keep-alive", 1);
+
+	if (debug)
+		printf("engine: %s %s from client %d over %d\n", c->request->method, c->request->url, c->arg->fd, c->sd);
+
+	c->len = headers_format(c->request, &c->buf);
+	c->pos = 0;
+	c->state = E_SEND;
+
+	return 1;
+}
+
+/*
+ * Prepare the response headers for the client.
+ *
+ * Returns: 1 to go on with E_REPLY, 0 if the client is gone
+ */
+static int engine_response(struct engine_conn_s *c) {
+	rr_data_t response = c->response;
+
+	/*
+	 * The pooled connection isn't authenticated anymore, a worker will
+	 * make a new one
+	 */
+	if (response->code == 407) {
+		engine_handoff(c);
+		return 0;
+	}
+
+	if (!hlist_subcmp(response->headers, "Connection", "keep-alive"))
+		response->headers = hlist_mod(response->headers, "Connection", "close", 1);
+	while (hlist_get(response->headers, "Proxy-Authenticate"))
+		response->headers = hlist_del(response->headers, "Proxy-Authenticate");
+
+	c->proxy_alive = hlist_subcmp(response->headers, "Proxy-Connection", "keep-alive")
+		&& c->request->http_version >= 11;
+
+	c->left = http_has_body(c->request, response);
+	c->chunked = c->left && hlist_subcmp(response->headers, "Transfer-Encoding", "chunked");
+	c->chunk = CH_SIZE;
+	c->chunk_left = 0;
+	c->chunk_line = 0;
+
+	c->len = headers_format(response, &c->buf);
+	c->pos = 0;
+	c->state = E_REPLY;
+
+	return 1;
+}
+
+/*
+ * The response is through. Pool the parent connection and wait for the
+ * next request, unless either side is closing.
+ *
+ * Returns: 1 to go on with E_REQUEST, 0 if the client is gone
+ */
+static int engine_next(struct engine_conn_s *c) {
+	int alive = c->keep_alive && c->proxy_alive;
+
+	__atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED);
+	engine_release(c, c->proxy_alive);
+	free_rr_data(&c->request);
+
+	if (!alive) {
+		engine_close(c);
+		return 0;
+	}
+	c->state = E_REQUEST;
+
+	return 1;
+}
+
+/*
+ * Write out buf[pos..len) to "fd".
+ *
+ * Returns: 1 when done, 0 to wait, -1 on error
+ */
+static int engine_write(struct engine_conn_s *c, int fd) {
+	int n;
+
+	while (c->pos < c->len) {
+		n = write(fd, c->buf + c->pos, c->len - c->pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return engine_wait(c, fd, EPOLLOUT) ? 0 : -1;
+		if (n <= 0)
+			return -1;
+		c->pos += n;
+	}
+
+	return 1;
+}
+
+/*
+ * Read a header block from "fd" into "data". so_fill() collects it in the
+ * read buffer across wakeups, headers_recv() only parses it.
+ *
+ * Returns: 1 when done, 0 to wait, -1 on error, -2 if the peer closed
+ * the connection before sending anything and -3 if the client's headers
+ * are too long for the read buffer
+ */
+static int engine_headers(struct engine_conn_s *c, int fd, rr_data_t data) {
+	int n;
+
+	while (!so_headready(fd)) {
+		n = so_fill(fd);
+		if (n > 0 || (n == -1 && errno == EINTR))
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			return engine_wait(c, fd, EPOLLIN | EPOLLRDHUP) ? 0 : -1;
+		if (n != -2)
+			return !so_pending(fd) && (n == 0 || errno == ECONNRESET) ? -2 : -1;
+
+		/*
+		 * Over SO_HEADMAX. A worker can wait for the rest of a client's
+		 * headers, but the parent has already got the request.
+		 */
+		if (fd == c->arg->fd)
+			return -3;
+		syslog(LOG_ERR, "Response headers from the parent are too long\n");
+		return -1;
+	}
+
+	return headers_recv(fd, data) ? 1 : -1;
+}
+
+/*
+ * Relay the response body.
+ *
+ * Returns: 1 when done, 0 to wait, -1 on error
+ */
+static int engine_body(struct engine_conn_s *c) {
+	int cd = c->arg->fd;
+	int n;
+	int m;
+
+	for (;;) {
+		n = engine_write(c, cd);
+		if (n <= 0)
+			return n;
+
+		if (c->chunked ? c->chunk == CH_DONE : c->left == 0)
+			return 1;
+
+		n = so_read(c->sd, c->buf, (c->left > 0 && !c->chunked) ? (int)MIN(c->left, ENGINE_BUFSIZE) : ENGINE_BUFSIZE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return engine_wait(c, c->sd, EPOLLIN | EPOLLRDHUP) ? 0 : -1;
+		if (n == 0 && c->left < 0 && !c->chunked) {
+			/*
+			 * Body until EOF, the connection is done
+			 */
+			c->proxy_alive = 0;
+			c->left = 0;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+
+		if (c->chunked) {
+			m = engine_chunks(c, c->buf, n);
+			if (m < 0)
+				return -1;
+			if (m < n)
+				c->proxy_alive = 0;
+			n = m;
+		} else if (c->left > 0) {
+			c->left -= n;
+		}
+
+		c->len = n;
+		c->pos = 0;
+	}
+}
+
+/*
+ * Move the connection on as far as it goes without blocking.
+ */
+static void engine_run(struct engine_conn_s *c) {
+	int cd = c->arg->fd;
+	int rc = 1;
+
+	while (rc > 0) {
+		switch (c->state) {
+			case E_REQUEST:
+				if (!c->request)
+					c->request = new_rr_data();
+				rc = engine_headers(c, cd, c->request);
+				if (rc == -3) {
+					engine_handoff(c);
+					return;
+				}
+				if (rc > 0 && !engine_request(c))
+					return;
+				break;
+			case E_SEND:
+				rc = engine_write(c, c->sd);
+				if (rc > 0) {
+					free(c->buf);
+					c->buf = NULL;
+					c->response = new_rr_data();
+					c->state = E_RESPONSE;
+				} else if (rc < 0) {
+					engine_retry(c);
+					return;
+				}
+				break;
+			case E_RESPONSE:
+				rc = engine_headers(c, c->sd, c->response);
+				if (rc == -2) {
+					engine_retry(c);
+					return;
+				}
+				if (rc > 0 && !engine_response(c))
+					return;
+				break;
+			case E_REPLY:
+				rc = engine_write(c, cd);
+				if (rc > 0) {
+					free(c->buf);
+					c->buf = c->left ? zmalloc(ENGINE_BUFSIZE) : NULL;
+					c->len = c->pos = 0;
+					c->state = E_BODY;
+				}
+				break;
+			case E_BODY:
+				rc = engine_body(c);
+				if (rc > 0 && !engine_next(c))
+					return;
+				break;
+		}
+	}
+
+	if (rc < 0)
+		engine_close(c);
+}
+
+static void *engine_thread(void *unused) {
+	struct epoll_event events[ENGINE_EVENTS];
+	int i;
+	int n;
+
+	(void)unused;
+	for (;;) {
+		n = epoll_wait(epfd, events, ENGINE_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Serious error during engine epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; ++i)
+			engine_run((struct engine_conn_s *)events[i].data.ptr);
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Start the engine thread. Requests it can't serve go to fn() (which
+ * must read arg->request first, if set) through "submit", which must
+ * behave like workers_submit(). "direct" tells the hosts not to forward.
+ *
+ * Returns: 1 if the engine is available, 0 otherwise.
+ */
+int engine_start(int (*submit)(void *(*fn)(void *), void *arg), void *(*fn)(void *), int (*match)(const char *hostname)) {
+#ifdef __linux__
+	pthread_attr_t attr;
+	pthread_t pthr;
+	int rc;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		syslog(LOG_ERR, "Cannot create epoll instance for the request engine: %s\n", strerror(errno));
+		return 0;
+	}
+	dispatch = submit;
+	resume = fn;
+	direct = match;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&pthr, &attr, engine_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		syslog(LOG_ERR, "Cannot start request engine thread: %d\n", rc);
+		close(epfd);
+		epfd = -1;
+		return 0;
+	}
+
+	return 1;
+#else
+	(void)submit;
+	(void)fn;
+	(void)match;
+	syslog(LOG_WARNING, "The event-driven request engine is supported only on Linux\n");
+	return 0;
+#endif
+}
+
+int engine_enabled(void) {
+	return epfd >= 0;
+}
+
+/*
+ * Take over the client arg->fd, until it sends a request the workers have
+ * to serve. Data already read ahead wouldn't wake us, caller has to check
+ * so_pending() first.
+ *
+ * Returns: 1 if taken (arg now belongs to the engine), 0 if the caller
+ * has to keep serving the client itself.
+ */
+int engine_park(struct thread_arg_s *arg) {
+#ifdef __linux__
+	struct engine_conn_s *c;
+	struct epoll_event ev;
+	int fd = arg->fd;
+
+	if (epfd < 0)
+		return 0;
+
+	c = (struct engine_conn_s *)zmalloc(sizeof(struct engine_conn_s));
+	c->state = E_REQUEST;
+	c->arg = arg;
+	c->sd = -1;
+	engine_blocking(fd, 0);
+
+	/*
+	 * Count and mark it first, the event may fire before epoll_ctl()
+	 * returns
+	 */
+	c->cd_added = 1;
+	__atomic_add_fetch(&clients, 1, __ATOMIC_RELAXED);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		__atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+		if (debug)
+			printf("engine: cannot take client %d: %s\n", fd, strerror(errno));
+		engine_blocking(fd, 1);
+		free(c);
+		return 0;
+	}
+
+	return 1;
+#else
+	(void)arg;
+	return 0;
+#endif
+}
+
+void engine_stats(struct engine_stats_s *stats) {
+	stats->clients = __atomic_load_n(&clients, __ATOMIC_RELAXED);
+	stats->requests = __atomic_load_n(&requests, __ATOMIC_RELAXED);
+	stats->handoffs = __atomic_load_n(&handoffs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,36 @@
+/*
+ * These are the event-driven request routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _ENGINE_H
+#define _ENGINE_H
+
+#include "utils.h"
+
+struct engine_stats_s {
+	unsigned long clients;		/* served by the engine right now */
+	unsigned long requests;		/* forwarded by the engine */
+	unsigned long handoffs;		/* requests given to the workers */
+};
+
+extern int engine_start(int (*submit)(void *(*fn)(void *), void *arg), void *(*fn)(void *), int (*direct)(const char *hostname));
+extern int engine_enabled(void);
+extern int engine_park(struct thread_arg_s *arg);
+extern void engine_stats(struct engine_stats_s *stats);
+
+#endif /* _ENGINE_H */
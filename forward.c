@@ -37,6 +37,9 @@
 #include "socket.h"
 #include "forward.h"
 #include "scanner.h"
+#include "idle.h"
+#include "engine.h"
+#include "connpool.h"
 #include "pages.h"
 #include "proxy.h"
 
@@ -74,7 +77,6 @@
  * pac_aux is NOT freed
  */
 rr_data_t forward_request(void *thread_data, rr_data_t request) {
-	int i;
 	int loop;
 	int plugin;
 	int retry = 0;
@@ -91,6 +93,9 @@ rr_data_t forward_request(void *thread_data, rr_data_t request) {
 	int authok;
 	int noauth;
 	int was_cached;
+	int reused;
+	int parkable;
+	struct connpool_s *pool;
 
 	int sd;
 	assert(thread_data != NULL);
@@ -98,8 +103,12 @@ rr_data_t forward_request(void *thread_data, rr_data_t request) {
 	char saddr[INET6_ADDRSTRLEN] = {0};
 	INET_NTOP(&((struct thread_arg_s *)thread_data)->addr, saddr, INET6_ADDRSTRLEN);
 
+	parkable = (idle_enabled() || engine_enabled()) && !ntlmbasic
+		&& hlist_subcmp(request->headers, "Proxy-Connection", "keep-alive");
+
 beginning:
 	sd = 0;
+	pool = NULL;
 	was_cached = noauth = authok = conn_alive = proxy_alive = 0;
 
 	rsocket[0] = wsocket[1] = &cd;
@@ -107,43 +116,34 @@ beginning:
 
 	if (debug) {
 		printf("Thread processing%s...\n", retry ? " (retry)" : "");
-		pthread_mutex_lock(&connection_mtx);
-		plist_dump(connection_list);
-		pthread_mutex_unlock(&connection_mtx);
+		connpool_dump();
 	}
 
 	/*
 	 * NTLM credentials for purposes of this thread (tcreds) are given to
-	 * us by proxy_connect() or retrieved from connection cache.
+	 * us by proxy_connect(), either fresh or along with an authenticated
+	 * connection from the pool of the selected parent.
 	 *
 	 * Ultimately, the source for creds is always proxy_connect(), but when
-	 * we cache a connection, we store creds associated with it in the
-	 * cache as well, in case we'll need them.
+	 * we pool a connection, we store creds associated with it in the
+	 * pool as well, in case we'll need them.
 	 */
-	pthread_mutex_lock(&connection_mtx);
-	i = plist_pop(&connection_list, (void **)&tcreds);
-	pthread_mutex_unlock(&connection_mtx);
-	if (i) {
-		if (debug)
-			printf("Found authenticated connection %d!\n", i);
-		sd = i;
-		authok = 1;
-		was_cached = 1;
-	} else {
-		tcreds = new_auth();
-		sd = proxy_connect(tcreds, request->url, request->hostname);
-		if (sd == -2) {
-			rc = (void *)-2;
-			goto bailout;
-		}
-		if (sd < 0) {
-			tmp = gen_502_page(request->http, "Parent proxy unreachable");
-			(void) write_wrapper(cd, tmp, strlen(tmp));
-			free(tmp);
-			rc = (void *)-1;
-			goto bailout;
-		}
+	tcreds = new_auth();
+	sd = proxy_connect(tcreds, request->url, request->hostname, &pool, &was_cached);
+	if (sd == -2) {
+		rc = (void *)-2;
+		goto bailout;
 	}
+	if (sd < 0) {
+		tmp = gen_502_page(request->http, "Parent proxy unreachable");
+		(void) write_wrapper(cd, tmp, strlen(tmp));
+		free(tmp);
+		rc = (void *)-1;
+		goto bailout;
+	}
+	if (was_cached)
+		authok = 1;
+	reused = was_cached;
 
 	/*
 	 * Each thread only serves req's for one hostname. If hostname changes,
@@ -195,12 +195,32 @@ beginning:
 					printf("Reading headers (%d)...\n", *rsocket[loop]);
 				}
 				if (!headers_recv(*rsocket[loop], data[loop])) {
+					/*
+					 * A pooled connection the parent closed before the reaper
+					 * noticed: closed or reset before any response byte. Retry
+					 * on another one, but only if the request is idempotent
+					 * and has no body (that one is gone).
+					 */
+					if (loop == 1 && reused && data[1]->closed && http_idempotent(data[0])
+							&& !http_has_body(data[0], NULL)) {
+						if (debug)
+							printf("\nPooled connection %d is stale - retrying.\n", sd);
+						free(tcreds);
+
+						retry = 1;
+						request = data[0];
+						free_rr_data(&data[1]);
+						so_close(sd);
+						goto beginning;
+					}
 					free_rr_data(&data[0]);
 					free_rr_data(&data[1]);
 					rc = (void *)-1;
 					/* error page */
 					goto bailout;
 				}
+				if (loop == 1)
+					reused = 0;
 			}
 
 			/*
@@ -345,7 +365,7 @@ shortcut:
 				retry = 1;
 				request = data[0];
 				free_rr_data(&data[1]);
-				close(sd);
+				so_close(sd);
 				goto beginning;
 			}
 
@@ -408,8 +428,19 @@ shortcut:
 				 * Forward client's headers to the proxy and vice versa; proxy_authenticate()
 				 * might have by now prepared 1st and 2nd auth steps and filled our headers with
 				 * the 3rd, final, NTLM message.
+				 *
+				 * Unless a CONNECT might turn into a tunnel below, the body goes
+				 * right after the headers, starting in the same write.
 				 */
-				if (!headers_send(*wsocket[loop], data[loop])) {
+				if ((plugin & PLUG_SENDDATA) && !CONNECT(data[0])) {
+					if (!http_message_send(*wsocket[loop], *rsocket[loop], data[loop], data[0], data[1])) {
+						free_rr_data(&data[0]);
+						free_rr_data(&data[1]);
+						rc = (void *)-1;
+						goto bailout;
+					}
+					plugin &= ~PLUG_SENDDATA;
+				} else if (!headers_send(*wsocket[loop], data[loop])) {
 					free_rr_data(&data[0]);
 					free_rr_data(&data[1]);
 					rc = (void *)-1;
@@ -471,7 +502,13 @@ shortcut:
 	 * Checking conn_alive && proxy_alive is sufficient,
 	 * so_closed() just eliminates loops that we know would fail.
 	 */
-	} while (conn_alive && proxy_alive && !so_closed(sd) && !so_closed(cd) && !serialize);
+	/*
+	 * When idle clients are parked, don't block on the client holding the
+	 * parent connection, return and let it go to the cache instead. Our
+	 * caller parks the client only if it asked for proxy keep-alive.
+	 */
+	} while (conn_alive && proxy_alive && !so_closed(sd) && !so_closed(cd) && !serialize
+			&& (!parkable || so_dataready(cd)));
 
 bailout:
 	if (hostname)
@@ -485,13 +522,11 @@ bailout:
 	if (proxy_alive && authok && !ntlmbasic && !so_closed(sd)) {
 		if (debug)
 			printf("Storing the connection for reuse (%d:%d).\n", cd, sd);
-		pthread_mutex_lock(&connection_mtx);
-		connection_list = plist_add(connection_list, sd, (void *)tcreds);
-		pthread_mutex_unlock(&connection_mtx);
+		connpool_put(pool, sd, tcreds);
 	} else {
 		free(tcreds);
 		if (sd >= 0) {
-			close(sd);
+			so_close(sd);
 		}
 	}
 
@@ -517,10 +552,10 @@ int prepare_http_connect(int sd, struct auth_s *credentials, const char *thost)
 	data2 = new_rr_data();
 
 	data1->req = 1;
-	data1->method = strdup("CONNECT");
-	data1->url = strdup(thost);
-	data1->http = strdup("HTTP/1.1");
-	data1->headers = hlist_mod(data1->headers, "Proxy-Connection", "keep-alive", 1);
+	data1->method = rr_strdup(data1, "CONNECT");
+	data1->url = rr_strdup(data1, thost);
+	data1->http = rr_strdup(data1, "HTTP/1.1");
+	data1->headers = hlist_add_arena(data1->headers, &data1->arena, "Proxy-Connection", "keep-alive", HLIST_ALLOC);
 
 	/*
 	 * Header replacement
@@ -590,7 +625,7 @@ int forward_tunnel(void *thread_data) {
 	INET_NTOP(&((struct thread_arg_s *)thread_data)->addr, saddr, INET6_ADDRSTRLEN);
 
 	tcreds = new_auth();
-	sd = proxy_connect(tcreds, "/", thost);
+	sd = proxy_connect(tcreds, "/", thost, NULL, NULL);
 
 	if (sd < 0)
 		goto bailout;
@@ -605,10 +640,10 @@ int forward_tunnel(void *thread_data) {
 
 bailout:
 	if (sd >= 0) {
-		close(sd);
+		so_close(sd);
 	}
 	if (sd != -2) {
-		close(cd);
+		so_close(cd);
 	}
 	free(tcreds);
 
@@ -664,12 +699,12 @@ void magic_auth_detect(const char *url) {
 		req = new_rr_data();
 
 		req->req = 1;
-		req->method = strdup("GET");
-		req->url = strdup(url);
-		req->http = strdup("HTTP/1.1");
-		req->headers = hlist_add(req->headers, "Proxy-Connection", "keep-alive", HLIST_ALLOC, HLIST_ALLOC);
+		req->method = rr_strdup(req, "GET");
+		req->url = rr_strdup(req, url);
+		req->http = rr_strdup(req, "HTTP/1.1");
+		req->headers = hlist_add_arena(req->headers, &req->arena, "Proxy-Connection", "keep-alive", HLIST_ALLOC);
 		if (host)
-			req->headers = hlist_add(req->headers, "Host", host, HLIST_ALLOC, HLIST_ALLOC);
+			req->headers = hlist_add_arena(req->headers, &req->arena, "Host", host, HLIST_ALLOC);
 
 		tcreds->hashnt = prefs[i][0];
 		tcreds->hashlm = prefs[i][1];
@@ -678,7 +713,7 @@ void magic_auth_detect(const char *url) {
 
 		printf("Config profile %2d/%d... ", i+1, MAGIC_TESTS);
 
-		nc = proxy_connect(NULL, url, host);
+		nc = proxy_connect(NULL, url, host, NULL, NULL);
 		if (nc < 0) {
 			printf("\nConnection to proxy failed, bailing out\n");
 			free_rr_data(&res);
@@ -694,7 +729,7 @@ void magic_auth_detect(const char *url) {
 			printf("Auth not required (HTTP code: %d)\n", res->code);
 			free_rr_data(&res);
 			free_rr_data(&req);
-			close(nc);
+			so_close(nc);
 			continue;
 		}
 
@@ -717,7 +752,7 @@ void magic_auth_detect(const char *url) {
 					found = i;
 					free_rr_data(&res);
 					free_rr_data(&req);
-					close(nc);
+					so_close(nc);
 					break;
 				}
 			}
@@ -725,7 +760,7 @@ void magic_auth_detect(const char *url) {
 
 		free_rr_data(&res);
 		free_rr_data(&req);
-		close(nc);
+		so_close(nc);
 	}
 
 	if (found > -1) {
@@ -40,12 +40,7 @@ extern int ntlmbasic;				/* forward_request() */
 extern int serialize;
 extern int scanner_plugin;
 extern long scanner_plugin_maxsize;
-
-extern plist_t threads_list;
-extern pthread_mutex_t threads_mtx;
-
-extern plist_t connection_list;
-extern pthread_mutex_t connection_mtx;
+extern int connect_timeout;			/* so_connect() callers */
 
 extern int pac_initialized;
 
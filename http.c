@@ -19,10 +19,17 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE				/* splice() */
+#endif
+
 #include <sys/types.h>
-#include <sys/select.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <ctype.h>
+#include <limits.h>
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
@@ -36,8 +43,16 @@
 #include "socket.h"
 #include "ntlm.h"
 #include "http.h"
+#ifdef ENABLE_IO_URING
+#include "uring.h"
+#endif
 
 #define BLOCK		2048
+#define SPLICE_BLOCK	65536
+
+#ifndef IOV_MAX
+#define IOV_MAX		16
+#endif
 
 extern int debug;
 
@@ -79,45 +94,94 @@ char *get_http_header_value(const char *src) {
 		return NULL;
 }
 
+/*
+ * Cut the line starting at "line" off the header block, dropping CRLF and
+ * any trailing whitespace.
+ *
+ * Returns: start of the next line, or NULL if this one was the last.
+ */
+static char *header_line(char *line) {
+	char *next;
+	char *end;
+
+	next = strchr(line, '\n');
+	end = (next ? next : line + strlen(line));
+	while (end > line && isspace((unsigned char)end[-1]))
+		end--;
+	*end = 0;
+
+	return (next ? next + 1 : NULL);
+}
+
+/*
+ * strtok_r(s, " ") look-alike for header_line()'s result, except that
+ * *s isn't advanced past the end of the line.
+ */
+static char *header_token(char **s) {
+	char *tok = *s;
+	char *end;
+
+	while (*tok == ' ')
+		tok++;
+	if (!*tok) {
+		*s = tok;
+		return NULL;
+	}
+
+	end = tok + strcspn(tok, " ");
+	if (*end)
+		*end++ = 0;
+	*s = end;
+
+	return tok;
+}
+
 /*
  * Receive HTTP request/response from the given socket. Fill in pre-allocated
  * rr_data_t structure.
- * Returns: 1 if OK, 0 in case of socket EOF or other error
+ *
+ * The whole header block is received into the arena of "data" at once and
+ * parsed in a single pass, in place: the fields and headers point right into
+ * it, only the host name and a missing Host header are copied.
+ *
+ * Returns: 1 if OK, 0 in case of socket EOF or other error. If the peer
+ * closed or reset the connection before sending anything, data->closed is
+ * set.
  */
 int headers_recv(int fd, rr_data_t data) {
 	int i;
-	int bsize;
-	int len;
 	int is_http = 0;
-	char *buf;
+	int has_http;
+	char *head;
+	char *line;
+	char *next;
 	char *tok;
-	char *s3 = NULL;
-	char *orig = NULL;
-	char *ccode = NULL;
+	char *s3;
+	char *ccode;
 	char *host = NULL;
 
-	bsize = BUFSIZE;
-	buf = zmalloc(bsize);
-
-	i = so_recvln(fd, &buf, &bsize);
-	if (i <= 0)
+	i = so_recvhead(fd, &data->arena, &head);
+	if (i <= 0) {
+		data->closed = !i;
 		goto bailout;
+	}
+
+	line = head;
+	next = header_line(line);
 
 	if (debug)
-		printf("HEAD: %s", buf);
+		printf("HEAD: %s\n", line);
 
 	/*
 	 * Are we reading HTTP request (from client) or response (from server)?
 	 */
-	trimr(buf);
-	orig = strdup(buf);
-	len = strlen(buf);
-	tok = strtok_r(buf, " ", &s3);
+	has_http = (strstr(line, " HTTP/") != NULL);
+	s3 = line;
+	tok = header_token(&s3);
 	if (tok && ((is_http = !strncasecmp(tok, "HTTP/", 5)) || !strncasecmp(tok, "ICY", 3))) {
 		data->req = 0;
 		data->empty = 0;
-		data->http = strdup(tok);
-		data->msg = NULL;
+		data->http = tok;
 
 		/*
 		 * Let's find out the numeric version of the HTTP version: 09, 10, 11.
@@ -129,42 +193,21 @@ int headers_recv(int fd, rr_data_t data) {
 			data->http_version = -1;
 		}
 
-		tok = strtok_r(NULL, " ", &s3);
-		if (tok) {
-			ccode = strdup(tok);
-
-			tok += strlen(ccode);
-			while (tok < buf+len && *tok++ == ' ');
-
-			if (strlen(tok))
-				data->msg = strdup(tok);
-		}
-
-		if (!data->msg)
-			data->msg = strdup("");
+		ccode = header_token(&s3);
+		while (*s3 == ' ')
+			s3++;
+		data->msg = s3;
 
 		if (!ccode || strlen(ccode) != 3 || (data->code = atoi(ccode)) == 0) {
 			i = -2;
 			goto bailout;
 		}
-	} else if (strstr(orig, " HTTP/") && tok) {
+	} else if (has_http && tok) {
 		data->req = 1;
 		data->empty = 0;
-		data->method = NULL;
-		data->url = NULL;
-		data->rel_url = NULL;
-		data->http = NULL;
-		data->hostname = NULL;
-
-		data->method = strdup(tok);
-
-		tok = strtok_r(NULL, " ", &s3);
-		if (tok)
-			data->url = strdup(tok);
-
-		tok = strtok_r(NULL, " ", &s3);
-		if (tok)
-			data->http = strdup(tok);
+		data->method = tok;
+		data->url = header_token(&s3);
+		data->http = header_token(&s3);
 
 		if (!data->url || !data->http) {
 			i = -3;
@@ -187,32 +230,41 @@ int headers_recv(int fd, rr_data_t data) {
 			tok = data->url;
 		}
 
+		/*
+		 * The relative URL is the tail of the URL, host needs a copy
+		 */
 		s3 = strchr(tok, '/');
 		if (s3) {
-			host = substr(tok, 0, s3-tok);
-			data->rel_url = strdup(s3);
+			host = arena_strndup(&data->arena, tok, s3-tok);
+			data->rel_url = s3;
 		} else {
-			host = substr(tok, 0, strlen(tok));
-			data->rel_url = strdup("/");
+			host = arena_strndup(&data->arena, tok, strlen(tok));
+			data->rel_url = rr_strdup(data, "/");
 		}
 
 	} else {
 		if (debug)
-			printf("headers_recv: Unknown header (%s).\n", orig);
+			printf("headers_recv: Unknown header (%s).\n", line);
 		i = -4;
 		goto bailout;
 	}
 
 	/*
-	 * Read in all headers, do not touch any possible HTTP body
+	 * Now the headers, up to the empty line
 	 */
-	do {
-		i = so_recvln(fd, &buf, &bsize);
-		trimr(buf);
-		if (i > 0 && is_http_header(buf)) {
-			data->headers = hlist_add(data->headers, get_http_header_name(buf), get_http_header_value(buf), HLIST_NOALLOC, HLIST_NOALLOC);
+	while (next) {
+		line = next;
+		next = header_line(line);
+		if (!*line)
+			break;
+
+		if ((tok = strchr(line, ':'))) {
+			*tok++ = 0;
+			while (*tok == ' ')
+				tok++;
+			data->headers = hlist_add_arena(data->headers, &data->arena, line, tok, HLIST_NOALLOC);
 		}
-	} while (strlen(buf) != 0 && i > 0);
+	}
 
 	if (data->req) {
 		/*
@@ -220,28 +272,26 @@ int headers_recv(int fd, rr_data_t data) {
 		 */
 		if (host && strlen(host)) {
 			if (!hlist_get(data->headers, "Host"))
-				data->headers = hlist_add(data->headers, "Host", host, HLIST_ALLOC, HLIST_ALLOC);
+				data->headers = hlist_add_arena(data->headers, &data->arena, "Host", host, HLIST_ALLOC);
 		} else {
 			if (debug)
-				printf("headers_recv: no host name (%s)\n", orig);
+				printf("headers_recv: no host name (%s)\n", data->url);
 			i = -6;
 			goto bailout;
 		}
 
-
-		if (host[0] == '[') {
-			tok = strchr(host, ']');
+		if (host[0] == '[' && (tok = strchr(host, ']'))) {
 			*tok = 0;
-			data->hostname = strdup(host+1);
+			data->hostname = host+1;
 			if (*(tok+1) == ':') {
 				data->port = atoi(tok+2);
 			}
 		} else if ((tok = strchr(host, ':'))) {
 			*tok = 0;
-			data->hostname = strdup(host);
+			data->hostname = host;
 			data->port = atoi(tok+1);
 		} else {
-			data->hostname = strdup(host);
+			data->hostname = host;
 		}
 
 		if (!data->port) {
@@ -260,11 +310,6 @@ int headers_recv(int fd, rr_data_t data) {
 	}
 
 bailout:
-	if (orig) free(orig);
-	if (ccode) free(ccode);
-	if (host) free(host);
-	free(buf);
-
 	if (i <= 0) {
 		if (debug)
 			printf("headers_recv: fd %d error %d\n", fd, i);
@@ -275,76 +320,272 @@ bailout:
 }
 
 /*
- * Send HTTP request/response to the given socket based on what's in "data".
+ * Write the whole iovec array, resuming after short writes. The array
+ * is modified in the process.
+ *
  * Returns: 1 if OK, 0 in case of socket error
  */
-int headers_send(int fd, rr_data_const_t data) {
+static int writev_all(int fd, struct iovec *iov, int count) {
+	ssize_t i;
+
+	while (count > 0) {
+		i = writev(fd, iov, MIN(count, IOV_MAX));
+		if (i < 0 && errno == EINTR)
+			continue;
+		if (i <= 0) {
+			if (i < 0)
+				syslog(LOG_ERR, "writev() failed with error %d: %s\n", errno, strerror(errno));
+			return 0;
+		}
+
+		while (count > 0 && (size_t)i >= iov->iov_len) {
+			i -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + i;
+			iov->iov_len -= i;
+		}
+	}
+
+	return 1;
+}
+
+#define IOV_SET(v, s, l)	do { (v)->iov_base = (void *)(s); (v)->iov_len = (l); (v)++; } while (0)
+#define IOV_STR(v, s)		IOV_SET(v, s, strlen(s))
+
+/*
+ * Describe the header block of "data" as an iovec array, pointing right
+ * into "data" (and "code", a buffer of 16 bytes for the status code). The
+ * array has one more entry, left for the caller.
+ *
+ * Returns: the array (to be freed), number of used entries in *count
+ */
+static struct iovec *headers_iovec(rr_data_const_t data, char *code, int *count) {
 	hlist_const_t t;
-	char *buf;
-	int i;
-	int len;
+	struct iovec *iov;
+	struct iovec *v;
+	int n;
 
 	/*
-	 * First compute required buffer size (avoid realloc, etc)
+	 * Six pieces for the first line, four per header, one terminator
+	 * and one spare
 	 */
-	if (data->req)
-		len = 20 + strlen(data->method) + strlen(data->url) + strlen(data->http);
-	else
-		len = 20 + strlen(data->http) + strlen(data->msg);
+	n = 8;
+	for (t = data->headers; t; t = t->next)
+		n += 4;
+
+	iov = (struct iovec *)zmalloc(n * sizeof(struct iovec));
+	v = iov;
 
-	t = data->headers;
-	while (t) {
-		len += 20 + strlen(t->key) + strlen(t->value);
-		t = t->next;
+	if (data->req) {
+		IOV_STR(v, data->method);
+		IOV_SET(v, " ", 1);
+		IOV_STR(v, data->url);
+		IOV_SET(v, " ", 1);
+		IOV_STR(v, data->http);
+		IOV_SET(v, "\r\n", 2);
+	} else if (!data->skip_http) {
+		snprintf(code, 16, " %03d ", data->code);
+		IOV_STR(v, data->http);
+		IOV_STR(v, code);
+		IOV_STR(v, data->msg);
+		IOV_SET(v, "\r\n", 2);
 	}
 
-	/*
-	 * We know how much memory we need now...
-	 */
-	const int buf_len = len;
-	buf = zmalloc(buf_len);
+	for (t = data->headers; t; t = t->next) {
+		IOV_STR(v, t->key);
+		IOV_SET(v, ": ", 2);
+		IOV_STR(v, t->value);
+		IOV_SET(v, "\r\n", 2);
+	}
+
+	IOV_SET(v, "\r\n", 2);
+	*count = v - iov;
+
+	return iov;
+}
+
+/*
+ * Send HTTP request/response to the given socket based on what's in "data",
+ * followed by up to "len" bytes of body which were already read ahead from
+ * "src" together with its headers (src == -1 or len == 0 means none; len
+ * == -1 means all of them). Everything goes out in a single writev(), the
+ * headers are not formatted into an intermediate buffer.
+ *
+ * Returns: number of body bytes sent, -1 in case of socket error
+ */
+length_t headers_send_body(int fd, rr_data_const_t data, int src, length_t len) {
+	struct iovec *iov;
+	struct iovec *v;
+	char code[16];
+	char body[BUFSIZE];
+	length_t sent = 0;
+	int count;
+	int i;
+
+	iov = headers_iovec(data, code, &count);
+	v = iov + count;
 
 	/*
-	 * Prepare the first request/response line
+	 * Piggyback the beginning of the body, if we already have it
 	 */
+	if (src >= 0 && len && so_pending(src) > 0) {
+		i = so_read(src, body, len < 0 ? BUFSIZE : MIN(len, BUFSIZE));
+		if (i > 0) {
+			IOV_SET(v, body, i);
+			sent = i;
+		}
+	}
+
+	i = writev_all(fd, iov, v - iov);
+	free(iov);
+
+	if (!i) {
+		if (debug)
+			printf("headers_send: fd %d warning (connection closed)\n", fd);
+		return -1;
+	}
+
+	return sent;
+}
+
+/*
+ * Format the header block of "data" into a new buffer, for callers which
+ * write to non-blocking sockets and may have to finish later.
+ *
+ * Returns: length of the block, which is in *buf (to be freed)
+ */
+int headers_format(rr_data_const_t data, char **buf) {
+	struct iovec *iov;
+	char code[16];
+	int count;
+	int len;
+	int i;
+
+	iov = headers_iovec(data, code, &count);
+
 	len = 0;
-	if (data->req)
-		len = snprintf(buf, buf_len, "%s %s %s\r\n", data->method, data->url, data->http);
-	else if (!data->skip_http)
-		len = snprintf(buf, buf_len, "%s %03d %s\r\n", data->http, data->code, data->msg);
+	for (i = 0; i < count; ++i)
+		len += iov[i].iov_len;
 
-	/*
-	 * Now add all headers.
-	 */
-	t = data->headers;
-	while (t) {
-		len += snprintf(buf+len, buf_len - len, "%s: %s\r\n", t->key, t->value);
-		t = t->next;
+	*buf = zmalloc(len + 1);
+	len = 0;
+	for (i = 0; i < count; ++i) {
+		memcpy(*buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
 	}
+	free(iov);
 
-	/*
-	 * Terminate headers
-	 */
-	strlcat(buf, "\r\n", buf_len);
+	return len;
+}
 
-	/*
-	 * Flush it all down the toilet
-	 */
-	if (!so_closed(fd))
-		i = write_wrapper(fd, buf, len+2);
-	else
-		i = -999;
+/*
+ * Send HTTP request/response to the given socket based on what's in "data".
+ * Returns: 1 if OK, 0 in case of socket error
+ */
+int headers_send(int fd, rr_data_const_t data) {
+	return headers_send_body(fd, data, -1, 0) == 0;
+}
 
-	free(buf);
+/*
+ * Forward up to "len" bytes which so_recvln() read ahead from "src".
+ *
+ * Returns: number of bytes forwarded or -1 on write error.
+ */
+static length_t pending_send(int dst, int src, length_t len) {
+	char buf[BLOCK];
+	length_t c = 0;
+	int i;
 
-	if (i <= 0 || i != len+2) {
-		if (debug)
-			printf("headers_send: fd %d warning %d (connection closed)\n", fd, i);
-		return 0;
+	while (c < len && so_pending(src) > 0) {
+		i = so_read(src, buf, MIN(len - c, BLOCK));
+		if (i <= 0)
+			break;
+		if (write_wrapper(dst, buf, i) != i)
+			return -1;
+		c += i;
 	}
 
-	return 1;
+	return c;
+}
+
+#ifdef __linux__
+/*
+ * Move up to "len" bytes from "src" to "dst" through an (empty) pipe, so
+ * that the data never leaves the kernel.
+ *
+ * Returns: number of bytes forwarded, 0 on EOF, -1 on error and -2 if
+ * splice() is not supported for "src"; nothing was read then and the
+ * caller should fall back to read()/write().
+ */
+static ssize_t splice_relay(int dst, int src, int *pipefd, size_t len) {
+	char buf[BLOCK];
+	ssize_t n;
+	ssize_t w;
+	ssize_t left;
+
+	do {
+		n = splice(src, NULL, pipefd[1], NULL, MIN(len, SPLICE_BLOCK), SPLICE_F_MOVE);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+		return -2;
+	if (n <= 0)
+		return n;
+
+	for (left = n; left > 0; left -= w) {
+		w = splice(pipefd[0], NULL, dst, NULL, left, SPLICE_F_MOVE);
+		if (w < 0 && errno == EINTR) {
+			w = 0;
+		} else if (w < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			/*
+			 * Can't splice into "dst", copy what's in the pipe already
+			 */
+			w = read(pipefd[0], buf, MIN(left, BLOCK));
+			if (w <= 0 || write_wrapper(dst, buf, w) != w)
+				return -1;
+		} else if (w <= 0) {
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Known-length body forwarding via splice_relay().
+ *
+ * Returns: 1 on success, 0 on error, -2 if splice() can't be used.
+ */
+static int data_splice(int dst, int src, length_t len) {
+	int pipefd[2];
+	length_t c = 0;
+	ssize_t i = 1;
+
+	if (pipe(pipefd))
+		return -2;
+
+	while (c < len) {
+		i = splice_relay(dst, src, pipefd, MIN(len - c, SPLICE_BLOCK));
+		if (i <= 0)
+			break;
+		c += i;
+	}
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	if (debug)
+		printf("data_splice: fds %d:%d moved %lld of %lld\n", dst, src, c, len);
+
+	if (i == -2 && c == 0)
+		return -2;
+
+	return c == len;
 }
+#endif
 
 /*
  * Forward "size" of data from "src" to "dst". If size == -1 then keep
@@ -355,23 +596,62 @@ int data_send(int dst, int src, length_t len) {
 	char *buf;
 	int i;
 	int block;
-	int c = 0;
+	length_t c = 0;
 	int j = 1;
 
 	if (!len)
 		return 1;
 
+#ifdef ENABLE_IO_URING
+	/*
+	 * With io_uring, forward what was read ahead with the headers and
+	 * let the ring do the rest.
+	 */
+	if (dst >= 0 && uring_enabled()) {
+		c = pending_send(dst, src, len < 0 ? so_pending(src) : len);
+		if (c < 0)
+			return 0;
+		if (c == len)
+			return 1;
+
+		i = uring_data_send(dst, src, len < 0 ? -1 : len - c);
+		if (i != -2)
+			return i;
+	}
+#endif
+
+#ifdef __linux__
+	/*
+	 * Bigger bodies of known length are spliced, saving the copies to
+	 * user space and back. Not worth the pipe for small ones. What was
+	 * read ahead with the headers has to go first.
+	 */
+	if (dst >= 0 && len > BUFSIZE) {
+		length_t n = pending_send(dst, src, len - c);
+
+		if (n < 0)
+			return 0;
+		c += n;
+		if (c == len)
+			return 1;
+
+		i = data_splice(dst, src, len - c);
+		if (i != -2)
+			return i;
+	}
+#endif
+
 	buf = zmalloc(BLOCK);
 
 	do {
 		block = (len == -1 || len-c > BLOCK ? BLOCK : len-c);
-		i = read(src, buf, block);
+		i = so_read(src, buf, block);
 
 		if (i > 0)
 			c += i;
 
 		if (dst >= 0 && debug)
-			printf("data_send: read %d of %d / %d of %lld (errno = %s)\n", i, block, c, len, i < 0 ? strerror(errno) : "ok");
+			printf("data_send: read %d of %d / %lld of %lld (errno = %s)\n", i, block, c, len, i < 0 ? strerror(errno) : "ok");
 
 		if (dst >= 0 && so_closed(dst)) {
 			i = -999;
@@ -466,28 +746,56 @@ int chunked_data_send(int dst, int src) {
 /*
  * Full-duplex forwarding between proxy and client descriptors.
  * Used for bidirectional HTTP CONNECT connection.
+ *
+ * On Linux, the data is spliced through a pipe (each read is written out
+ * completely before the next one, so one pipe serves both directions).
+ * We switch to plain read()/write() if that's not possible.
  */
 int tunnel(int cd, int sd) {
-	fd_set set;
+	struct pollfd fds[2];
+	int pipefd[2] = { -1, -1 };
 	int from;
 	int to;
 	int ret;
 	int sel;
-	char *buf;
+	char *buf = NULL;
+
+	/*
+	 * Pass on anything read ahead with the headers, e.g. TLS handshake
+	 * sent by the client right after CONNECT.
+	 */
+	if (pending_send(sd, cd, so_pending(cd)) < 0 || pending_send(cd, sd, so_pending(sd)) < 0)
+		return 0;
+
+#ifdef ENABLE_IO_URING
+	if (uring_enabled()) {
+		ret = uring_tunnel(cd, sd);
+		if (ret != -2)
+			return ret;
+	}
+#endif
 
-	buf = zmalloc(BUFSIZE);
+#ifdef __linux__
+	if (pipe(pipefd)) {
+		pipefd[0] = pipefd[1] = -1;
+		syslog(LOG_WARNING, "tunnel: cannot create pipe, splice disabled: %s\n", strerror(errno));
+	}
+#endif
+	if (pipefd[0] < 0)
+		buf = zmalloc(BUFSIZE);
 
 	if (debug)
-		printf("tunnel: select cli: %d, srv: %d\n", cd, sd);
+		printf("tunnel: poll cli: %d, srv: %d%s\n", cd, sd, pipefd[0] < 0 ? "" : " (splice)");
 
-	do {
-		FD_ZERO(&set);
-		FD_SET(cd, &set);
-		FD_SET(sd, &set);
+	fds[0].fd = cd;
+	fds[0].events = POLLIN;
+	fds[1].fd = sd;
+	fds[1].events = POLLIN;
 
-		sel = select(FD_SETSIZE, &set, NULL, NULL, NULL);
+	do {
+		sel = poll(fds, 2, -1);
 		if (sel > 0) {
-			if (FD_ISSET(cd, &set)) {
+			if (fds[0].revents) {
 				from = cd;
 				to = sd;
 			} else {
@@ -495,21 +803,61 @@ int tunnel(int cd, int sd) {
 				to = cd;
 			}
 
-			ret = read(from, buf, BUFSIZE);
-			if (ret > 0) {
-				(void) write_wrapper(to, buf, ret);
-			} else {
-				free(buf);
-				return (ret == 0);
+#ifdef __linux__
+			if (pipefd[0] >= 0) {
+				ret = splice_relay(to, from, pipefd, SPLICE_BLOCK);
+				if (ret == -2) {
+					if (debug)
+						printf("tunnel: splice not supported, copying\n");
+					close(pipefd[0]);
+					close(pipefd[1]);
+					pipefd[0] = pipefd[1] = -1;
+					buf = zmalloc(BUFSIZE);
+					continue;
+				}
+			} else
+#endif
+			{
+				ret = read(from, buf, BUFSIZE);
+				if (ret > 0)
+					(void) write_wrapper(to, buf, ret);
 			}
-		} else if (sel < 0) {
-			free(buf);
-			return 0;
+
+			if (ret <= 0) {
+				ret = (ret == 0);
+				break;
+			}
+		} else if (sel < 0 && errno != EINTR) {
+			ret = 0;
+			break;
 		}
 	} while (1);
 
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
 	free(buf);
-	return 1;
+
+	return ret;
+}
+
+/*
+ * Return 1 if the request method is idempotent (RFC 9110, 9.2.2), so that
+ * it can be sent again if the connection failed before any response.
+ */
+int http_idempotent(rr_data_const_t request) {
+	static const char *methods[] = { "GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE" };
+	size_t i;
+
+	if (!request || !request->req || !request->method)
+		return 0;
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); ++i)
+		if (!strcasecmp(methods[i], request->method))
+			return 1;
+
+	return 0;
 }
 
 /*
@@ -620,6 +968,42 @@ int http_body_send(int writefd, int readfd, rr_data_const_t request, rr_data_con
 	return rc;
 }
 
+/*
+ * Send headers from "data" followed by the body, as http_body_send() would.
+ * A non-chunked body starts in the same write as the headers, as far as it
+ * was read ahead with them.
+ *
+ * Returns: 1 if OK, 0 in case of socket error
+ */
+int http_message_send(int writefd, int readfd, rr_data_const_t data, rr_data_const_t request, rr_data_const_t response) {
+	rr_data_const_t current;
+	length_t bodylen;
+	length_t sent;
+	int rc;
+
+	current = (response->empty ? request : response);
+	bodylen = http_has_body(request, response);
+
+	if (!bodylen || hlist_subcmp(current->headers, "Transfer-Encoding", "chunked")) {
+		if (!headers_send(writefd, data))
+			return 0;
+		return http_body_send(writefd, readfd, request, response);
+	}
+
+	sent = headers_send_body(writefd, data, readfd, bodylen);
+	if (sent < 0)
+		return 0;
+
+	if (debug)
+		printf("Body included. Length: %lld (%lld with headers)\n", bodylen, sent);
+
+	rc = data_send(writefd, readfd, bodylen < 0 ? -1 : bodylen - sent);
+	if (debug)
+		printf("%s", rc ? "Body sent.\n" : "Could not send whole body\n");
+
+	return rc;
+}
+
 /*
  * Connection cleanup - C-L or chunked body
  * Return 0 if connection closed or EOF, 1 if OK to continue
@@ -42,9 +42,13 @@ extern char *get_http_header_value(const char *src);
 extern int http_parse_basic(hlist_const_t headers, const char *header, struct auth_s *tcreds);
 extern int headers_recv(int fd, rr_data_t data);
 extern int headers_send(int fd, rr_data_const_t data);
+extern length_t headers_send_body(int fd, rr_data_const_t data, int src, length_t len);
+extern int headers_format(rr_data_const_t data, char **buf);
 extern int tunnel(int cd, int sd);
+extern int http_idempotent(rr_data_const_t request);
 extern length_t http_has_body(rr_data_const_t request, rr_data_const_t response);
 extern int http_body_send(int writefd, int readfd, rr_data_const_t request, rr_data_const_t response);
+extern int http_message_send(int writefd, int readfd, rr_data_const_t data, rr_data_const_t request, rr_data_const_t response);
 extern int http_body_drop(int fd, rr_data_const_t response);
 
 #endif /* _HTTP_H */
@@ -0,0 +1,201 @@
+/*
+ * These are the idle connection routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "utils.h"
+#include "socket.h"
+#include "idle.h"
+
+#define IDLE_EVENTS	64
+
+extern int debug;
+
+/*
+ * A keep-alive client spends most of its life between requests. Rather
+ * than keeping a worker blocked in headers_recv() for that time, the
+ * connection is parked here: a single thread watches all parked clients
+ * with epoll and hands each one back to the workers (proxy_thread() again)
+ * as soon as its next request starts to arrive. Workers thus only serve
+ * requests in flight, and thousands of idle clients cost one descriptor
+ * and a few bytes each instead of a thread.
+ *
+ * A parked connection is registered one-shot, so it is dispatched once
+ * and removed from the set by the event thread itself.
+ */
+
+struct parked_s {
+	int fd;
+	void *(*fn)(void *);
+	void *arg;
+};
+
+static int epfd = -1;
+static unsigned long parked = 0;
+static int (*dispatch)(void *(*fn)(void *), void *arg) = NULL;
+
+#ifdef __linux__
+static void *idle_thread(void *unused) {
+	struct epoll_event events[IDLE_EVENTS];
+	struct parked_s *p;
+	int i;
+	int n;
+
+	(void)unused;
+	for (;;) {
+		n = epoll_wait(epfd, events, IDLE_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Serious error during idle epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; ++i) {
+			p = (struct parked_s *)events[i].data.ptr;
+			epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+			__atomic_sub_fetch(&parked, 1, __ATOMIC_RELAXED);
+
+			if (debug)
+				printf("idle: resuming client %d\n", p->fd);
+
+			/*
+			 * Whether it's a request, EOF or an error, the thread
+			 * routine will find out and clean up.
+			 */
+			if (dispatch(p->fn, p->arg)) {
+				syslog(LOG_ERR, "Cannot resume idle client %d\n", p->fd);
+				so_close(p->fd);
+				free(p->arg);
+			}
+			free(p);
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Start the event thread. Parked connections are resumed through
+ * "submit", which must behave like workers_submit().
+ *
+ * Returns: 1 if parking is available, 0 otherwise.
+ */
+int idle_start(int (*submit)(void *(*fn)(void *), void *arg)) {
+#ifdef __linux__
+	pthread_attr_t attr;
+	pthread_t pthr;
+	int rc;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		syslog(LOG_ERR, "Cannot create epoll instance for idle clients: %s\n", strerror(errno));
+		return 0;
+	}
+	dispatch = submit;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&pthr, &attr, idle_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		syslog(LOG_ERR, "Cannot start idle client thread: %d\n", rc);
+		close(epfd);
+		epfd = -1;
+		return 0;
+	}
+
+	return 1;
+#else
+	(void)submit;
+	syslog(LOG_WARNING, "Parking idle clients is supported only on Linux\n");
+	return 0;
+#endif
+}
+
+int idle_enabled(void) {
+	return epfd >= 0;
+}
+
+/*
+ * Park the client "fd" until it becomes readable, then run fn(arg) on
+ * a worker. Data already read ahead wouldn't wake us, caller has to check
+ * so_pending() first.
+ *
+ * Returns: 1 if parked (fd and arg now belong to the event thread),
+ * 0 if the caller has to keep serving the client itself.
+ */
+int idle_park(int fd, void *(*fn)(void *), void *arg) {
+#ifdef __linux__
+	struct epoll_event ev;
+	struct parked_s *p;
+
+	if (epfd < 0)
+		return 0;
+
+	p = (struct parked_s *)zmalloc(sizeof(struct parked_s));
+	p->fd = fd;
+	p->fn = fn;
+	p->arg = arg;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = p;
+
+	/*
+	 * Count it first, the event may fire before epoll_ctl() returns
+	 */
+	__atomic_add_fetch(&parked, 1, __ATOMIC_RELAXED);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		__atomic_sub_fetch(&parked, 1, __ATOMIC_RELAXED);
+		if (debug)
+			printf("idle: cannot park client %d: %s\n", fd, strerror(errno));
+		free(p);
+		return 0;
+	}
+
+	if (debug)
+		printf("idle: parked client %d\n", fd);
+
+	return 1;
+#else
+	(void)fd;
+	(void)fn;
+	(void)arg;
+	return 0;
+#endif
+}
+
+/*
+ * Number of clients waiting for their next request.
+ */
+unsigned long idle_parked(void) {
+	return __atomic_load_n(&parked, __ATOMIC_RELAXED);
+}
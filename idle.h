@@ -0,0 +1,28 @@
+/*
+ * These are the idle connection routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _IDLE_H
+#define _IDLE_H
+
+extern int idle_start(int (*submit)(void *(*fn)(void *), void *arg));
+extern int idle_enabled(void);
+extern int idle_park(int fd, void *(*fn)(void *), void *arg);
+extern unsigned long idle_parked(void);
+
+#endif /* _IDLE_H */
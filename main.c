@@ -19,6 +19,10 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE				/* pthread_setaffinity_np() */
+#endif
+
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/select.h>
@@ -46,6 +50,10 @@
 #ifdef __CYGWIN__
 #include <windows.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sched.h>
+#endif
 
 /*
  * Some helping routines like linked list manipulation substr(), memory
@@ -66,6 +74,16 @@
 #include "direct.h"				/* code serving directly without proxy */
 #include "proxy.h"
 #include "pac.h"
+#include "workers.h"
+#include "idle.h"
+#include "engine.h"
+#include "connpool.h"
+#include "dns.h"
+#include "dnsstub.h"
+#include "paccache.h"
+#ifdef ENABLE_IO_URING
+#include "uring.h"
+#endif
 #ifdef __CYGWIN__
 #include "sspi.h"				/* code for SSPI management */
 #endif
@@ -75,6 +93,8 @@
 #endif
 
 #define STACK_SIZE	sizeof(void *)*8*1024
+#define MAX_EVENTS	64
+#define ACCEPT_BACKOFF	100000		/* usec to wait when accept() runs out of resources */
 
 /*
  * Global "read-only" data initialized in main(). Comments list funcs. which use
@@ -86,23 +106,12 @@ int debug = 0;					/* all debug printf's and possibly external modules */
 struct auth_s *g_creds = NULL;			/* throughout the whole module */
 
 int quit = 0;					/* sighandler() */
+int reload = 0;					/* sighandler() */
 int ntlmbasic = 0;				/* forward_request() */
 int serialize = 0;
 int scanner_plugin = 0;
 long scanner_plugin_maxsize = 0;
-
-/*
- * List of finished threads. Each forward_request() thread adds itself to it when
- * finished. Main regularly joins and removes all tid's in there.
- */
-plist_t threads_list = NULL;
-pthread_mutex_t threads_mtx = PTHREAD_MUTEX_INITIALIZER;
-
-/*
- * List of cached connections. Accessed by each thread forward_request().
- */
-plist_t connection_list = NULL;
-pthread_mutex_t connection_mtx = PTHREAD_MUTEX_INITIALIZER;
+int connect_timeout = DEFAULT_CONNECT_TIMEOUT;	/* so_connect() callers */
 
 /*
  * List of custom header substitutions, SOCKS5 proxy users and
@@ -116,10 +125,44 @@ plist_t noproxy_list = NULL;			/* proxy_thread() */
 /* 1 = Pac engine is initialized and in use. */
 int pac_initialized = 0;
 
+/*
+ * ACL rules checked for each accepted connection.
+ */
+plist_t rules = NULL;
+
+/*
+ * Listening sockets served by the main loop. Each entry remembers the
+ * thread routine of its service (and the target of a tunnel), so that
+ * an accepted connection can be dispatched straight from the poller's
+ * event payload without looking the descriptor up in the lists.
+ */
+struct listener_s {
+	int fd;
+	int shard;
+	void *(*thread)(void *);
+	char *target;
+};
+
+struct listener_s *listeners = NULL;
+int listeners_count = 0;
+
+/*
+ * Number of connections handed over to the workers, by any acceptor.
+ */
+static unsigned long dispatched = 0;
+
 /*
  * General signal handler. If in debug mode, quit immediately.
  */
 void sighandler(int p) {
+	/*
+	 * With a PAC file, SIGHUP means reload it.
+	 */
+	if (p == SIGHUP && pac_initialized) {
+		reload = 1;
+		return;
+	}
+
 	if (!quit)
 		syslog(LOG_INFO, "Signal %d received, issuing clean shutdown\n", p);
 	else
@@ -129,10 +172,18 @@ void sighandler(int p) {
 		quit++;
 }
 
+/*
+ * Results of the old PAC file are void after it's reloaded.
+ */
+static void pac_reloaded(void) {
+	paccache_flush();
+	paclist_flush();
+}
+
 /*
  * Register and bind new proxy service port.
  */
-void listen_add(const char *service, plist_t *list, char *spec, int gateway) {
+void listen_add(const char *service, plist_t *list, char *spec, int gateway, int shards) {
 	struct addrinfo *addresses;
 	int i;
 	int p;
@@ -164,17 +215,17 @@ void listen_add(const char *service, plist_t *list, char *spec, int gateway) {
 		so_resolv_wildcard(&addresses, port, gateway);
 	}
 
-	i = so_listen(list, addresses, NULL);
+	i = so_listen(list, addresses, NULL, shards);
 	if (i > 0) {
 		syslog(LOG_INFO, "New %s service on %s\n", service, spec);
 	}
-	freeaddrinfo(addresses);
+	so_freeaddr(addresses);
 }
 
 /*
  * Register a new tunnel definition, bind service port.
  */
-void tunnel_add(plist_t *list, char *spec, int gateway) {
+void tunnel_add(plist_t *list, char *spec, int gateway, int shards) {
 	struct addrinfo *addresses;
 	int i;
 	int len;
@@ -222,8 +273,18 @@ void tunnel_add(plist_t *list, char *spec, int gateway) {
 		strlcat(tmp, ":", tmp_len);
 		strlcat(tmp, field[pos+2], tmp_len);
 
-		i = so_listen(list, addresses, tmp);
+		i = so_listen(list, addresses, tmp, shards);
 		if (i > 0) {
+			plist_t t;
+
+			/*
+			 * The target is freed with the list, so every socket bound
+			 * (e.g. both IPv4 and IPv6 wildcard) needs a copy of its own.
+			 */
+			for (t = *list, count = 0; t; t = t->next) {
+				if (t->aux == tmp && count++)
+					t->aux = strdup(tmp);
+			}
 			syslog(LOG_INFO, "New tunnel to %s\n", tmp);
 		} else {
 			syslog(LOG_ERR, "Unable to bind tunnel");
@@ -235,7 +296,7 @@ void tunnel_add(plist_t *list, char *spec, int gateway) {
 	}
 
 	free(spec);
-	freeaddrinfo(addresses);
+	so_freeaddr(addresses);
 }
 
 /*
@@ -294,10 +355,17 @@ void *proxy_thread(void *thread_data) {
 			printf("Reading headers (%d)...\n", cd);
 		}
 
-		request = new_rr_data();
-		if (!headers_recv(cd, request)) {
-			free_rr_data(&request);
-			break;
+		/*
+		 * The request engine may have read the request for us
+		 */
+		request = ((struct thread_arg_s *)thread_data)->request;
+		((struct thread_arg_s *)thread_data)->request = NULL;
+		if (!request) {
+			request = new_rr_data();
+			if (!headers_recv(cd, request)) {
+				free_rr_data(&request);
+				break;
+			}
 		}
 
 		do {
@@ -325,6 +393,15 @@ void *proxy_thread(void *thread_data) {
 		} while (ret != NULL && ret != (void *)-1);
 
 		free_rr_data(&request);
+
+		/*
+		 * Nothing more from the client yet? Don't wait for it here, let
+		 * the request engine or the idle thread take it.
+		 */
+		if (keep_alive && ret != (void *)-1 && !serialize && !so_pending(cd)
+				&& (engine_enabled() ? engine_park(thread_data)
+					: idle_enabled() && idle_park(cd, proxy_thread, thread_data)))
+			return NULL;
 	/*
 	 * If client asked for proxy keep-alive, loop unless the last server response
 	 * requested (Proxy-)Connection: close.
@@ -332,17 +409,7 @@ void *proxy_thread(void *thread_data) {
 	} while (keep_alive && ret != (void *)-1 && !serialize);
 
 	free(thread_data);
-	close(cd);
-
-	/*
-	 * Add ourself to the "threads to join" list.
-	 */
-	if (!serialize) {
-		pthread_mutex_lock(&threads_mtx);
-		pthread_t thread_id = pthread_self();
-		threads_list = plist_add(threads_list, (unsigned long)thread_id, NULL);
-		pthread_mutex_unlock(&threads_mtx);
-	}
+	so_close(cd);
 
 	return NULL;
 }
@@ -373,16 +440,6 @@ void *tunnel_thread(void *thread_data) {
 	free(hostname);
 	free(thread_data);
 
-	/*
-	 * Add ourself to the "threads to join" list.
-	 */
-	if (!serialize) {
-		pthread_mutex_lock(&threads_mtx);
-		pthread_t thread_id = pthread_self();
-		threads_list = plist_add(threads_list, (unsigned long)thread_id, NULL);
-		pthread_mutex_unlock(&threads_mtx);
-	}
-
 	return NULL;
 }
 
@@ -615,7 +672,7 @@ void *socks5_thread(void *thread_data) {
 		strlcat(thost, tport, HOST_BUFSIZE);
 
 		tcreds = new_auth();
-		sd = proxy_connect(tcreds, "/", thost);
+		sd = proxy_connect(tcreds, "/", thost, NULL, NULL);
 		if (sd == -2) {
 			// remove previously added port to thost
 			char* t = thost;
@@ -679,21 +736,241 @@ bailout:
 	if (tcreds)
 		free(tcreds);
 	if (sd >= 0)
-		close(sd);
-	close(cd);
+		so_close(sd);
+	so_close(cd);
+
+	return NULL;
+}
+
+/*
+ * Register all sockets of a listening list with the main loop,
+ * each of them served by the given thread routine.
+ */
+void listeners_add(plist_const_t list, void *(*thread)(void *), int shards) {
+	struct listener_s *tmp;
+	int i;
+
+	for (i = 0; list; ++i) {
+		tmp = realloc(listeners, (listeners_count + 1) * sizeof(struct listener_s));
+		if (!tmp) {
+			syslog(LOG_ERR, "Cannot allocate memory for listeners, exiting\n");
+			myexit(1);
+		}
+		listeners = tmp;
+		listeners[listeners_count].fd = list->key;
+		listeners[listeners_count].shard = i % shards;
+		listeners[listeners_count].thread = thread;
+		listeners[listeners_count].target = list->aux;
+		listeners_count++;
+		list = list->next;
+	}
+}
+
+/*
+ * Hand a connection over to the workers, see workers_submit(). This is
+ * also how idle keep-alive clients get back to work.
+ */
+static int dispatch(void *(*fn)(void *), void *arg) {
+	int rc;
+
+	rc = workers_submit(fn, arg);
+	if (!rc)
+		__atomic_add_fetch(&dispatched, 1, __ATOMIC_RELAXED);
+
+	return rc;
+}
+
+/*
+ * Accept a connection pending on the listening socket and hand it
+ * over to the listener's thread routine on a worker (or run it inline,
+ * if we serialize).
+ *
+ * Returns: 1 if a connection was dispatched, 0 if it was refused or
+ * failed, -1 if there is nothing (more) to accept and -2 if we are out
+ * of descriptors or memory, so the queue stays pending for now.
+ */
+int listener_accept(const struct listener_s *l) {
+	struct thread_arg_s *data;
+	union sock_addr caddr;
+	socklen_t clen;
+	char *tmp;
+	int tid = 0;
+	int cd;
+
+	clen = sizeof(caddr);
+	cd = accept(l->fd, &caddr.addr, &clen);
+	if (cd < 0) {
+		if (errno == EINTR || errno == ECONNABORTED)
+			return 0;
+		if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+			syslog(LOG_WARNING, "Cannot accept connection: %s, backing off\n", strerror(errno));
+			return -2;
+		}
+		if (errno != EAGAIN)
+			syslog(LOG_ERR, "Serious error during accept: %s\n", strerror(errno));
+		return -1;
+	}
 
 	/*
-	 * Add ourself to the "threads to join" list.
+	 * Check main access control list.
 	 */
-	if (!serialize) {
-		pthread_mutex_lock(&threads_mtx);
-		pthread_t thread_id = pthread_self();
-		threads_list = plist_add(threads_list, (unsigned long)thread_id, NULL);
-		pthread_mutex_unlock(&threads_mtx);
+	if (acl_check(rules, &caddr.addr) != ACL_ALLOW) {
+		char s[INET6_ADDRSTRLEN] = {0};
+		INET_NTOP(&caddr, s, INET6_ADDRSTRLEN);
+		unsigned short port = INET_PORT(&caddr);
+		syslog(LOG_WARNING, "Connection denied for %s:%d\n", s, ntohs(port));
+		tmp = gen_denied_page(s);
+		(void) write_wrapper(cd, tmp, strlen(tmp)); // We don't really care about the result
+		free(tmp);
+		so_close(cd);
+		return 0;
+	}
+
+	data = (struct thread_arg_s *)zmalloc(sizeof(struct thread_arg_s));
+	data->fd = cd;
+	data->addr = caddr;
+	data->target = l->target;
+
+	if (serialize) {
+		l->thread((void *)data);
+		return 1;
+	}
+
+	/*
+	 * Proxy clients start out in the request engine, if we have one
+	 */
+	if (l->thread == proxy_thread && engine_enabled() && engine_park(data))
+		return 1;
+
+	tid = dispatch(l->thread, (void *)data);
+	if (tid) {
+		syslog(LOG_ERR, "Serious error during pthread_create: %d\n", tid);
+		free(data);
+		so_close(cd);
+		return 0;
+	}
+
+	return 1;
+}
+
+#ifdef __linux__
+/*
+ * Create an epoll instance watching all listening sockets of a shard
+ * (or all of them, if shard is -1). They are registered just once,
+ * edge-triggered, with the listener entry as the event payload. The
+ * sockets are switched to non-blocking mode, so that the acceptor can
+ * drain the accept queue after each event.
+ *
+ * Returns: epoll descriptor or -1 if epoll is not available, in which
+ * case the main loop falls back to select().
+ */
+int listeners_epoll(int shard) {
+	struct epoll_event ev;
+	int flags;
+	int epfd;
+	int i;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		syslog(LOG_WARNING, "epoll_create1() failed: %s, falling back to select()\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < listeners_count; ++i) {
+		if (shard >= 0 && listeners[i].shard != shard)
+			continue;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &listeners[i];
+
+		if ((flags = fcntl(listeners[i].fd, F_GETFL, 0)) < 0
+				|| fcntl(listeners[i].fd, F_SETFL, flags | O_NONBLOCK) < 0
+				|| epoll_ctl(epfd, EPOLL_CTL_ADD, listeners[i].fd, &ev) < 0) {
+			syslog(LOG_WARNING, "Cannot register listener %d with epoll: %s, falling back to select()\n",
+				listeners[i].fd, strerror(errno));
+			close(epfd);
+			return -1;
+		}
+	}
+
+	return epfd;
+}
+
+/*
+ * Accept all connections pending on an edge-triggered listener. If we run
+ * out of descriptors or memory, the rest of the queue won't raise another
+ * edge, so wait a bit and re-arm the listener with EPOLL_CTL_MOD: epoll
+ * then reports it again while connections are still waiting.
+ */
+void listener_drain(int epfd, struct listener_s *l) {
+	struct epoll_event ev;
+	int rc;
+
+	while ((rc = listener_accept(l)) >= 0)
+		;
+
+	if (rc == -2) {
+		usleep(ACCEPT_BACKOFF);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = l;
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, l->fd, &ev) < 0)
+			syslog(LOG_ERR, "Cannot re-arm listener %d: %s\n", l->fd, strerror(errno));
+	}
+}
+
+/*
+ * Acceptor of one listener shard. It runs pinned to its own CPU (the shard
+ * number modulo the CPUs we are allowed to run on) and serves only its
+ * SO_REUSEPORT sockets, so the kernel spreads new connections across the
+ * acceptors.
+ */
+void *acceptor_thread(void *arg) {
+	struct epoll_event events[MAX_EVENTS];
+	cpu_set_t allowed;
+	cpu_set_t cpus;
+	int shard = (int)(intptr_t)arg;
+	int epfd;
+	int cpu;
+	int n;
+	int i;
+
+	if (!sched_getaffinity(0, sizeof(allowed), &allowed) && CPU_COUNT(&allowed) > 0) {
+		n = shard % CPU_COUNT(&allowed);
+		for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+				break;
+		}
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if ((i = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)))
+			syslog(LOG_WARNING, "Cannot pin acceptor %d to CPU %d: %s\n", shard, cpu, strerror(i));
+		else if (debug)
+			printf("Acceptor %d running on CPU %d\n", shard, cpu);
 	}
 
+	epfd = listeners_epoll(shard);
+	if (epfd < 0) {
+		syslog(LOG_ERR, "Acceptor %d cannot watch its listeners, terminating\n", shard);
+		quit = 2;
+		return NULL;
+	}
+
+	while (quit < 2) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+		for (i = 0; i < n; ++i)
+			listener_drain(epfd, events[i].data.ptr);
+		if (n < 0 && errno != EINTR && !quit)
+			syslog(LOG_ERR, "Serious error during epoll_wait: %s\n", strerror(errno));
+	}
+
+	close(epfd);
+
 	return NULL;
 }
+#endif
 
 int main(int argc, char **argv) {
 	char *tmp;
@@ -710,8 +987,6 @@ int main(int argc, char **argv) {
 	char *cauth;
 	struct termios termold;
 	struct termios termnew;
-	pthread_attr_t pattr;
-	pthread_t pthr;
 	hlist_const_t list;
 	int i;
 	int w;
@@ -721,8 +996,25 @@ int main(int argc, char **argv) {
 	int nuid = 0;
 	int ngid = 0;
 	int gateway = 0;
-	unsigned int tc = 0; ///< Total number of created threads
-	unsigned int tj = 0; ///< Total number of terminated threads
+	unsigned long tc = 0; ///< Total number of dispatched connections
+	unsigned long tj = 0; ///< Total number of finished connections
+	int workers = DEFAULT_WORKERS;
+	int workersmax = DEFAULT_WORKERS_MAX;
+	int shards = 1;
+	int parkidle = 0;
+	int reqengine = 0;
+	int poolsize = DEFAULT_POOL_SIZE;
+	int poolidle = DEFAULT_POOL_IDLE;
+	int poolwarm = 0;
+	char *poolwarmurl = NULL;
+	int dnssize = DEFAULT_DNS_CACHE_SIZE;
+	int dnsttl = DEFAULT_DNS_TTL;
+	int dnsnegttl = DEFAULT_DNS_NEGATIVE_TTL;
+	int dnsstub = 0;
+	int pacsize = DEFAULT_PAC_CACHE_SIZE;
+	int pacttl = DEFAULT_PAC_CACHE_TTL;
+	int pacbyurl = 0;
+	int paccontexts = 0;
 	int interactivepwd = 0;
 	int interactivehash = 0;
 	int tracefile = 0;
@@ -732,11 +1024,15 @@ int main(int argc, char **argv) {
 	plist_t tunneld_list = NULL;
 	plist_t proxyd_list = NULL;
 	plist_t socksd_list = NULL;
-	plist_t rules = NULL;
+	plist_t tunnel_specs = NULL;
+	plist_t listen_specs = NULL;
+	plist_t socks_specs = NULL;
+	plist_const_t t;
 	config_t cf = NULL;
 	char *magic_detect = NULL;
 	int pac = 0;
 	char *pac_file;
+	int epfd = -1;
 
 	pac_file = zmalloc(PATH_MAX);
 	g_creds = new_auth();
@@ -820,15 +1116,17 @@ int main(int argc, char **argv) {
 			case 'L':
 				/*
 				 * Parse and validate the argument.
-				 * Create a listening socket for tunneling.
+				 * Create a listening socket for tunneling, once the
+				 * number of listener shards is known.
 				 */
-				tunnel_add(&tunneld_list, optarg, gateway);
+				tunnel_specs = plist_add(tunnel_specs, gateway, strdup(optarg));
 				break;
 			case 'l':
 				/*
-				 * Create a listening socket for proxy function.
+				 * Create a listening socket for proxy function (later, as
+				 * with -L).
 				 */
-				listen_add("Proxy", &proxyd_list, optarg, gateway);
+				listen_specs = plist_add(listen_specs, gateway, strdup(optarg));
 				break;
 			case 'M':
 				magic_detect = strdup(optarg);
@@ -838,7 +1136,7 @@ int main(int argc, char **argv) {
 				free(tmp);
 				break;
 			case 'O':
-				listen_add("SOCKS5 proxy", &socksd_list, optarg, gateway);
+				socks_specs = plist_add(socks_specs, gateway, strdup(optarg));
 				break;
 			case 'P':
 				strlcpy(cpidfile, optarg, MINIBUF_SIZE);
@@ -1130,6 +1428,176 @@ int main(int argc, char **argv) {
 			gateway = 1;
 		free(tmp);
 
+		/*
+		 * Size of the worker pool.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "Workers", tmp, MINIBUF_SIZE)
+		if (strlen(tmp)) {
+			workers = atoi(tmp);
+			if (workers < 0) {
+				syslog(LOG_WARNING, "Invalid Workers value %s, using default %d\n", tmp, DEFAULT_WORKERS);
+				workers = DEFAULT_WORKERS;
+			}
+		}
+		free(tmp);
+
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "WorkersMax", tmp, MINIBUF_SIZE)
+		if (strlen(tmp)) {
+			workersmax = atoi(tmp);
+			if (workersmax < 0) {
+				syslog(LOG_WARNING, "Invalid WorkersMax value %s, using default %d\n", tmp, DEFAULT_WORKERS_MAX);
+				workersmax = DEFAULT_WORKERS_MAX;
+			}
+		}
+		free(tmp);
+
+		/*
+		 * Time limit for connecting to parent proxies and web servers.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "ConnectTimeout", tmp, MINIBUF_SIZE)
+		if (strlen(tmp)) {
+			connect_timeout = atoi(tmp);
+			if (connect_timeout < 0) {
+				syslog(LOG_WARNING, "Invalid ConnectTimeout value %s, using default %d\n", tmp, DEFAULT_CONNECT_TIMEOUT);
+				connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+			}
+		}
+		free(tmp);
+
+		/*
+		 * Limits of the per-parent pools of authenticated connections.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "PoolSize", tmp, MINIBUF_SIZE)
+		if (strlen(tmp)) {
+			poolsize = atoi(tmp);
+			if (poolsize < 0) {
+				syslog(LOG_WARNING, "Invalid PoolSize value %s, using default %d\n", tmp, DEFAULT_POOL_SIZE);
+				poolsize = DEFAULT_POOL_SIZE;
+			}
+		}
+		free(tmp);
+
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "PoolIdleTime", tmp, MINIBUF_SIZE)
+		if (strlen(tmp)) {
+			poolidle = atoi(tmp);
+			if (poolidle < 0) {
+				syslog(LOG_WARNING, "Invalid PoolIdleTime value %s, using default %d\n", tmp, DEFAULT_POOL_IDLE);
+				poolidle = DEFAULT_POOL_IDLE;
+			}
+		}
+		free(tmp);
+
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "PoolWarm", tmp, MINIBUF_SIZE)
+		if (strlen(tmp))
+			poolwarm = MAX(atoi(tmp), 0);
+		free(tmp);
+
+		/*
+		 * Warm-up request, chosen by the admin so that it has no side
+		 * effects and leaks nothing about the users' traffic.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "PoolWarmURL", tmp, MINIBUF_SIZE)
+		if (strlen(tmp)) {
+			if (strncasecmp("http://", tmp, 7) || !tmp[7] || tmp[7] == '/')
+				syslog(LOG_WARNING, "Invalid PoolWarmURL %s, must be http://host[:port]/...\n", tmp);
+			else
+				poolwarmurl = strdup(tmp);
+		}
+		free(tmp);
+
+		/*
+		 * DNS cache size and lifetime of its positive and negative entries.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "DNSCacheSize", tmp, MINIBUF_SIZE)
+		if (strlen(tmp))
+			dnssize = MAX(atoi(tmp), 0);
+		free(tmp);
+
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "DNSCacheTTL", tmp, MINIBUF_SIZE)
+		if (strlen(tmp))
+			dnsttl = MAX(atoi(tmp), 0);
+		free(tmp);
+
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "DNSNegativeTTL", tmp, MINIBUF_SIZE)
+		if (strlen(tmp))
+			dnsnegttl = MAX(atoi(tmp), 0);
+		free(tmp);
+
+		/*
+		 * Resolve names with our own stub resolver instead of the system one.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "DNSResolver", tmp, MINIBUF_SIZE)
+		if (!strcasecmp("stub", tmp))
+			dnsstub = 1;
+		else if (strlen(tmp) && strcasecmp("system", tmp))
+			syslog(LOG_WARNING, "Unknown DNSResolver %s, using system\n", tmp);
+		free(tmp);
+
+		/*
+		 * Number of SO_REUSEPORT listener shards, each with its own acceptor.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "ListenShards", tmp, MINIBUF_SIZE)
+		if (strlen(tmp)) {
+			shards = atoi(tmp);
+#ifndef __linux__
+			if (shards > 1)
+				syslog(LOG_WARNING, "ListenShards is supported only on Linux, ignoring\n");
+			shards = 1;
+#endif
+			if (shards < 1 || serialize)
+				shards = 1;
+		}
+		free(tmp);
+
+		/*
+		 * Wait for the next request of keep-alive clients in an event loop.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "ParkIdle", tmp, MINIBUF_SIZE)
+		if (!strcasecmp("yes", tmp))
+			parkidle = 1;
+		free(tmp);
+
+		/*
+		 * Serve plain proxy requests in an event loop instead of the workers.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "RequestEngine", tmp, MINIBUF_SIZE)
+		if (!strcasecmp("events", tmp))
+			reqengine = 1;
+		else if (strlen(tmp) && strcasecmp("threads", tmp))
+			syslog(LOG_WARNING, "Unknown RequestEngine %s, using threads\n", tmp);
+		free(tmp);
+
+		/*
+		 * I/O engine for tunnels and bodies.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "IOEngine", tmp, MINIBUF_SIZE)
+		if (!strcasecmp("io_uring", tmp)) {
+#ifdef ENABLE_IO_URING
+			if (!uring_init())
+				syslog(LOG_WARNING, "io_uring is not available, using blocking I/O\n");
+#else
+			syslog(LOG_WARNING, "io_uring support is not compiled in, using blocking I/O\n");
+#endif
+		} else if (strlen(tmp) && strcasecmp("blocking", tmp)) {
+			syslog(LOG_WARNING, "Unknown IOEngine %s, using blocking I/O\n", tmp);
+		}
+		free(tmp);
+
 		/*
 		 * Check for NTLM-to-basic settings
 		 */
@@ -1143,7 +1611,7 @@ int main(int argc, char **argv) {
 		 * Setup the rest of tunnels.
 		 */
 		while ((tmp = config_pop(cf, "Tunnel"))) {
-			tunnel_add(&tunneld_list, tmp, gateway);
+			tunnel_add(&tunneld_list, tmp, gateway, shards);
 			free(tmp);
 		}
 
@@ -1151,7 +1619,7 @@ int main(int argc, char **argv) {
 		 * Bind the rest of proxy service ports.
 		 */
 		while ((tmp = config_pop(cf, "Listen"))) {
-			listen_add("Proxy", &proxyd_list, tmp, gateway);
+			listen_add("Proxy", &proxyd_list, tmp, gateway, shards);
 			free(tmp);
 		}
 
@@ -1159,7 +1627,7 @@ int main(int argc, char **argv) {
 		 * Bind the rest of SOCKS5 service ports.
 		 */
 		while ((tmp = config_pop(cf, "SOCKS5Proxy"))) {
-			listen_add("SOCKS5 proxy", &socksd_list, tmp, gateway);
+			listen_add("SOCKS5 proxy", &socksd_list, tmp, gateway, shards);
 			free(tmp);
 		}
 
@@ -1186,8 +1654,52 @@ int main(int argc, char **argv) {
 		CFG_DEFAULT(cf, "Pac", pac_file, PATH_MAX)
 		if (*pac_file) {
 			pac = 1;
+			/*
+			 * Resolve relative paths like -x does, the PAC watcher
+			 * reloads the file long after we chdir("/").
+			 */
+			tmp = zmalloc(PATH_MAX);
+			if (realpath(pac_file, tmp)) {
+				strlcpy(pac_file, tmp, PATH_MAX);
+			} else if (errno != ENOENT) {
+				syslog(LOG_ERR, "Resolving path to PAC file failed: %s\n", strerror(errno));
+				myexit(1);
+			}
+			free(tmp);
 		}
 
+		/*
+		 * Size, lifetime and key of the PAC result cache.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "PacCacheSize", tmp, MINIBUF_SIZE)
+		if (strlen(tmp))
+			pacsize = MAX(atoi(tmp), 0);
+		free(tmp);
+
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "PacCacheTTL", tmp, MINIBUF_SIZE)
+		if (strlen(tmp))
+			pacttl = MAX(atoi(tmp), 0);
+		free(tmp);
+
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "PacCacheKey", tmp, MINIBUF_SIZE)
+		if (!strcasecmp("url", tmp))
+			pacbyurl = 1;
+		else if (strlen(tmp) && strcasecmp("host", tmp))
+			syslog(LOG_WARNING, "Unknown PacCacheKey %s, using host\n", tmp);
+		free(tmp);
+
+		/*
+		 * Number of PAC engines for parallel lookups, one per CPU by default.
+		 */
+		tmp = zmalloc(MINIBUF_SIZE);
+		CFG_DEFAULT(cf, "PacContexts", tmp, MINIBUF_SIZE)
+		if (strlen(tmp))
+			paccontexts = MAX(atoi(tmp), 0);
+		free(tmp);
+
 		/*
 		 * Add the rest of parent proxies.
 		 */
@@ -1304,6 +1816,20 @@ int main(int argc, char **argv) {
 
 	config_close(cf);
 
+	/*
+	 * Bind the service ports given on the command line, with the gateway
+	 * mode in effect where they were given.
+	 */
+	for (t = tunnel_specs; t; t = t->next)
+		tunnel_add(&tunneld_list, t->aux, t->key, shards);
+	for (t = listen_specs; t; t = t->next)
+		listen_add("Proxy", &proxyd_list, t->aux, t->key, shards);
+	for (t = socks_specs; t; t = t->next)
+		listen_add("SOCKS5 proxy", &socksd_list, t->aux, t->key, shards);
+	tunnel_specs = plist_free(tunnel_specs);
+	listen_specs = plist_free(listen_specs);
+	socks_specs = plist_free(socks_specs);
+
 	/* Start Pac engine if pac_file available */
 	/* TODO: pac file option in config file */
 	if (pac) {
@@ -1316,11 +1842,14 @@ int main(int argc, char **argv) {
 		fclose(test_fd);
 
 		/* Initiailize Pac. */
-		pac_init();
-		pac_parse_file(pac_file);
+		pac_init(paccontexts);
+		if (!pac_parse_file(pac_file)) {
+			syslog(LOG_ERR, "Cannot load PAC file: '%s'\n", pac_file);
+			myexit(1);
+		}
 		if (debug)
 			printf("Pac initialized with PAC file %s\n", pac_file);
-		// TODO handle parsing errors from pac
+		paccache_init(pacsize, pacttl, pacbyurl);
 		pac_initialized = 1;
 	}
 
@@ -1659,13 +2188,68 @@ int main(int argc, char **argv) {
 	 */
 	srandom(time(NULL));
 
+	dns_init(dnssize, dnsttl, dnsnegttl);
+	if (pac_initialized)
+		pac_watch_start(pac_file, pac_reloaded);
+	if (dnsstub && !dnsstub_init(RESOLV_CONF))
+		syslog(LOG_WARNING, "DNS stub resolver unavailable, using system resolver\n");
+	connpool_init(poolsize, poolidle);
+	if (poolwarm && !ntlmbasic) {
+		if (poolwarmurl)
+			connpool_warm_start(poolwarm, poolwarmurl, proxy_warm);
+		else
+			syslog(LOG_WARNING, "PoolWarm needs PoolWarmURL, not warming up connections\n");
+	}
+	free(poolwarmurl);
+
+	/*
+	 * Spawn the workers and register all service ports with the main loop.
+	 */
+	if (!serialize) {
+		workers_start(workers, workersmax, STACK_SIZE);
+		if (parkidle)
+			idle_start(dispatch);
+		if (reqengine && (ntlmbasic || scanner_plugin))
+			syslog(LOG_WARNING, "RequestEngine events doesn't support NTLMToBasic and ISAScannerAgent, using threads\n");
+		else if (reqengine)
+			engine_start(dispatch, proxy_thread, noproxy_match);
+	}
+
+	listeners_add(proxyd_list, proxy_thread, shards);
+	listeners_add(socksd_list, socks5_thread, shards);
+	listeners_add(tunneld_list, tunnel_thread, shards);
+
+#ifdef __linux__
+	/*
+	 * With sharded listeners, each shard gets an acceptor thread of its own
+	 * and the main loop below only keeps the accounting.
+	 */
+	if (shards > 1) {
+		pthread_attr_t pattr;
+		pthread_t pthr;
+
+		pthread_attr_init(&pattr);
+		pthread_attr_setstacksize(&pattr, MAX(STACK_SIZE, (size_t)PTHREAD_STACK_MIN));
+		pthread_attr_setdetachstate(&pattr, PTHREAD_CREATE_DETACHED);
+		for (i = 0; i < shards; ++i) {
+			if ((w = pthread_create(&pthr, &pattr, acceptor_thread, (void *)(intptr_t)i))) {
+				syslog(LOG_ERR, "Cannot start acceptor thread: %d\n", w);
+				myexit(1);
+			}
+		}
+		pthread_attr_destroy(&pattr);
+		syslog(LOG_INFO, "Accepting connections with %d listener shards\n", shards);
+	} else {
+		epfd = listeners_epoll(-1);
+	}
+#endif
+
 	/*
 	 * This loop iterates over every connection request on any of
-	 * the listening ports. We keep the number of created threads.
+	 * the listening ports. We keep the number of dispatched connections.
 	 *
-	 * We also check the "finished threads" list, threads_list, here and
-	 * free the memory of all inactive threads. Then, we update the
-	 * number of finished threads.
+	 * We also check the number of connections the workers have finished
+	 * serving, so that we know how many are still active.
 	 *
 	 * The loop ends, when we were "killed" and all threads created
 	 * are finished, OR if we were killed more than once. This way,
@@ -1674,145 +2258,91 @@ int main(int argc, char **argv) {
 	 * killed us twice).
 	 */
 	while (quit == 0 || (tc != tj && quit < 2)) {
-		struct thread_arg_s *data;
-		union sock_addr caddr;
-		struct timeval tv;
-		socklen_t clen;
-		fd_set set;
-		plist_t t;
-		int tid = 0;
-
-		FD_ZERO(&set);
-
-		/*
-		 * Watch for proxy ports.
-		 */
-		t = proxyd_list;
-		while (t) {
-			FD_SET(t->key, &set);
-			t = t->next;
-		}
-
-		/*
-		 * Watch for SOCKS5 ports.
-		 */
-		t = socksd_list;
-		while (t) {
-			FD_SET(t->key, &set);
-			t = t->next;
-		}
-
-		/*
-		 * Watch for tunneled ports.
-		 */
-		t = tunneld_list;
-		while (t) {
-			FD_SET(t->key, &set);
-			t = t->next;
-		}
-
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-
 		/*
 		 * Wait here for data (connection request) on any of the listening
 		 * sockets. When ready, establish the connection. For the main
-		 * port, a new proxy_thread() thread is spawned to service the HTTP
-		 * request. For tunneled ports, tunnel_thread() thread is created
-		 * and for SOCKS port, socks5_thread() is created.
+		 * port, proxy_thread() is handed to a worker to service the HTTP
+		 * request. For tunneled ports, it is tunnel_thread() and for SOCKS
+		 * port, socks5_thread().
 		 *
 		 * All threads are defined in forward.c, except for local proxy_thread()
 		 * which routes the request as forwarded or direct, depending on the
 		 * URL host name and NoProxy settings.
+		 *
+		 * With epoll, each event carries its listener, so there is no need to
+		 * rebuild a descriptor set and scan it after every wakeup. Listeners
+		 * are edge-triggered, so listener_drain() accepts until the queue is empty.
+		 *
+		 * With listener shards, the acceptor threads do all of this and we
+		 * just wake up once in a while to check on them.
 		 */
-		cd = select(FD_SETSIZE, &set, NULL, NULL, &tv);
-		if (cd > 0) {
-			for (i = 0; i < FD_SETSIZE; ++i) {
-				if (!FD_ISSET(i, &set))
-					continue;
-
-				clen = sizeof(caddr);
-				cd = accept(i, &caddr.addr, &clen);
-
-				if (cd < 0) {
-					syslog(LOG_ERR, "Serious error during accept: %s\n", strerror(errno));
-					continue;
-				}
-
-				/*
-				 * Check main access control list.
-				 */
-				if (acl_check(rules, &caddr.addr) != ACL_ALLOW) {
-					char s[INET6_ADDRSTRLEN] = {0};
-					INET_NTOP(&caddr, s, INET6_ADDRSTRLEN);
-					unsigned short port = INET_PORT(&caddr);
-					syslog(LOG_WARNING, "Connection denied for %s:%d\n", s, ntohs(port));
-					tmp = gen_denied_page(s);
-					(void) write_wrapper(cd, tmp, strlen(tmp)); // We don't really care about the result
-					free(tmp);
-					close(cd);
-					continue;
-				}
-
-				pthread_attr_init(&pattr);
-				pthread_attr_setstacksize(&pattr, MAX(STACK_SIZE, PTHREAD_STACK_MIN));
-				pthread_attr_setdetachstate(&pattr, PTHREAD_CREATE_DETACHED);
-#ifndef __CYGWIN__
-				pthread_attr_setguardsize(&pattr, 256);
+		if (shards > 1) {
+			sleep(1);
+#ifdef __linux__
+		} else if (epfd >= 0) {
+			struct epoll_event events[MAX_EVENTS];
+
+			cd = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+			for (i = 0; i < cd; ++i)
+				listener_drain(epfd, events[i].data.ptr);
+			if (cd < 0 && errno != EINTR && !quit)
+				syslog(LOG_ERR, "Serious error during epoll_wait: %s\n", strerror(errno));
 #endif
-
-				if (plist_in(proxyd_list, i)) {
-					data = (struct thread_arg_s *)zmalloc(sizeof(struct thread_arg_s));
-					data->fd = cd;
-					data->addr = caddr;
-					if (!serialize)
-						tid = pthread_create(&pthr, &pattr, proxy_thread, (void *)data);
-					else
-						proxy_thread((void *)data);
-				} else if (plist_in(socksd_list, i)) {
-					data = (struct thread_arg_s *)zmalloc(sizeof(struct thread_arg_s));
-					data->fd = cd;
-					data->addr = caddr;
-					if (!serialize)
-						tid = pthread_create(&pthr, &pattr, socks5_thread, (void *)data);
-					else
-						socks5_thread((void *)data);
-				} else {
-					data = (struct thread_arg_s *)zmalloc(sizeof(struct thread_arg_s));
-					data->fd = cd;
-					data->addr = caddr;
-					data->target = plist_get(tunneld_list, i);
-					if (!serialize)
-						tid = pthread_create(&pthr, &pattr, tunnel_thread, (void *)data);
-					else
-						tunnel_thread((void *)data);
+		} else {
+			struct timeval tv;
+			fd_set set;
+
+			FD_ZERO(&set);
+			for (i = 0; i < listeners_count; ++i)
+				FD_SET(listeners[i].fd, &set);
+
+			tv.tv_sec = 1;
+			tv.tv_usec = 0;
+
+			cd = select(FD_SETSIZE, &set, NULL, NULL, &tv);
+			if (cd > 0) {
+				for (i = 0; i < listeners_count; ++i) {
+					if (FD_ISSET(listeners[i].fd, &set)
+							&& listener_accept(&listeners[i]) == -2)
+						usleep(ACCEPT_BACKOFF);
 				}
+			} else if (cd < 0 && !quit)
+				syslog(LOG_ERR, "Serious error during select: %s\n", strerror(errno));
+		}
 
-				pthread_attr_destroy(&pattr);
-
-				if (tid)
-					syslog(LOG_ERR, "Serious error during pthread_create: %d\n", tid);
-				else
-					tc++; // update count of active threads
-			}
-		} else if (cd < 0 && !quit)
-			syslog(LOG_ERR, "Serious error during select: %s\n", strerror(errno));
-
-		if (threads_list) {
-			pthread_mutex_lock(&threads_mtx);
-			t = threads_list;
-			while (t) {
-				plist_t tmp_next = t->next;
-
-				tj++; // update count of terminated threads
-				if (debug)
-					printf("Terminated thread %lu; rc: %d\n", t->key, i);
+		if (reload) {
+			reload = 0;
+			pac_reload();
+		}
 
-				free(t);
-				t = tmp_next;
+		tc = __atomic_load_n(&dispatched, __ATOMIC_RELAXED); // update count of active threads
+		if (workers_completed() != tj) {
+			tj = workers_completed(); // update count of terminated threads
+			if (debug) {
+				struct workers_stats_s stats;
+				struct dns_stats_s dstats;
+
+				workers_stats(&stats);
+				printf("Workers: %u/%u busy, %u queued, %lu completed, %lu overflow, %lu idle\n",
+					stats.busy, stats.workers, stats.queued, stats.completed, stats.overflow, idle_parked());
+				if (engine_enabled()) {
+					struct engine_stats_s estats;
+
+					engine_stats(&estats);
+					printf("Request engine: %lu clients, %lu requests, %lu handoffs\n",
+						estats.clients, estats.requests, estats.handoffs);
+				}
+				dns_stats(&dstats);
+				printf("DNS cache: %lu hits, %lu negative, %lu misses, %u entries\n",
+					dstats.hits, dstats.negative, dstats.misses, dstats.entries);
+				if (pac_initialized) {
+					struct paccache_stats_s pstats;
+
+					paccache_stats(&pstats);
+					printf("PAC cache: %lu hits, %lu misses, %u entries\n",
+						pstats.hits, pstats.misses, pstats.entries);
+				}
 			}
-			threads_list = NULL;
-			pthread_mutex_unlock(&threads_mtx);
 		}
 	}
 
@@ -1820,6 +2350,7 @@ bailout:
 	if (pac_initialized) {
 		pac_initialized = 0;
 		pac_cleanup();
+		paccache_free();
 	}
 
 	free(pac_file);
@@ -1829,10 +2360,13 @@ bailout:
 		sspi_unset();
 #endif
 
-	syslog(LOG_INFO, "Terminating with %u active threads\n", tc - tj);
-	pthread_mutex_lock(&connection_mtx);
-	plist_free(connection_list);
-	pthread_mutex_unlock(&connection_mtx);
+	syslog(LOG_INFO, "Terminating with %lu active threads\n", tc - tj);
+	workers_stop();
+	if (epfd >= 0)
+		close(epfd);
+	free(listeners);
+
+	connpool_free();
 
 	hlist_free(header_list);
 	plist_free(scanner_agent_list);
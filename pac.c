@@ -21,64 +21,415 @@
 
 #include <netdb.h>
 #include <ifaddrs.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 #include "duktape/duktape.h"
 #include "pac_utils_js.h"
+#include "dns.h"
 #include "pac.h"
 
 /*
- * global duktape context
+ * Pool of duktape contexts, each with its own heap holding pac_utils_js
+ * and the PAC script. A lookup takes one out of the pool for itself, so up
+ * to pac_size lookups run in parallel. Contexts are created as needed.
+ *
+ * Both scripts are compiled only once, by pac_parse_string(), and new
+ * contexts load the bytecode. It's kept in memory only: duktape doesn't
+ * validate bytecode, so loading it from a file isn't safe.
+ *
+ * Parsing a script again replaces the current one, pac_code. Contexts
+ * running an older version finish their lookup and are then destroyed
+ * instead of returning to the pool; idle ones are destroyed right away.
+ * A version is freed once it's not current and no context is being
+ * created from it.
  */
-duk_context *pac_ctx = NULL;
+struct pac_code_s {
+    unsigned int gen;                   // version of the script
+    int refs;
+    void *bc;                           // bytecode of the PAC script
+    duk_size_t len;
+};
+
+struct pac_context_s {
+    duk_context *ctx;
+    unsigned int gen;                   // version it runs
+};
+
+static struct pac_context_s **pac_pool = NULL;  // idle contexts
+static int pac_idle = 0;                // number of idle contexts
+static int pac_created = 0;             // idle and busy contexts
+static int pac_size = 0;                // max contexts
+static void *pac_utils_bc = NULL;       // bytecode of pac_utils_js
+static duk_size_t pac_utils_bclen = 0;
+static struct pac_code_s *pac_code = NULL;      // current PAC script
+static unsigned int pac_gen = 0;
+static pthread_mutex_t pac_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pac_cond = PTHREAD_COND_INITIALIZER;
 
+/*
+ * dnsResolve() goes through the DNS cache shared with the proxy itself
+ * (see dns.c), so repeated calls for a host don't wait for the resolver.
+ */
 static duk_ret_t native_dnsresolve(duk_context *ctx) {
 	const char *hostname;
-	struct addrinfo hints;
 	struct addrinfo *addresses;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_family = AF_INET;
+	char s[INET_ADDRSTRLEN] = {0};
+	int found = 0;
 
 	hostname = duk_to_string(ctx, 0);
 
-	int rc = getaddrinfo(hostname, NULL, &hints, &addresses);
-	if (rc != 0) {
-		duk_push_string(ctx, NULL);
-	} else {
-    	char s[INET_ADDRSTRLEN] = {0};
-		for(struct addrinfo *p = addresses; p != NULL; p = p->ai_next) {
+	if (dns_resolve(hostname, 0, &addresses)) {
+		for (struct addrinfo *p = addresses; p != NULL; p = p->ai_next) {
 			if (p->ai_family == AF_INET) {
-				getnameinfo(p->ai_addr, p->ai_addrlen, s, sizeof(s), NULL, 0, NI_NUMERICHOST);
+				found = inet_ntop(AF_INET, &((struct sockaddr_in *)p->ai_addr)->sin_addr, s, sizeof(s)) != NULL;
 				break;
 			}
 		}
-		duk_push_string(ctx, s);
-		freeaddrinfo(addresses);
+		dns_free(addresses);
 	}
+	duk_push_string(ctx, found ? s : NULL);
 
 	return 1;
 }
 
+/*
+ * myIpAddress() is looked up again only when it's older than myip_ttl
+ * seconds or, on Linux, when the kernel announces a change of IPv4
+ * addresses over rtnetlink. The short TTL is for when that's unavailable.
+ */
+#define MYIP_TTL            10
+#define MYIP_TTL_WATCHED    300
+
+static char myip[INET_ADDRSTRLEN];
+static time_t myip_expires = 0;
+static int myip_ttl = MYIP_TTL;
+static pthread_mutex_t myip_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef __linux__
+static void *myip_watch(void *arg) {
+	char buf[4096];
+	int fd = (int)(intptr_t)arg;
+	ssize_t n;
+
+	for (;;) {
+		n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 && !(n < 0 && errno == ENOBUFS))
+			break;
+
+		// any message (or lost ones) means the addresses changed
+		pthread_mutex_lock(&myip_mtx);
+		myip_expires = 0;
+		pthread_mutex_unlock(&myip_mtx);
+	}
+
+	syslog(LOG_WARNING, "Stopped watching IP address changes: %s\n", n < 0 ? strerror(errno) : "EOF");
+	pthread_mutex_lock(&myip_mtx);
+	myip_ttl = MYIP_TTL;
+	myip_expires = 0;
+	pthread_mutex_unlock(&myip_mtx);
+	close(fd);
+
+	return NULL;
+}
+
+static void myip_watch_start(void) {
+	struct sockaddr_nl sa;
+	pthread_attr_t attr;
+	pthread_t thr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_IPV4_IFADDR;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thr, &attr, myip_watch, (void *)(intptr_t)fd) == 0)
+		myip_ttl = MYIP_TTL_WATCHED;
+	else
+		close(fd);
+	pthread_attr_destroy(&attr);
+}
+#endif
+
 static duk_ret_t native_myipaddress(duk_context *ctx) {
 	struct ifaddrs *addrs;
-
-	int rc = getifaddrs(&addrs);
-	if (rc != 0) {
-		duk_push_string(ctx, "127.0.0.1");
-	} else {
-    	char s[INET_ADDRSTRLEN] = {0};
-		for (struct ifaddrs *p = addrs; p != NULL; p = p->ifa_next) {
-			if (p->ifa_addr && p->ifa_addr->sa_family == AF_INET) {
-				getnameinfo(p->ifa_addr, sizeof(struct sockaddr_in), s, sizeof(s), NULL, 0, NI_NUMERICHOST);
+	char s[INET_ADDRSTRLEN] = {0};
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&myip_mtx);
+	if (now >= myip_expires) {
+		if (getifaddrs(&addrs) != 0) {
+			strcpy(myip, "127.0.0.1");
+		} else {
+			myip[0] = 0;
+			for (struct ifaddrs *p = addrs; p != NULL; p = p->ifa_next) {
+				if (p->ifa_addr && p->ifa_addr->sa_family == AF_INET) {
+					getnameinfo(p->ifa_addr, sizeof(struct sockaddr_in), myip, sizeof(myip), NULL, 0, NI_NUMERICHOST);
+				}
 			}
+			freeifaddrs(addrs);
+		}
+		myip_expires = now + myip_ttl;
+	}
+	strcpy(s, myip);
+	pthread_mutex_unlock(&myip_mtx);
+
+	duk_push_string(ctx, s);
+
+	return 1;
+}
+
+/*
+ * Native versions of the helpers of ascii_pac_utils.js, which PAC files
+ * call many times per lookup. They give the same results as the
+ * JavaScript ones, for arguments converted to strings.
+ */
+
+static duk_ret_t native_dnsdomainis(duk_context *ctx) {
+	duk_size_t hlen, dlen;
+	const char *host = duk_to_lstring(ctx, 0, &hlen);
+	const char *domain = duk_to_lstring(ctx, 1, &dlen);
+
+	duk_push_boolean(ctx, hlen >= dlen && !memcmp(host + hlen - dlen, domain, dlen));
+	return 1;
+}
+
+static duk_ret_t native_dnsdomainlevels(duk_context *ctx) {
+	duk_size_t len;
+	const char *host = duk_to_lstring(ctx, 0, &len);
+	int levels = 0;
+
+	while (len--)
+		levels += host[len] == '.';
+	duk_push_int(ctx, levels);
+	return 1;
+}
+
+static duk_ret_t native_isplainhostname(duk_context *ctx) {
+	duk_size_t len;
+	const char *host = duk_to_lstring(ctx, 0, &len);
+
+	duk_push_boolean(ctx, !memchr(host, '.', len) && !memchr(host, ':', len));
+	return 1;
+}
+
+static duk_ret_t native_localhostordomainis(duk_context *ctx) {
+	duk_size_t hlen, dlen;
+	const char *host = duk_to_lstring(ctx, 0, &hlen);
+	const char *hostdom = duk_to_lstring(ctx, 1, &dlen);
+
+	duk_push_boolean(ctx, (hlen == dlen && !memcmp(host, hostdom, hlen))
+		|| (dlen > hlen && !memcmp(host, hostdom, hlen) && hostdom[hlen] == '.'));
+	return 1;
+}
+
+/*
+ * Dotted quad with 1-3 digits per byte, like the regular expression of
+ * isValidIpAddress(). Stores the address if valid.
+ */
+static int pac_valid_ip(const char *s, duk_size_t len, duk_uint32_t *addr) {
+	const char *end = s + len;
+	unsigned int byte;
+	int digits;
+	int i;
+
+	*addr = 0;
+	for (i = 0; i < 4; ++i) {
+		if (i && (s == end || *s++ != '.'))
+			return 0;
+		for (byte = 0, digits = 0; s < end && *s >= '0' && *s <= '9' && digits < 3; ++digits)
+			byte = byte * 10 + (*s++ - '0');
+		if (!digits || byte > 255)
+			return 0;
+		*addr = (*addr << 8) | byte;
+	}
+
+	return s == end;
+}
+
+/*
+ * convert_addr(): split at dots, each part is converted to a number and
+ * masked to a byte, missing parts are 0.
+ */
+static duk_uint32_t pac_convert_addr(duk_context *ctx, const char *s, duk_size_t len) {
+	const char *end = s + len;
+	const char *dot;
+	duk_uint32_t addr = 0;
+	duk_uint32_t byte;
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		byte = 0;
+		if (s) {
+			dot = memchr(s, '.', end - s);
+			duk_push_lstring(ctx, s, (dot ? dot : end) - s);
+			byte = duk_to_int32(ctx, -1) & 0xff;
+			duk_pop(ctx);
+			s = dot ? dot + 1 : NULL;
+		}
+		addr = (addr << 8) | byte;
+	}
+
+	return addr;
+}
+
+static duk_ret_t native_isvalidipaddress(duk_context *ctx) {
+	duk_uint32_t addr;
+	duk_size_t len;
+	const char *ip = duk_to_lstring(ctx, 0, &len);
+
+	duk_push_boolean(ctx, pac_valid_ip(ip, len, &addr));
+	return 1;
+}
+
+static duk_ret_t native_convert_addr(duk_context *ctx) {
+	duk_size_t len;
+	const char *ip = duk_to_lstring(ctx, 0, &len);
+
+	duk_push_int(ctx, (duk_int32_t)pac_convert_addr(ctx, ip, len));
+	return 1;
+}
+
+static duk_ret_t native_isinnet(duk_context *ctx) {
+	duk_uint32_t host, pat, mask;
+	duk_size_t len;
+	const char *str;
+
+	str = duk_to_lstring(ctx, 1, &len);
+	if (!pac_valid_ip(str, len, &pat)) {
+		duk_push_false(ctx);
+		return 1;
+	}
+	str = duk_to_lstring(ctx, 2, &len);
+	if (!pac_valid_ip(str, len, &mask)) {
+		duk_push_false(ctx);
+		return 1;
+	}
+
+	str = duk_to_lstring(ctx, 0, &len);
+	if (!pac_valid_ip(str, len, &host)) {
+		duk_get_global_string(ctx, "dnsResolve");
+		duk_dup(ctx, 0);
+		duk_call(ctx, 1);
+		if (duk_is_null_or_undefined(ctx, -1)) {
+			duk_push_false(ctx);
+			return 1;
+		}
+		str = duk_to_lstring(ctx, -1, &len);
+		host = pac_convert_addr(ctx, str, len);
+	}
+
+	duk_push_boolean(ctx, (host & mask) == (pat & mask));
+	return 1;
+}
+
+/*
+ * Full match of str against a pattern with * and ? wildcards.
+ */
+static int pac_glob(const char *str, const char *pat) {
+	const char *star = NULL;
+	const char *mark = NULL;
+
+	while (*str) {
+		if (*pat == '*') {
+			star = pat++;
+			mark = str;
+		} else if (*pat == '?' || *pat == *str) {
+			pat++;
+			str++;
+		} else if (star) {
+			pat = star + 1;
+			str = ++mark;
+		} else {
+			return 0;
 		}
-		duk_push_string(ctx, s);
-		freeifaddrs(addrs);
+	}
+	while (*pat == '*')
+		pat++;
+
+	return !*pat;
+}
+
+/*
+ * shExpMatch() turns the pattern into a regular expression by escaping
+ * dots only, so other special characters keep their meaning there. Such
+ * patterns still go to RegExp, as do URLs where "." and "?" would not
+ * match one byte: line terminators and non-ASCII characters.
+ */
+static duk_ret_t native_shexpmatch(duk_context *ctx) {
+	duk_size_t ulen, plen, i, n;
+	const char *url = duk_to_lstring(ctx, 0, &ulen);
+	const char *pattern = duk_to_lstring(ctx, 1, &plen);
+	int simple = strlen(url) == ulen && strlen(pattern) == plen
+		&& !pattern[strcspn(pattern, "\\^$+()[]{}|")];
+	char *re;
+
+	for (i = 0; simple && i < ulen; ++i)
+		simple = !(url[i] & 0x80) && url[i] != '\n' && url[i] != '\r';
+	if (simple) {
+		duk_push_boolean(ctx, pac_glob(url, pattern));
+		return 1;
 	}
 
+	re = (char *)malloc(plen * 2 + 2);
+	if (!re)
+		return duk_error(ctx, DUK_ERR_ERROR, "out of memory");
+	n = 0;
+	re[n++] = '^';
+	for (i = 0; i < plen; ++i) {
+		if (pattern[i] == '.' || pattern[i] == '*')
+			re[n++] = pattern[i] == '.' ? '\\' : '.';
+		re[n++] = pattern[i] == '?' ? '.' : pattern[i];
+	}
+	re[n++] = '$';
+
+	duk_get_global_string(ctx, "RegExp");
+	duk_push_lstring(ctx, re, n);
+	free(re);
+	duk_new(ctx, 1);
+	duk_push_string(ctx, "test");
+	duk_dup(ctx, 0);
+	duk_call_prop(ctx, -3, 1);
 	return 1;
 }
 
+static const duk_function_list_entry pac_natives[] = {
+	{ "dnsResolve", native_dnsresolve, 1 },
+	{ "myIpAddress", native_myipaddress, 0 },
+	{ "dnsDomainIs", native_dnsdomainis, 2 },
+	{ "dnsDomainLevels", native_dnsdomainlevels, 1 },
+	{ "isValidIpAddress", native_isvalidipaddress, 1 },
+	{ "convert_addr", native_convert_addr, 1 },
+	{ "isInNet", native_isinnet, 3 },
+	{ "isPlainHostName", native_isplainhostname, 1 },
+	{ "localHostOrDomainIs", native_localhostordomainis, 2 },
+	{ "shExpMatch", native_shexpmatch, 2 },
+	{ NULL, NULL, 0 }
+};
+
 char *read_file(const char* filename) {
     FILE    *fd;
     char    *buf;
@@ -104,52 +455,157 @@ char *read_file(const char* filename) {
     return buf;
 }
 
-// returns an escaped string or null if original string
-// does not need to be escaped, or it is null, 
-// or an allocation error happens
-char *escape_string(const char *str) {
-    if (!str)
+// compiles the source and returns a copy of its bytecode
+static void *pac_compile(duk_context *ctx, const char *source, const char *name, duk_size_t *len) {
+    void *code = NULL;
+    void *buf;
+
+    duk_push_string(ctx, name);
+    if (duk_pcompile_string_filename(ctx, 0, source) != 0) {
+        syslog(LOG_ERR, "Cannot compile %s: %s\n", name, duk_safe_to_string(ctx, -1));
+    } else {
+        duk_dump_function(ctx);
+        buf = duk_get_buffer(ctx, -1, len);
+        code = malloc(*len);
+        if (code)
+            memcpy(code, buf, *len);
+    }
+    duk_pop(ctx);
+
+    return code;
+}
+
+// loads the bytecode and runs it as global code
+static int pac_run(duk_context *ctx, const void *code, duk_size_t len, const char *name) {
+    int rc;
+
+    memcpy(duk_push_fixed_buffer(ctx, len), code, len);
+    duk_load_function(ctx);
+    rc = duk_pcall(ctx, 0) == DUK_EXEC_SUCCESS;
+    if (!rc)
+        syslog(LOG_ERR, "Cannot run %s: %s\n", name, duk_safe_to_string(ctx, -1));
+    duk_pop(ctx);
+
+    return rc;
+}
+
+static struct pac_context_s *pac_new_context(const struct pac_code_s *code) {
+    struct pac_context_s *pc;
+    duk_context *ctx = duk_create_heap_default();
+
+    if (!ctx)
         return NULL;
 
-    int n = 0;
-    const char *p = str;
-    while (*p) {
-        if (*p == '"' || *p == '\\')
-            n++;
-        p++;
+    duk_push_global_object(ctx);
+    duk_put_function_list(ctx, -1, pac_natives);
+    duk_pop(ctx);
+
+    if (!pac_run(ctx, pac_utils_bc, pac_utils_bclen, "pac_utils_js")
+            || !pac_run(ctx, code->bc, code->len, "PAC script")) {
+        duk_destroy_heap(ctx);
+        return NULL;
     }
-    if (n == 0)
+
+    // keep FindProxyForURL where the PAC script can't replace it
+    duk_push_heap_stash(ctx);
+    duk_get_global_string(ctx, "FindProxyForURL");
+    if (!duk_is_function(ctx, -1)) {
+        syslog(LOG_ERR, "PAC script has no FindProxyForURL function\n");
+        duk_destroy_heap(ctx);
         return NULL;
+    }
+    duk_put_prop_string(ctx, -2, "FindProxyForURL");
+    duk_pop(ctx);
 
-    char *newstr = (char*)calloc(p - str + n + 1, sizeof(char));
-    if (!newstr)
+    pc = (struct pac_context_s *)malloc(sizeof(struct pac_context_s));
+    if (!pc) {
+        duk_destroy_heap(ctx);
         return NULL;
+    }
+    pc->ctx = ctx;
+    pc->gen = code->gen;
+
+    return pc;
+}
 
-    char *q = newstr;
-    p = str;
-    while (*p) {
-        if (*p == '"' || *p == '\\')
-            *q++ = '\\';
-        *q++ = *p++;
+static void pac_free_context(struct pac_context_s *pc) {
+    duk_destroy_heap(pc->ctx);
+    free(pc);
+}
+
+// drops a reference to the script, called with pac_mtx held
+static void pac_put_code(struct pac_code_s *code) {
+    if (code && --code->refs == 0) {
+        free(code->bc);
+        free(code);
     }
-    *q = 0;
-    return newstr;
 }
 
-int pac_init(void) {
-    pac_ctx = duk_create_heap_default();
+// takes an idle context, creates a new one if there's none
+// and the limit allows, or waits for one
+static struct pac_context_s *pac_acquire(void) {
+    struct pac_context_s *pc;
+    struct pac_code_s *code;
+
+    pthread_mutex_lock(&pac_mtx);
+    while (pac_code && !pac_idle && pac_created >= pac_size)
+        pthread_cond_wait(&pac_cond, &pac_mtx);
+    if (!pac_code) {
+        pthread_mutex_unlock(&pac_mtx);
+        return NULL;
+    }
+    if (pac_idle) {
+        pc = pac_pool[--pac_idle];
+        pthread_mutex_unlock(&pac_mtx);
+        return pc;
+    }
+    pac_created++;
+    code = pac_code;
+    code->refs++;
+    pthread_mutex_unlock(&pac_mtx);
+
+    pc = pac_new_context(code);
+
+    pthread_mutex_lock(&pac_mtx);
+    pac_put_code(code);
+    if (!pc) {
+        pac_created--;
+        pthread_cond_signal(&pac_cond);
+    }
+    pthread_mutex_unlock(&pac_mtx);
+
+    return pc;
+}
+
+static void pac_release(struct pac_context_s *pc) {
+    pthread_mutex_lock(&pac_mtx);
+    if (pac_code && pc->gen == pac_code->gen) {
+        pac_pool[pac_idle++] = pc;
+        pc = NULL;
+    } else {
+        pac_created--;
+    }
+    pthread_cond_signal(&pac_cond);
+    pthread_mutex_unlock(&pac_mtx);
 
-    if (pac_ctx) {
-        duk_push_c_function(pac_ctx, native_dnsresolve, 1);
-        duk_put_global_string(pac_ctx, "dnsResolve");
-        duk_push_c_function(pac_ctx, native_myipaddress, 0);
-        duk_put_global_string(pac_ctx, "myIpAddress");
+    if (pc)
+        pac_free_context(pc);
+}
 
-        duk_eval_string(pac_ctx, pac_utils_js);
-        duk_pop(pac_ctx);
+int pac_init(int contexts) {
+    if (contexts <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        contexts = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (contexts <= 0)
+            contexts = 1;
     }
 
-    return pac_ctx != NULL;
+    pac_pool = (struct pac_context_s **)calloc(contexts, sizeof(struct pac_context_s *));
+    if (pac_pool)
+        pac_size = contexts;
+
+    return pac_pool != NULL;
 }
 
 int pac_parse_file(const char *pacfile) {
@@ -164,40 +620,227 @@ int pac_parse_file(const char *pacfile) {
 }
 
 int pac_parse_string(const char *pacstring) {
-    if (!pac_ctx)
+    struct pac_context_s **stale;
+    struct pac_context_s *pc;
+    struct pac_code_s *code;
+    struct pac_code_s *old;
+    duk_context *ctx;
+    int n = 0;
+
+    if (!pac_pool)
         return 0;
 
-    duk_eval_string(pac_ctx, pacstring);
-    duk_pop(pac_ctx);
+    code = (struct pac_code_s *)calloc(1, sizeof(struct pac_code_s));
+    if (!code)
+        return 0;
+
+    ctx = duk_create_heap_default();
+    if (!ctx) {
+        free(code);
+        return 0;
+    }
+    if (!pac_utils_bc)
+        pac_utils_bc = pac_compile(ctx, pac_utils_js, "pac_utils_js", &pac_utils_bclen);
+    code->bc = pac_compile(ctx, pacstring, "PAC script", &code->len);
+    duk_destroy_heap(ctx);
+
+    // the first context is created right away, which also checks the
+    // script, the others on demand
+    pthread_mutex_lock(&pac_mtx);
+    code->gen = ++pac_gen;
+    pthread_mutex_unlock(&pac_mtx);
+    pc = pac_utils_bc && code->bc ? pac_new_context(code) : NULL;
+    if (!pc) {
+        free(code->bc);
+        free(code);
+        return 0;
+    }
+
+    stale = (struct pac_context_s **)calloc(pac_size + 1, sizeof(struct pac_context_s *));
+    if (!stale) {
+        pac_free_context(pc);
+        free(code->bc);
+        free(code);
+        return 0;
+    }
+
+    // publish the new version
+    pthread_mutex_lock(&pac_mtx);
+    old = pac_code;
+    code->refs = 1;
+    pac_code = code;
+    while (pac_idle > 0)
+        stale[n++] = pac_pool[--pac_idle];
+    pac_created -= n;
+    if (pac_created < pac_size) {
+        pac_pool[pac_idle++] = pc;
+        pac_created++;
+    } else {
+        stale[n++] = pc;
+    }
+    pac_put_code(old);
+    pthread_cond_broadcast(&pac_cond);
+    pthread_mutex_unlock(&pac_mtx);
+
+    while (n > 0)
+        pac_free_context(stale[--n]);
+    free(stale);
 
     return 1;
 }
 
-const char *pac_find_proxy(const char *url, const char *host) {
-    if (!pac_ctx || !url || !host)
+char *pac_find_proxy(const char *url, const char *host) {
+    char *proxy = NULL;
+
+    if (!url || !host)
         return NULL;
 
-    char* escaped_url = escape_string(url);
-    char* escaped_host = escape_string(host);
+    struct pac_context_s *pc = pac_acquire();
+    if (!pc)
+        return NULL;
 
-    duk_push_sprintf(pac_ctx, "FindProxyForURL(\"%s\", \"%s\");",
-        escaped_url ? escaped_url : url,
-        escaped_host ? escaped_host : host);
-    duk_eval(pac_ctx);
-    const char* res = duk_get_string(pac_ctx, -1);
-    duk_pop(pac_ctx);
+    duk_context *ctx = pc->ctx;
+    duk_push_heap_stash(ctx);
+    duk_get_prop_string(ctx, -1, "FindProxyForURL");
+    duk_push_string(ctx, url);
+    duk_push_string(ctx, host);
+    if (duk_pcall(ctx, 2) != DUK_EXEC_SUCCESS)
+        syslog(LOG_ERR, "FindProxyForURL(%s) failed: %s\n", url, duk_safe_to_string(ctx, -1));
+    else if (!duk_is_string(ctx, -1))
+        syslog(LOG_ERR, "FindProxyForURL(%s) returned no string\n", url);
+    else
+        proxy = strdup(duk_get_string(ctx, -1));
+    duk_pop_2(ctx);
+
+    pac_release(pc);
+
+    return proxy;
+}
+
+/*
+ * The watcher thread parses the PAC file again when asked to by
+ * pac_reload() or, on Linux, when inotify reports a change in its
+ * directory which changed the file. Watching the directory catches
+ * editors which replace the file, and symlink swaps.
+ */
+static char *pac_watch_file = NULL;
+static void (*pac_reloaded)(void) = NULL;
+static int pac_reload_requested = 0;
+
+static int pac_file_changed(const struct stat *a, const struct stat *b) {
+    return a->st_dev != b->st_dev || a->st_ino != b->st_ino || a->st_size != b->st_size
+#ifdef __linux__
+        || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec
+#endif
+        || a->st_mtime != b->st_mtime;
+}
+
+static void *pac_watch(void *unused) {
+    struct stat last;
+    struct stat st;
+    int changed;
+    int fd = -1;
+#ifdef __linux__
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+    char *dir;
+    char *slash;
+
+    dir = strdup(pac_watch_file);
+    slash = dir ? strrchr(dir, '/') : NULL;
+    if (slash && slash == dir)
+        slash[1] = 0;               // file in the root directory
+    else if (slash)
+        *slash = 0;
+    fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd >= 0 && inotify_add_watch(fd, slash ? dir : ".",
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB) < 0) {
+        syslog(LOG_WARNING, "Cannot watch PAC file %s: %s\n", pac_watch_file, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+    free(dir);
+#endif
+
+    (void)unused;
+    if (stat(pac_watch_file, &last) != 0)
+        memset(&last, 0, sizeof(last));
+
+    for (;;) {
+        changed = 0;
+#ifdef __linux__
+        if (fd >= 0) {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 1000) > 0) {
+                usleep(100000);     // let the writer finish
+                while (read(fd, buf, sizeof(buf)) > 0)
+                    ;
+                changed = stat(pac_watch_file, &st) == 0 && pac_file_changed(&st, &last);
+            }
+        } else
+#endif
+            sleep(1);
+
+        if (__atomic_exchange_n(&pac_reload_requested, 0, __ATOMIC_ACQ_REL))
+            changed = 1;
+        if (!changed)
+            continue;
+
+        if (stat(pac_watch_file, &st) == 0)
+            last = st;
+        if (pac_parse_file(pac_watch_file)) {
+            syslog(LOG_INFO, "Reloaded PAC file %s\n", pac_watch_file);
+            if (pac_reloaded)
+                pac_reloaded();
+        } else {
+            syslog(LOG_ERR, "Cannot reload PAC file %s, keeping the old one\n", pac_watch_file);
+        }
+    }
+
+    return NULL;
+}
+
+void pac_reload(void) {
+    __atomic_store_n(&pac_reload_requested, 1, __ATOMIC_RELEASE);
+}
 
-    if (escaped_url)
-        free(escaped_url);
-    if (escaped_host)
-        free(escaped_host);
+int pac_watch_start(const char *pacfile, void (*reloaded)(void)) {
+    pthread_attr_t attr;
+    pthread_t thr;
+    int rc;
 
-    return res;
+#ifdef __linux__
+    myip_watch_start();
+#endif
+
+    pac_watch_file = strdup(pacfile);
+    if (!pac_watch_file)
+        return 0;
+    pac_reloaded = reloaded;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(&thr, &attr, pac_watch, NULL);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        syslog(LOG_ERR, "Cannot start PAC watcher thread: %d\n", rc);
+        return 0;
+    }
+
+    return 1;
 }
 
 void pac_cleanup(void) {
-    if (pac_ctx) {
-        duk_destroy_heap(pac_ctx);
-        pac_ctx = NULL;
+    pthread_mutex_lock(&pac_mtx);
+    while (pac_idle > 0) {
+        pac_free_context(pac_pool[--pac_idle]);
+        pac_created--;
     }
+    free(pac_utils_bc);
+    pac_utils_bc = NULL;
+    pac_put_code(pac_code);
+    pac_code = NULL;
+    pthread_cond_broadcast(&pac_cond);
+    pthread_mutex_unlock(&pac_mtx);
 }
@@ -23,40 +23,61 @@
 #define _PAC_H
 
 /// @brief Initializes pac parser.
+/// @param contexts Maximum number of JavaScript contexts, 0 for one per CPU.
 /// @returns 0 on failure and 1 on success.
 ///
-/// Initializes Duktape JavaScript engine and does few basic initializations specific
-/// to pac.
-int pac_init(void);
+/// Prepares a pool of Duktape JavaScript contexts, so that as many PAC lookups
+/// can run in parallel.
+int pac_init(int contexts);
 
 /// @brief Parses the given PAC file.
 /// @param pacfile PAC file to parse.
 /// @returns 0 on failure and 1 on success.
 ///
-/// Reads the given PAC file and evaluates it in the JavaScript context created
-/// by pac_init.
+/// Reads the given PAC file and evaluates it in a new JavaScript context of
+/// the pool created by pac_init. See pac_parse_string.
 int pac_parse_file(const char *pacfile);       // PAC file to parse
 
 /// @brief Parses the given PAC script string.
 /// @param pacstring PAC string to parse.
 /// @returns 0 on failure and 1 on success.
 ///
-/// Evaulates the given PAC script string in the JavaScript context created
-/// by pac_init.
+/// Evaulates the given PAC script string in a new JavaScript context of the
+/// pool created by pac_init. Further contexts evaluate it when created.
+/// If a script was parsed before, it is replaced: lookups in progress finish
+/// with the old script, new ones use the new one. On failure, the old script
+/// stays in use.
 int pac_parse_string(const char *pacstring);      // PAC string to parse
 
 /// @brief Finds proxy for the given URL and Host.
 /// @param url URL to find proxy for.
 /// @param host Host part of the URL.
-/// @returns proxy string on sucess and NULL on error.
+/// @returns proxy string on sucess, to be freed by the caller, and NULL on error.
 ///
 /// Finds proxy for the given URL and Host. This function should be called only
 /// after pac engine has been initialized (using pac_init) and pac
 /// script has been parsed (using pac_parse_file or pac_parse_string).
-const char *pac_find_proxy(const char *url,            // URL to find proxy for
-                           const char *host);          // Host part of the URL
+/// It is thread safe, waiting for a free context if all are busy.
+char *pac_find_proxy(const char *url,            // URL to find proxy for
+                     const char *host);          // Host part of the URL
 
-/// @brief Destroys JavaSctipt context.
+/// @brief Starts the background threads of the pac engine.
+/// @param pacfile PAC file to watch.
+/// @param reloaded Called after the PAC file was reloaded, or NULL.
+/// @returns 0 on failure and 1 on success.
+///
+/// Watches the given PAC file and parses it again whenever it changes (Linux
+/// only) or pac_reload is called, and myIpAddress changes (Linux only).
+/// Should be called once the process won't fork any more.
+int pac_watch_start(const char *pacfile,               // PAC file to watch
+                    void (*reloaded)(void));           // Callback after a reload
+
+/// @brief Requests a reload of the watched PAC file.
+///
+/// The reload is done by the thread started by pac_watch_start.
+void pac_reload(void);
+
+/// @brief Destroys JavaSctipt contexts.
 ///
 /// This function should be called once you're done with using pac engine.
 void pac_cleanup(void);
@@ -28,80 +28,17 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
-static const char* pac_utils_js =
-"function dnsDomainIs(host, domain) {\n"
-"  return (\n"
-"    host.length >= domain.length &&\n"
-"    host.substring(host.length - domain.length) == domain\n"
-"  );\n"
-"}\n"
-
-"function dnsDomainLevels(host) {\n"
-"  return host.split(\".\").length - 1;\n"
-"}\n"
-
-"function isValidIpAddress(ipchars) {\n"
-"  var matches = /^(\\d{1,3})\\.(\\d{1,3})\\.(\\d{1,3})\\.(\\d{1,3})$/.exec(ipchars);\n"
-"  if (matches == null) {\n"
-"    return false;\n"
-"  } else if (\n"
-"    matches[1] > 255 ||\n"
-"    matches[2] > 255 ||\n"
-"    matches[3] > 255 ||\n"
-"    matches[4] > 255\n"
-"  ) {\n"
-"    return false;\n"
-"  }\n"
-"  return true;\n"
-"}\n"
-
-"function convert_addr(ipchars) {\n"
-"  var bytes = ipchars.split(\".\");\n"
-"  var result =\n"
-"    ((bytes[0] & 0xff) << 24) |\n"
-"    ((bytes[1] & 0xff) << 16) |\n"
-"    ((bytes[2] & 0xff) << 8) |\n"
-"    (bytes[3] & 0xff);\n"
-"  return result;\n"
-"}\n"
-
-"function isInNet(ipaddr, pattern, maskstr) {\n"
-"  if (!isValidIpAddress(pattern) || !isValidIpAddress(maskstr)) {\n"
-"    return false;\n"
-"  }\n"
-"  if (!isValidIpAddress(ipaddr)) {\n"
-"    ipaddr = dnsResolve(ipaddr);\n"
-"    if (ipaddr == null) {\n"
-"      return false;\n"
-"    }\n"
-"  }\n"
-"  var host = convert_addr(ipaddr);\n"
-"  var pat = convert_addr(pattern);\n"
-"  var mask = convert_addr(maskstr);\n"
-"  return (host & mask) == (pat & mask);\n"
-"}\n"
-
-"function isPlainHostName(host) {\n"
-"  return host.search(\"(\\\\.)|:\") == -1;\n"
-"}\n"
+/*
+ * dnsDomainIs, dnsDomainLevels, isValidIpAddress, convert_addr, isInNet,
+ * isPlainHostName, localHostOrDomainIs and shExpMatch are native, see pac.c.
+ */
 
+static const char* pac_utils_js =
 "function isResolvable(host) {\n"
 "  var ip = dnsResolve(host);\n"
 "  return ip != null;\n"
 "}\n"
 
-"function localHostOrDomainIs(host, hostdom) {\n"
-"  return host == hostdom || hostdom.lastIndexOf(host + \".\", 0) == 0;\n"
-"}\n"
-
-"function shExpMatch(url, pattern) {\n"
-"  pattern = pattern.replace(/\\./g, \"\\\\.\");\n"
-"  pattern = pattern.replace(/\\*/g, \".*\");\n"
-"  pattern = pattern.replace(/\\?/g, \".\");\n"
-"  var newRe = new RegExp(\"^\" + pattern + \"$\");\n"
-"  return newRe.test(url);\n"
-"}\n"
-
 "var wdays = { SUN: 0, MON: 1, TUE: 2, WED: 3, THU: 4, FRI: 5, SAT: 6 };\n"
 "var months = {\n"
 "  JAN: 0,\n"
@@ -0,0 +1,317 @@
+/*
+ * These are the PAC decision cache routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "utils.h"
+#include "paccache.h"
+
+#define PACCACHE_SHARDS	16
+
+extern int debug;
+
+/*
+ * Results of FindProxyForURL(), so that most requests don't need the PAC
+ * engine at all. The key is the scheme and host of the URL, which is all
+ * that most PAC files look at, or the whole URL if asked to (PacCacheKey).
+ *
+ * Entries live for cache_ttl seconds and each shard keeps at most its part
+ * of the cache size, evicting the least recently used entry. Shards are
+ * picked by key hash and have their own lock, so lookups of different hosts
+ * rarely meet. paccache_flush() drops everything and bumps the generation;
+ * a result computed before that (paccache_get() returned the generation
+ * with the miss) is then not stored.
+ */
+
+struct paccache_entry_s {
+	unsigned int hash;
+	time_t expires;
+	char *key;
+	char *result;
+	struct paccache_entry_s *chain;		/* same bucket */
+	struct paccache_entry_s *prev;		/* LRU order, most recent first */
+	struct paccache_entry_s *next;
+};
+
+struct paccache_shard_s {
+	pthread_mutex_t mtx;
+	struct paccache_entry_s **buckets;
+	struct paccache_entry_s *head;
+	struct paccache_entry_s *tail;
+	int count;
+};
+
+static struct paccache_shard_s *shards = NULL;
+static unsigned int bucket_mask = 0;
+static int shard_max = 0;
+static int cache_ttl = DEFAULT_PAC_CACHE_TTL;
+static int cache_byurl = 0;
+static unsigned int generation = 0;
+
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+
+/*
+ * Make the cache key for a request into a new string and hash it.
+ */
+static char *paccache_key(const char *url, const char *hostname, unsigned int *hash) {
+	unsigned int h = 2166136261u;
+	const char *scheme;
+	char *key;
+	char *p;
+	size_t len;
+
+	if (cache_byurl) {
+		key = strdup(url);
+	} else {
+		scheme = strstr(url, "://");
+		len = scheme ? (size_t)(scheme - url) + 3 : 0;
+		key = zmalloc(len + strlen(hostname) + 1);
+		memcpy(key, url, len);
+		strcpy(key + len, hostname);
+		for (p = key; *p; ++p)
+			*p = tolower((unsigned char)*p);
+	}
+
+	for (p = key; *p; ++p)
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	*hash = h;
+
+	return key;
+}
+
+static void entry_unlink(struct paccache_shard_s *shard, struct paccache_entry_s *e) {
+	struct paccache_entry_s **pe;
+
+	for (pe = &shard->buckets[e->hash & bucket_mask]; *pe != e; pe = &(*pe)->chain)
+		;
+	*pe = e->chain;
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		shard->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		shard->tail = e->prev;
+
+	shard->count--;
+	free(e->key);
+	free(e->result);
+	free(e);
+}
+
+static void entry_touch(struct paccache_shard_s *shard, struct paccache_entry_s *e) {
+	if (shard->head == e)
+		return;
+
+	e->prev->next = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		shard->tail = e->prev;
+
+	e->prev = NULL;
+	e->next = shard->head;
+	shard->head->prev = e;
+	shard->head = e;
+}
+
+static struct paccache_entry_s *entry_find(struct paccache_shard_s *shard, const char *key, unsigned int hash) {
+	struct paccache_entry_s *e;
+
+	for (e = shard->buckets[hash & bucket_mask]; e; e = e->chain) {
+		if (e->hash == hash && !strcmp(e->key, key))
+			return e;
+	}
+
+	return NULL;
+}
+
+/*
+ * Allocate the cache for "size" results kept "ttl" seconds, keyed by the
+ * whole URL if "byurl". Until called, or with size 0, nothing is cached.
+ */
+void paccache_init(int size, int ttl, int byurl) {
+	unsigned int buckets = 1;
+	int i;
+
+	cache_ttl = MAX(ttl, 0);
+	cache_byurl = byurl;
+	if (size <= 0 || !cache_ttl)
+		return;
+
+	shard_max = MAX((size + PACCACHE_SHARDS - 1) / PACCACHE_SHARDS, 1);
+	while (buckets < (unsigned int)shard_max)
+		buckets <<= 1;
+	bucket_mask = buckets - 1;
+
+	shards = (struct paccache_shard_s *)zmalloc(PACCACHE_SHARDS * sizeof(struct paccache_shard_s));
+	for (i = 0; i < PACCACHE_SHARDS; ++i) {
+		pthread_mutex_init(&shards[i].mtx, NULL);
+		shards[i].buckets = (struct paccache_entry_s **)zmalloc(buckets * sizeof(struct paccache_entry_s *));
+	}
+
+	if (debug)
+		printf("PAC cache: %d entries by %s, TTL %d s\n", shard_max * PACCACHE_SHARDS, byurl ? "URL" : "host", cache_ttl);
+}
+
+/*
+ * Look up the PAC result for a request.
+ *
+ * Returns: a copy of the result, to be freed by the caller, or NULL if not
+ * cached; then *gen is for paccache_put().
+ */
+char *paccache_get(const char *url, const char *hostname, unsigned int *gen) {
+	struct paccache_shard_s *shard;
+	struct paccache_entry_s *e;
+	unsigned int hash;
+	char *result = NULL;
+	char *key;
+
+	*gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+	if (!shards || !url || !hostname)
+		return NULL;
+
+	key = paccache_key(url, hostname, &hash);
+	shard = &shards[(hash >> 24) % PACCACHE_SHARDS];
+
+	pthread_mutex_lock(&shard->mtx);
+	e = entry_find(shard, key, hash);
+	if (e && e->expires <= time(NULL)) {
+		entry_unlink(shard, e);
+		e = NULL;
+	}
+	if (e) {
+		entry_touch(shard, e);
+		result = strdup(e->result);
+	}
+	pthread_mutex_unlock(&shard->mtx);
+
+	if (debug)
+		printf("PAC cache %s: %s\n", result ? "hit" : "miss", key);
+	free(key);
+
+	__atomic_add_fetch(result ? &hits : &misses, 1, __ATOMIC_RELAXED);
+
+	return result;
+}
+
+/*
+ * Store the PAC result for a request, unless the cache was flushed since
+ * the lookup which returned gen.
+ */
+void paccache_put(const char *url, const char *hostname, const char *result, unsigned int gen) {
+	struct paccache_shard_s *shard;
+	struct paccache_entry_s *e;
+	unsigned int hash;
+	char *key;
+
+	if (!shards || !url || !hostname || !result)
+		return;
+
+	key = paccache_key(url, hostname, &hash);
+	shard = &shards[(hash >> 24) % PACCACHE_SHARDS];
+
+	pthread_mutex_lock(&shard->mtx);
+	if (__atomic_load_n(&generation, __ATOMIC_ACQUIRE) != gen) {
+		pthread_mutex_unlock(&shard->mtx);
+		free(key);
+		return;
+	}
+
+	e = entry_find(shard, key, hash);
+	if (e) {
+		free(key);
+		free(e->result);
+		entry_touch(shard, e);
+	} else {
+		if (shard->count >= shard_max)
+			entry_unlink(shard, shard->tail);
+
+		e = (struct paccache_entry_s *)zmalloc(sizeof(struct paccache_entry_s));
+		e->hash = hash;
+		e->key = key;
+		e->chain = shard->buckets[hash & bucket_mask];
+		shard->buckets[hash & bucket_mask] = e;
+		e->next = shard->head;
+		if (shard->head)
+			shard->head->prev = e;
+		else
+			shard->tail = e;
+		shard->head = e;
+		shard->count++;
+	}
+	e->result = strdup(result);
+	e->expires = time(NULL) + cache_ttl;
+	pthread_mutex_unlock(&shard->mtx);
+}
+
+/*
+ * Forget all results, e.g. because the PAC script changed.
+ */
+void paccache_flush(void) {
+	int i;
+
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+	if (!shards)
+		return;
+
+	for (i = 0; i < PACCACHE_SHARDS; ++i) {
+		pthread_mutex_lock(&shards[i].mtx);
+		while (shards[i].head)
+			entry_unlink(&shards[i], shards[i].head);
+		pthread_mutex_unlock(&shards[i].mtx);
+	}
+}
+
+void paccache_stats(struct paccache_stats_s *stats) {
+	int i;
+
+	stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+	stats->entries = 0;
+	for (i = 0; shards && i < PACCACHE_SHARDS; ++i) {
+		pthread_mutex_lock(&shards[i].mtx);
+		stats->entries += shards[i].count;
+		pthread_mutex_unlock(&shards[i].mtx);
+	}
+}
+
+void paccache_free(void) {
+	int i;
+
+	if (!shards)
+		return;
+
+	paccache_flush();
+	for (i = 0; i < PACCACHE_SHARDS; ++i) {
+		pthread_mutex_destroy(&shards[i].mtx);
+		free(shards[i].buckets);
+	}
+	free(shards);
+	shards = NULL;
+}
@@ -0,0 +1,42 @@
+/*
+ * These are the PAC decision cache routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _PACCACHE_H
+#define _PACCACHE_H
+
+#define DEFAULT_PAC_CACHE_SIZE	1024
+#define DEFAULT_PAC_CACHE_TTL	60
+
+/*
+ * Snapshot of the cache counters, see paccache_stats().
+ */
+struct paccache_stats_s {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned int entries;
+};
+
+extern void paccache_init(int size, int ttl, int byurl);
+extern char *paccache_get(const char *url, const char *hostname, unsigned int *gen);
+extern void paccache_put(const char *url, const char *hostname, const char *result, unsigned int gen);
+extern void paccache_flush(void);
+extern void paccache_stats(struct paccache_stats_s *stats);
+extern void paccache_free(void);
+
+#endif /* _PACCACHE_H */
@@ -0,0 +1,218 @@
+/*
+ * Conformance and speed test of the native PAC helpers (make pactest)
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "pac.h"
+
+int debug = 0;
+
+/*
+ * The JavaScript versions of the helpers pac.c implements natively, as
+ * they were in pac_utils_js.h, renamed to ref_*, and a PAC script which
+ * compares both on a table of arguments (FindProxyForURL(url, "check"))
+ * or runs the four most used ones in a loop (hosts "native" and "js").
+ *
+ * https://searchfox.org/mozilla-central/source/netwerk/base/ascii_pac_utils.js
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+static const char *pactest_js =
+"function ref_dnsDomainIs(host, domain) {\n"
+"  return (\n"
+"    host.length >= domain.length &&\n"
+"    host.substring(host.length - domain.length) == domain\n"
+"  );\n"
+"}\n"
+"function ref_dnsDomainLevels(host) {\n"
+"  return host.split(\".\").length - 1;\n"
+"}\n"
+"function ref_isValidIpAddress(ipchars) {\n"
+"  var matches = /^(\\d{1,3})\\.(\\d{1,3})\\.(\\d{1,3})\\.(\\d{1,3})$/.exec(ipchars);\n"
+"  if (matches == null) {\n"
+"    return false;\n"
+"  } else if (\n"
+"    matches[1] > 255 ||\n"
+"    matches[2] > 255 ||\n"
+"    matches[3] > 255 ||\n"
+"    matches[4] > 255\n"
+"  ) {\n"
+"    return false;\n"
+"  }\n"
+"  return true;\n"
+"}\n"
+"function ref_convert_addr(ipchars) {\n"
+"  var bytes = ipchars.split(\".\");\n"
+"  var result =\n"
+"    ((bytes[0] & 0xff) << 24) |\n"
+"    ((bytes[1] & 0xff) << 16) |\n"
+"    ((bytes[2] & 0xff) << 8) |\n"
+"    (bytes[3] & 0xff);\n"
+"  return result;\n"
+"}\n"
+"function ref_isInNet(ipaddr, pattern, maskstr) {\n"
+"  if (!ref_isValidIpAddress(pattern) || !ref_isValidIpAddress(maskstr)) {\n"
+"    return false;\n"
+"  }\n"
+"  if (!ref_isValidIpAddress(ipaddr)) {\n"
+"    ipaddr = dnsResolve(ipaddr);\n"
+"    if (ipaddr == null) {\n"
+"      return false;\n"
+"    }\n"
+"  }\n"
+"  var host = ref_convert_addr(ipaddr);\n"
+"  var pat = ref_convert_addr(pattern);\n"
+"  var mask = ref_convert_addr(maskstr);\n"
+"  return (host & mask) == (pat & mask);\n"
+"}\n"
+"function ref_isPlainHostName(host) {\n"
+"  return host.search(\"(\\\\.)|:\") == -1;\n"
+"}\n"
+"function ref_localHostOrDomainIs(host, hostdom) {\n"
+"  return host == hostdom || hostdom.lastIndexOf(host + \".\", 0) == 0;\n"
+"}\n"
+"function ref_shExpMatch(url, pattern) {\n"
+"  pattern = pattern.replace(/\\./g, \"\\\\.\");\n"
+"  pattern = pattern.replace(/\\*/g, \".*\");\n"
+"  pattern = pattern.replace(/\\?/g, \".\");\n"
+"  var newRe = new RegExp(\"^\" + pattern + \"$\");\n"
+"  return newRe.test(url);\n"
+"}\n"
+"var hosts = [\"\", \"a\", \"a.b\", \"www.example.com\", \".example.com\", \"example.com\", \"EXAMPLE.com\", \"x:80\", \"1.2.3.4\",\n"
+"  \"10.1.2.3\", \"255.255.255.255\", \"256.1.1.1\", \"1.2.3\", \"1.2.3.4.5\", \"01.02.003.004\", \"0010.1.1.1\", \"1..2.3\", \" 1.2.3.4\",\n"
+"  \"1.2.3.4 \", \"1.2.3.x\", \"0x10.1.1.1\", \"localhost\", \"127.0.0.1\", \"a\\u2028b\", \"\\u00e9.example.com\", \"x\\u00e9y.com\", \"a\\nb\", \"1e2.1.1.1\",\n"
+"  \"-1.2.3.4\", \"999.1.1.1\", \"1.2.3.4\\n\", \"www\", \"www.\", \"com\"];\n"
+"var pats = [\"*\", \"?\", \"*.example.com\", \"www.*\", \"*example*\", \"w?w.*\", \"a.b\", \"a*b\", \"*.com\", \"1.2.3.*\", \"10.*\", \"\",\n"
+"  \"a+b\", \"[ab].b\", \"*(x)*\", \"a|b\", \"^a\", \"x$\", \"*:80\", \"??????????????????\", \"**\", \"*?*\", \".*\", \"a\\\\.b\", \"{1}\"];\n"
+"var nets = [[\"10.0.0.0\", \"255.0.0.0\"], [\"1.2.3.0\", \"255.255.255.0\"], [\"0.0.0.0\", \"0.0.0.0\"], [\"1.2.3.4\", \"255.255.255.255\"],\n"
+"  [\"bad\", \"255.0.0.0\"], [\"10.0.0.0\", \"x\"], [\"127.0.0.0\", \"255.0.0.0\"]];\n"
+"function cmp(name, a, b, args) { if (a !== b) throw new Error(name + \"(\" + JSON.stringify(args) + \"): \" + a + \" vs \" + b); }\n"
+"function check() {\n"
+"  var n = 0;\n"
+"  for (var i = 0; i < hosts.length; i++) {\n"
+"    var h = hosts[i];\n"
+"    cmp(\"dnsDomainLevels\", dnsDomainLevels(h), ref_dnsDomainLevels(h), [h]);\n"
+"    cmp(\"isPlainHostName\", isPlainHostName(h), ref_isPlainHostName(h), [h]);\n"
+"    cmp(\"isValidIpAddress\", isValidIpAddress(h), ref_isValidIpAddress(h), [h]);\n"
+"    cmp(\"convert_addr\", convert_addr(h), ref_convert_addr(h), [h]);\n"
+"    n += 4;\n"
+"    for (var j = 0; j < hosts.length; j++) {\n"
+"      cmp(\"dnsDomainIs\", dnsDomainIs(h, hosts[j]), ref_dnsDomainIs(h, hosts[j]), [h, hosts[j]]);\n"
+"      cmp(\"localHostOrDomainIs\", localHostOrDomainIs(h, hosts[j]), ref_localHostOrDomainIs(h, hosts[j]), [h, hosts[j]]);\n"
+"      n += 2;\n"
+"    }\n"
+"    for (var j = 0; j < pats.length; j++) {\n"
+"      var a, b;\n"
+"      try { a = shExpMatch(h, pats[j]); } catch (e) { a = \"throw\"; }\n"
+"      try { b = ref_shExpMatch(h, pats[j]); } catch (e) { b = \"throw\"; }\n"
+"      cmp(\"shExpMatch\", a, b, [h, pats[j]]);\n"
+"      n++;\n"
+"    }\n"
+"    for (var j = 0; j < nets.length; j++) {\n"
+"      if (!ref_isValidIpAddress(h) && h != \"localhost\") continue;\n"
+"      cmp(\"isInNet\", isInNet(h, nets[j][0], nets[j][1]), ref_isInNet(h, nets[j][0], nets[j][1]), [h, nets[j]]);\n"
+"      n++;\n"
+"    }\n"
+"  }\n"
+"  // extra shExpMatch fuzz over a small alphabet\n"
+"  var al = [\"a\", \"b\", \".\", \"*\", \"?\"];\n"
+"  var strs = [\"\"];\n"
+"  for (var l = 0; l < 4; l++) { var next = []; for (var k = 0; k < strs.length; k++) for (var m = 0; m < al.length; m++) next.push(strs[k] + al[m]); strs = strs.concat(next); }\n"
+"  for (var i = 0; i < strs.length; i += 3) for (var j = 0; j < strs.length; j += 5) {\n"
+"    cmp(\"shExpMatch\", shExpMatch(strs[i], strs[j]), ref_shExpMatch(strs[i], strs[j]), [strs[i], strs[j]]); n++;\n"
+"  }\n"
+"  return n;\n"
+"}\n"
+"function bench(native, iters) {\n"
+"  var f = native ? [dnsDomainIs, isInNet, shExpMatch, isPlainHostName] : [ref_dnsDomainIs, ref_isInNet, ref_shExpMatch, ref_isPlainHostName];\n"
+"  var c = 0;\n"
+"  for (var i = 0; i < iters; i++) {\n"
+"    c += f[0](\"www.example.com\", \".example.com\") ? 1 : 0;\n"
+"    c += f[1](\"10.1.2.3\", \"10.0.0.0\", \"255.0.0.0\") ? 1 : 0;\n"
+"    c += f[2](\"http://www.example.com/path/x\", \"*.example.com/*\") ? 1 : 0;\n"
+"    c += f[3](\"www.example.com\") ? 1 : 0;\n"
+"  }\n"
+"  return c;\n"
+"}\n"
+"function FindProxyForURL(url, host) {\n"
+"  if (host == \"check\") { try { return \"OK \" + check(); } catch (e) { return \"FAIL \" + e.message; } }\n"
+"  if (host == \"native\") return \"\" + bench(true, 20000);\n"
+"  return \"\" + bench(false, 20000);\n"
+"}\n";
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run the "host" mode of the script and print how long it took.
+ */
+static double bench(const char *host) {
+	double start;
+	char *result;
+
+	start = now();
+	result = pac_find_proxy("http://www.example.com/", host);
+	start = now() - start;
+	printf("pactest: %-6s %s rounds in %.3f s\n", host, result ? result : "(failed)", start);
+	free(result);
+
+	return start;
+}
+
+int main(void) {
+	double js;
+	double native;
+	char *result;
+	int rc;
+
+	openlog("pactest", LOG_PERROR, LOG_USER);
+
+	if (!pac_init(1) || !pac_parse_string(pactest_js)) {
+		fprintf(stderr, "pactest: cannot load the test script\n");
+		return 2;
+	}
+
+	result = pac_find_proxy("http://check/", "check");
+	rc = !result || strncmp(result, "OK ", 3);
+	if (rc)
+		printf("pactest: FAILED: %s\n", result ? result : "no result");
+	else
+		printf("pactest: native and JS agree on %s cases\n", result + 3);
+	free(result);
+
+	js = bench("js");
+	native = bench("native");
+	if (native > 0)
+		printf("pactest: native helpers %.1fx as fast\n", js / native);
+
+	pac_cleanup();
+
+	return rc;
+}
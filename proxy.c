@@ -31,12 +31,14 @@
 #include "http.h"
 #include "ntlm.h"
 #include "proxy.h"
+#include "connpool.h"
 
 #ifdef ENABLE_KERBEROS
 #include "kerberos.h"
 #endif
 
 #include "pac.h"
+#include "paccache.h"
 
 /*
  * Proxy types defined by PAC specification. Used in proxy_t to
@@ -51,6 +53,7 @@ typedef struct {
 	struct auth_s creds;
 	struct addrinfo *addresses;
 	int resolved;
+	struct connpool_s *pool;
 } proxy_t;
 
 typedef struct proxylist_s *proxylist_t;
@@ -61,24 +64,35 @@ struct proxylist_s {
 	struct proxylist_s *next;
 };
 
+/*
+ * Proxies for one PAC result string, in the order given. A list doesn't
+ * change once it's in the table, except for curr, the index of the proxy
+ * which worked last.
+ */
 typedef struct paclist_s *paclist_t;
-typedef const struct paclist_s *paclist_const_t;
 struct paclist_s {
-	const char *pacstr;
-	struct proxylist_s *proxylist;
-	unsigned long proxycurr;
+	char *pacstr;
+	unsigned int hash;
+	proxy_t **proxies;
 	int count;
-	struct paclist_s *next;
-}; 
+	unsigned int curr;
+	struct paclist_s *chain;	/* same bucket */
+	struct paclist_s *next;		/* all lists, for paclist_free() */
+};
 
-paclist_t pac_list = NULL;
-
-void paclist_free(paclist_t paclist);
+#define PACLIST_BUCKETS	256
 
 /*
- * Pac Mutex
+ * Lists by PAC result string. Lookups read the buckets without a lock,
+ * paclist_mtx serializes the writers. Lists dropped from the table by
+ * paclist_flush() may still be used by requests in progress, so all lists
+ * ever made stay on pac_list and are freed only on exit.
  */
-pthread_mutex_t pac_mtx = PTHREAD_MUTEX_INITIALIZER;
+paclist_t pac_table[PACLIST_BUCKETS];
+paclist_t pac_list = NULL;
+pthread_mutex_t paclist_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+void paclist_free(paclist_t paclist);
 
 /*
  * List of available proxies and current proxy id for proxy_connect().
@@ -153,23 +167,6 @@ proxylist_const_t proxylist_get_next(proxylist_const_t list, const unsigned long
 	return (t == NULL || t->next == NULL ? list : t->next);
 }
 
-/*
- * For debugging purposes - dump the entire contents
- * of a proxy list.
- */
-void proxylist_dump(proxylist_const_t list) {
-	proxylist_const_t t;
-
-	t = list;
-	while (t) {
-		if (t->proxy->type == DIRECT)
-			printf("List data: %lu => DIRECT\n", t->key);
-		else
-			printf("List data: %lu => %s:%d\n", t->key, t->proxy->hostname, t->proxy->port);
-		t = t->next;
-	}
-}
-
 /*
  * Free the list of proxy_t data.
  */
@@ -178,7 +175,7 @@ void proxylist_free(proxylist_t list, int free_proxy) {
 		proxylist_t t = list->next;
 		if (free_proxy) {
 			proxy_t *proxy = list->proxy;
-			freeaddrinfo(proxy->addresses);
+			so_freeaddr(proxy->addresses);
 			free(proxy);
 		}
 		free(list);
@@ -250,22 +247,47 @@ void parent_free(void) {
 	proxylist_free(parent_list, 1);
 }
 
+/*
+ * Return the parent proxy of the given type and address, adding it to
+ * the global list if it's not there yet.
+ */
+proxy_t *paclist_proxy(enum proxy_type_t type, const char *hostname, int port) {
+	proxylist_const_t p;
+	proxy_t *proxy;
+
+	pthread_mutex_lock(&parent_mtx);
+	for (p = parent_list; p; p = p->next) {
+		if (p->proxy->type == type && (type == DIRECT
+				|| (p->proxy->port == port && !strcmp(p->proxy->hostname, hostname))))
+			break;
+	}
+
+	if (p) {
+		proxy = p->proxy;
+	} else if (type == PROXY) {
+		proxy = proxylist_get(parent_list, parent_add(hostname, port));
+	} else {
+		proxy = (proxy_t *)zmalloc(sizeof(proxy_t));
+		proxy->type = DIRECT;
+		parent_list = proxylist_add(parent_list, ++parent_count, proxy);
+	}
+	pthread_mutex_unlock(&parent_mtx);
+
+	return proxy;
+}
+
 /*
  * Create list of proxy_t structs parsed from the PAC string returned
- * by Pac.
- * TODO: Harden against malformed pacp_str.
+ * by Pac. Empty and malformed entries are skipped; if none is left, the
+ * list is DIRECT.
  */
 paclist_t paclist_create(const char *pacp_str) {
 	paclist_t tmp;
-	proxylist_t plist = NULL;
-	int plist_count = 0;
 	char *pacp_tmp = NULL;
 	char *pacp_start = NULL;
 	char *cur_proxy = NULL;
-
-	if (pacp_str == NULL) {
-		return NULL;
-	}
+	int size = 1;
+	int i;
 
 	/* Make a copy of shared PAC string pacp_str (coming
 	 * from pac) to avoid manipulation by strsep.
@@ -273,120 +295,136 @@ paclist_t paclist_create(const char *pacp_str) {
 	pacp_start = strdup(pacp_str);
 	pacp_tmp = pacp_start; // save the pointer to this buffer so we can free it
 
-	cur_proxy = strsep(&pacp_tmp, ";");
+	for (cur_proxy = pacp_start; *cur_proxy; ++cur_proxy)
+		if (*cur_proxy == ';')
+			++size;
+
+	tmp = (paclist_t)zmalloc(sizeof(struct paclist_s));
+	tmp->pacstr = strdup(pacp_str);
+	tmp->proxies = (proxy_t **)zmalloc(size * sizeof(proxy_t *));
 
 	if (debug)
 		printf("Parsed PAC Proxies:\n");
 
-	while (cur_proxy != NULL) {
+	while ((cur_proxy = strsep(&pacp_tmp, ";")) != NULL) {
 		enum proxy_type_t type = DIRECT; // default is DIRECT
 		char *type_str = NULL;
 		char *hostname = NULL;
 		char *port = NULL;
-		proxy_t *proxy;
+		int iport = 0;
 
 		/* skip whitespace after semicolon */
-		if (*cur_proxy == ' ')
-			cur_proxy = cur_proxy + 1;
+		cur_proxy += strspn(cur_proxy, " ");
+		if (!*cur_proxy)
+			continue;
 
 		type_str = strsep(&cur_proxy, " ");
-		if (strcmp(type_str, "PROXY") == 0) {
+		if (strcmp(type_str, "PROXY") == 0 && cur_proxy) {
 			type = PROXY; // TODO: support more types
+			cur_proxy += strspn(cur_proxy, " ");
 			hostname = strsep(&cur_proxy, ":");
 			port = cur_proxy; // last token is always the port
+			iport = port ? atoi(port) : 0;
+			if (!*hostname || iport <= 0) {
+				syslog(LOG_WARNING, "Invalid proxy in PAC result: %s\n", pacp_str);
+				continue;
+			}
 		}
 
 		if (debug) {
 			if (type != DIRECT) {
-				printf("   %s %s %s\n", type_str, hostname, port);
+				printf("   %s %s %d\n", type_str, hostname, iport);
 			} else {
 				printf("   %s\n", type_str);
 			}
 		}
 
-		proxylist_t p = parent_list;
-		if (type == PROXY) {
-			int iport = atoi(port);
-			while (p != NULL && !(p->proxy->type == type && p->proxy->port == iport && !strcmp(p->proxy->hostname, hostname)))
-					p = p->next;
-			if (p == NULL) {
-				pthread_mutex_lock(&parent_mtx);
-				parent_add(hostname, iport);
-				proxy = proxylist_get(parent_list, parent_count);
-				plist = proxylist_add(plist, parent_count, proxy);
-				pthread_mutex_unlock(&parent_mtx);
-			}
-		} else { // type == DIRECT
-			while (p != NULL && p->proxy->type != type)
-				p = p->next;
-			if (p == NULL) {
-				proxy = (proxy_t *)zmalloc(sizeof(proxy_t));
-				proxy->type = DIRECT;
-				
-				pthread_mutex_lock(&parent_mtx);
-				++parent_count;
-				parent_list = proxylist_add(parent_list, parent_count, proxy);
-				plist = proxylist_add(plist, parent_count, proxy);
-				pthread_mutex_unlock(&parent_mtx);
-			}
-		}
-		if (p != NULL)
-			plist = proxylist_add(plist, p->key, p->proxy);
-
-		++plist_count;
-		cur_proxy = strsep(&pacp_tmp, ";"); /* get next proxy */
+		tmp->proxies[tmp->count++] = paclist_proxy(type, hostname, iport);
 	}
 
+	if (!tmp->count)
+		tmp->proxies[tmp->count++] = paclist_proxy(DIRECT, NULL, 0);
+
 	if (debug) {
-		printf("Created PAC list with %d item(s):\n", plist_count);
-		proxylist_dump(plist);
+		printf("Created PAC list with %d item(s):\n", tmp->count);
+		for (i = 0; i < tmp->count; ++i) {
+			if (tmp->proxies[i]->type == DIRECT)
+				printf("List data: %d => DIRECT\n", i);
+			else
+				printf("List data: %d => %s:%d\n", i, tmp->proxies[i]->hostname, tmp->proxies[i]->port);
+		}
 	}
 
 	free(pacp_start);
 
-	tmp = malloc(sizeof(struct paclist_s));
-	tmp->pacstr = pacp_str;
-	tmp->proxylist = plist;
-	tmp->proxycurr = 0;
-	tmp->count = plist_count;
-	tmp->next = NULL;
-
 	return tmp;
 }
 
+/*
+ * Find a list in a bucket chain.
+ */
+paclist_t paclist_find(paclist_t chain, const char *pacp_str, unsigned int hash) {
+	for (; chain; chain = chain->chain) {
+		if (chain->hash == hash && !strcmp(pacp_str, chain->pacstr))
+			break;
+	}
+
+	return chain;
+}
+
 /*
  * Returns the list of proxies associated with the pac string,
- * if it is not available it is created and added to the global
- * list of pac proxies lists.
+ * if it is not available it is created and added to the table
+ * of pac proxies lists.
  */
 paclist_t paclist_get(const char *pacp_str) {
-	paclist_t tmp;
-	paclist_t p = pac_list;
+	unsigned int hash = 2166136261u;
+	const char *s;
+	paclist_t *bucket;
+	paclist_t p;
 
-	while (p) {
-		if (strcmp(pacp_str, p->pacstr) == 0) {
-			if (debug)
-				printf("Found PAC list for [%s]\n", pacp_str);
-			return p;
-		}
-		p = p->next;
+	for (s = pacp_str; *s; ++s)
+		hash = (hash ^ (unsigned char)*s) * 16777619u;
+	bucket = &pac_table[hash % PACLIST_BUCKETS];
+
+	p = paclist_find(__atomic_load_n(bucket, __ATOMIC_ACQUIRE), pacp_str, hash);
+	if (p) {
+		if (debug)
+			printf("Found PAC list for [%s]\n", pacp_str);
+		return p;
 	}
 
-	tmp = paclist_create(pacp_str);
+	/*
+	 * Another thread may have added it in the meantime.
+	 */
+	pthread_mutex_lock(&paclist_mtx);
+	p = paclist_find(*bucket, pacp_str, hash);
+	if (!p) {
+		p = paclist_create(pacp_str);
+		p->hash = hash;
+		p->chain = *bucket;
+		p->next = pac_list;
+		pac_list = p;
+		__atomic_store_n(bucket, p, __ATOMIC_RELEASE);
 
-	if (pac_list == NULL) {
-		pac_list = tmp;
-	} else {
-		p = pac_list;
-		while (p->next)
-			p = p->next;
-		p->next = tmp;
+		if (debug)
+			printf("New PAC list for [%s]\n", pacp_str);
 	}
+	pthread_mutex_unlock(&paclist_mtx);
 
-	if (debug)
-		printf("New PAC list for [%s]\n", pacp_str);
+	return p;
+}
 
-	return tmp;
+/*
+ * Forget all lists, e.g. because the PAC file changed.
+ */
+void paclist_flush(void) {
+	int i;
+
+	pthread_mutex_lock(&paclist_mtx);
+	for (i = 0; i < PACLIST_BUCKETS; ++i)
+		__atomic_store_n(&pac_table[i], NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&paclist_mtx);
 }
 
 /*
@@ -395,7 +433,8 @@ paclist_t paclist_get(const char *pacp_str) {
 void paclist_free(paclist_t paclist) {
 	while (paclist) {
 		paclist_t t = paclist->next;
-		proxylist_free(paclist->proxylist, 0);
+		free(paclist->proxies);
+		free(paclist->pacstr);
 		free(paclist);
 		paclist = t;
 	}
@@ -409,47 +448,68 @@ void paclist_free(paclist_t paclist) {
  *
  * Writes required credentials into passed auth_s structure
  *
+ * If "pool" is given, an authenticated connection to the selected proxy is
+ * taken from its pool first, in which case *cached is set; either way *pool
+ * is where the connection can be stored for reuse.
+ *
+ * Unless "block", we only look into the pool of the selected proxy and
+ * never block: no PAC evaluation (a cached result or nothing), no name
+ * resolution, no connect() and no failover.
+ *
  * Returns >0 valid handle
  * Returns -1 if it fails connection with proxy
  * Returns -2 if connection is DIRECT
  */
-int proxy_connect(struct auth_s *credentials, const char* url, const char* hostname) {
-	proxylist_const_t proxylist;
+static int proxy_open(struct auth_s *credentials, const char* url, const char* hostname, struct connpool_s **pool, int *cached, int block) {
+	proxylist_const_t proxylist = NULL;
 	proxylist_const_t p;
-	unsigned long proxycurr;
+	unsigned long proxycurr = 0;
+	unsigned int paccurr = 0;
+	unsigned int pacfirst = 0;
 	proxy_t *proxy;
 	int i;
 	int loop = 0;
 	int proxycount = 0;
 
 	paclist_t paclist = NULL;
-	const char *pacp_str;
+	char *pacp_str;
+	unsigned int pacgen;
 	if (pac_initialized) {
 		/*
 		 * Create proxy list for request from PAC file.
 		 */
-		pthread_mutex_lock(&pac_mtx);
-		pacp_str = pac_find_proxy(url, hostname);
-		pthread_mutex_unlock(&pac_mtx);
+		pacp_str = paccache_get(url, hostname, &pacgen);
+		if (!pacp_str && !block)
+			return -1;
+		if (!pacp_str) {
+			pacp_str = pac_find_proxy(url, hostname);
+			paccache_put(url, hostname, pacp_str, pacgen);
+		}
 
-		paclist = paclist_get(pacp_str);
-		proxylist = paclist->proxylist;
-		proxycurr = paclist->proxycurr;
+		/*
+		 * Like browsers, go direct if the PAC script fails.
+		 */
+		paclist = paclist_get(pacp_str ? pacp_str : "DIRECT");
+		free(pacp_str);
+		paccurr = pacfirst = __atomic_load_n(&paclist->curr, __ATOMIC_RELAXED);
 		proxycount = paclist->count;
 	} else {
 		proxylist = parent_list;
 		proxycurr = parent_curr;
 		proxycount = parent_count;
-	}
 
-	if (proxycurr == 0 && proxylist) {
-		proxycurr = proxylist->key;
+		if (proxycurr == 0 && proxylist) {
+			proxycurr = proxylist->key;
+		}
 	}
 
 	do {
 		pthread_mutex_lock(&parent_mtx);
-		proxy = proxylist_get(proxylist, proxycurr);
-		if (proxy &&
+		if (paclist)
+			proxy = paclist->proxies[paccurr];
+		else
+			proxy = proxylist_get(proxylist, proxycurr);
+		if (block && proxy &&
 			proxy->type == PROXY &&
 			proxy->resolved == 0) {
 			if (debug)
@@ -460,21 +520,44 @@ int proxy_connect(struct auth_s *credentials, const char* url, const char* hostn
 				syslog(LOG_ERR, "Cannot resolve proxy %s\n", proxy->hostname);
 			}
 		}
+		if (proxy && proxy->type == PROXY && !proxy->pool)
+			proxy->pool = connpool_find(proxy->hostname, proxy->port, g_creds);
 		pthread_mutex_unlock(&parent_mtx);
 
 		if (proxy && proxy->type == DIRECT)
 			return -2;
 
 		i = -1;
-		if (proxy && proxy->resolved != 0)
-			i = so_connect(proxy->addresses);
+		if (proxy && pool) {
+			*pool = proxy->pool;
+			i = connpool_get(proxy->pool, credentials);
+			if (i >= 0) {
+				if (debug)
+					printf("Found authenticated connection %d to %s:%d!\n", i, proxy->hostname, proxy->port);
+				*cached = 1;
+				credentials = NULL;
+			}
+		}
+		if (i < 0 && !block)
+			break;
+		if (i < 0 && proxy && proxy->resolved != 0)
+			i = so_connect(proxy->addresses, connect_timeout);
 
 		/*
 		 * Resolve or connect failed?
 		 */
 		if (i < 0) {
-			p = proxylist_get_next(proxylist, proxycurr);
-			if (p) {
+			/*
+			 * Whatever is pooled for this proxy is likely dead too. Pools
+			 * of the other proxies are left alone.
+			 */
+			if (proxy)
+				connpool_flush(proxy->pool);
+			if (paclist) {
+				paccurr = (paccurr + 1) % paclist->count;
+				proxy = paclist->proxies[paccurr];
+				syslog(LOG_ERR, "Proxy connect failed, will try %s:%d\n", proxy->hostname, proxy->port);
+			} else if ((p = proxylist_get_next(proxylist, proxycurr))) {
 				proxycurr = p->key;
 				proxy = p->proxy;
 				syslog(LOG_ERR, "Proxy connect failed, will try %s:%d\n", proxy->hostname, proxy->port);
@@ -490,24 +573,12 @@ int proxy_connect(struct auth_s *credentials, const char* url, const char* hostn
 	if (i < 0 && loop >= proxycount)
 		syslog(LOG_ERR, "No proxy on the list works. You lose.\n");
 
-	/*
-	 * We have to invalidate the cached connections if we moved to a different proxy
-	 */
-	if (parent_curr != proxycurr) {
-		pthread_mutex_lock(&connection_mtx);
-		plist_const_t list = connection_list;
-		while (list) {
-			plist_const_t tmp = list->next;
-			close(list->key);
-			list = tmp;
-		}
-		plist_free(connection_list);
-		pthread_mutex_unlock(&connection_mtx);
-
+	if (paclist) {
+		if (paccurr != pacfirst)
+			__atomic_store_n(&paclist->curr, paccurr, __ATOMIC_RELAXED);
+	} else if (parent_curr != proxycurr) {
 		pthread_mutex_lock(&parent_mtx);
 		parent_curr = proxycurr;
-		if (pac_initialized && paclist)
-			paclist->proxycurr = proxycurr;
 		pthread_mutex_unlock(&parent_mtx);
 	}
 
@@ -517,6 +588,24 @@ int proxy_connect(struct auth_s *credentials, const char* url, const char* hostn
 	return i;
 }
 
+int proxy_connect(struct auth_s *credentials, const char* url, const char* hostname, struct connpool_s **pool, int *cached) {
+	return proxy_open(credentials, url, hostname, pool, cached, 1);
+}
+
+/*
+ * Authenticated connection from the pool of the proxy selected for the
+ * request, without blocking, see proxy_open().
+ *
+ * Returns >0 valid handle
+ * Returns -1 if there is none at hand
+ * Returns -2 if connection is DIRECT
+ */
+int proxy_pooled(struct auth_s *credentials, const char* url, const char* hostname, struct connpool_s **pool) {
+	int cached = 0;
+
+	return proxy_open(credentials, url, hostname, pool, &cached, 0);
+}
+
 /*
  * Send request, read reply, if it contains NTLM challenge, generate final
  * NTLM auth message and insert it into the original client header,
@@ -530,8 +619,12 @@ int proxy_connect(struct auth_s *credentials, const char* url, const char* hostn
  *
  * Caller must init & free "request" and "response" (if supplied)
  *
+ * If the parent closes the connection during the handshake, a new one is
+ * made through proxy_connect() if "reconnect". Without, that's a failure,
+ * so the connection is never moved to another parent (PAC or failover).
+ *
  */
-int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct auth_s *credentials) {
+static int proxy_handshake(int *sd, rr_data_t request, rr_data_t response, struct auth_s *credentials, int reconnect) {
 	char *tmp;
 	char *buf;
 	char *challenge;
@@ -595,8 +688,7 @@ int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct au
 	 * For broken ISA's that don't accept HEAD in auth request
 	 */
 	if (HEAD(request)) {
-		free(auth->method);
-		auth->method = strdup("GET");
+		rr_strset(auth, &auth->method, "GET");
 	}
 
 	auth->headers = hlist_mod(auth->headers, "Content-Length", "0", 1);
@@ -609,7 +701,7 @@ int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct au
 	}
 
 	if (!headers_send(*sd, auth)) {
-		close(*sd);
+		so_close(*sd);
 		goto bailout;
 	}
 
@@ -627,7 +719,7 @@ int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct au
 
 	reset_rr_data(auth);
 	if (!headers_recv(*sd, auth)) {
-		close(*sd);
+		so_close(*sd);
 		goto bailout;
 	}
 
@@ -642,7 +734,7 @@ int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct au
 	if (auth->code == 407) {
 		if (!http_body_drop(*sd, auth)) {				// FIXME: if below fails, we should forward what we drop here...
 			rc = 0;
-			close(*sd);
+			so_close(*sd);
 			goto bailout;
 		}
 		tmp = hlist_get(auth->headers, "Proxy-Authenticate");
@@ -672,13 +764,13 @@ int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct au
 						syslog(LOG_ERR, "No target info block. Cannot do NTLMv2!\n");
 						free(challenge);
 						free(tmp);
-						close(*sd);
+						so_close(*sd);
 						goto bailout;
 					}
 				} else {
 					syslog(LOG_ERR, "Proxy returning invalid challenge!\n");
 					free(challenge);
-					close(*sd);
+					so_close(*sd);
 					goto bailout;
 				}
 
@@ -696,7 +788,7 @@ int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct au
 			response->code = 407;				// See explanation above
 		if (!http_body_drop(*sd, auth)) {
 			rc = 0;
-			close(*sd);
+			so_close(*sd);
 			goto bailout;
 		}
 	}
@@ -706,9 +798,9 @@ int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct au
 	 */
 	if (so_closed(*sd)) {
 		if (debug)
-			printf("Proxy closed on us, reconnect.\n");
-		close(*sd);
-		*sd = proxy_connect(credentials, request->url, request->hostname);
+			printf("Proxy closed on us%s.\n", reconnect ? ", reconnect" : "");
+		so_close(*sd);
+		*sd = reconnect ? proxy_connect(credentials, request->url, request->hostname, NULL, NULL) : -1;
 		if (*sd < 0) {
 			rc = 0;
 			goto bailout;
@@ -723,3 +815,115 @@ bailout:
 
 	return rc;
 }
+
+/*
+ * Authenticate a client request, see proxy_handshake().
+ */
+int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct auth_s *credentials) {
+	return proxy_handshake(sd, request, response, credentials, 1);
+}
+
+/*
+ * Open a new connection to parent:port and authenticate it for the
+ * connection pools, using HEAD "url" (http://...) as the request. Nothing
+ * but parent:port is connected to, whatever PAC or failover would pick.
+ * Global credentials are used and copied into "credentials".
+ *
+ * Returns: socket descriptor or -1 on failure. If the parent announced its
+ * keep-alive timeout, *timeout is set to it.
+ */
+int proxy_warm(const char *parent, int port, const char *url, struct auth_s *credentials, int *timeout) {
+	struct addrinfo *addresses = NULL;
+	rr_data_t request;
+	rr_data_t response;
+	hlist_t tl;
+	char *host;
+	char *tmp;
+	int sd;
+	int rc = 0;
+
+#ifdef ENABLE_KERBEROS
+	/*
+	 * Kerberos tokens are acquired for curr_proxy, which we don't set.
+	 */
+	if (g_creds->haskrb)
+		return -1;
+#endif
+
+	if (!so_resolv(&addresses, parent, port))
+		return -1;
+	sd = so_connect(addresses, connect_timeout);
+	so_freeaddr(addresses);
+	if (sd < 0)
+		return -1;
+
+	copy_auth(credentials, g_creds, /* fullcopy */ 1);
+
+	request = new_rr_data();
+	response = new_rr_data();
+
+	host = strstr(url, "://") + 3;
+	host = substr(host, 0, (int)strcspn(host, "/"));
+	request->req = 1;
+	request->http_version = 11;
+	request->method = rr_strdup(request, "HEAD");
+	request->url = rr_strdup(request, url);
+	request->http = rr_strdup(request, "HTTP/1.1");
+	request->hostname = rr_strdup(request, host);
+	request->headers = hlist_add_arena(request->headers, &request->arena, "Host", request->hostname, HLIST_ALLOC);
+	request->headers = hlist_add_arena(request->headers, &request->arena, "Proxy-Connection", "keep-alive", HLIST_ALLOC);
+	free(host);
+
+	tl = header_list;
+	while (tl) {
+		request->headers = hlist_mod(request->headers, tl->key, tl->value, 1);
+		tl = tl->next;
+	}
+
+	if (debug)
+		printf("Warming up connection %d to %s:%d...\n", sd, parent, port);
+
+	if (!proxy_handshake(&sd, request, response, credentials, 0)) {
+		sd = -1;
+		goto bailout;
+	}
+
+	/*
+	 * It's a HEAD request, so proxy_authenticate() always leaves the
+	 * final step to us.
+	 */
+	if (response->code == 407) {
+		if (!headers_send(sd, request))
+			goto bailout;
+		reset_rr_data(response);
+		if (!headers_recv(sd, response))
+			goto bailout;
+		if (http_has_body(request, response) && !http_body_drop(sd, response))
+			goto bailout;
+	}
+
+	if (response->code == 407) {
+		syslog(LOG_ERR, "Authentication for pooled connection to %s:%d failed!\n", parent, port);
+		goto bailout;
+	}
+
+	if (!hlist_subcmp(response->headers, "Proxy-Connection", "keep-alive"))
+		goto bailout;
+
+	tmp = hlist_get(response->headers, "Keep-Alive");
+	if (tmp && (tmp = strstr(tmp, "timeout=")))
+		*timeout = atoi(tmp + 8);
+
+	rc = 1;
+
+bailout:
+	free_rr_data(&request);
+	free_rr_data(&response);
+
+	if (!rc && sd >= 0) {
+		so_close(sd);
+		sd = -1;
+	}
+
+	return sd;
+}
@@ -22,11 +22,16 @@
 #ifndef _PROXY_H
 #define _PROXY_H
 
-extern int proxy_connect(struct auth_s *credentials, const char* url, const char* hostname);
+struct connpool_s;
+
+extern int proxy_connect(struct auth_s *credentials, const char* url, const char* hostname, struct connpool_s **pool, int *cached);
+extern int proxy_pooled(struct auth_s *credentials, const char* url, const char* hostname, struct connpool_s **pool);
 extern int proxy_authenticate(int *sd, rr_data_t request, rr_data_t response, struct auth_s *creds);
+extern int proxy_warm(const char *parent, int port, const char *url, struct auth_s *credentials, int *timeout);
 
 extern int parent_add(const char *parent, int port);
 extern int parent_available(void);
 extern void parent_free(void);
+extern void paclist_flush(void);
 
 #endif
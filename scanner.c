@@ -98,7 +98,7 @@ int scanner_hook(rr_data_const_t request, rr_data_t response, struct auth_s *cre
 
 	len = 0;
 	do {
-		size = read(*sd, buf + len, SAMPLE - len - 1);
+		size = so_read(*sd, buf + len, SAMPLE - len - 1);
 		if (debug)
 			printf("scanner_hook: read %d of %d\n", size, SAMPLE - len);
 		if (size > 0)
@@ -227,14 +227,13 @@ int scanner_hook(rr_data_const_t request, rr_data_t response, struct auth_s *cre
 				newres = new_rr_data();
 				newreq = dup_rr_data(request);
 
-				free(newreq->method);
-				newreq->method = strdup("POST");
+				rr_strset(newreq, &newreq->method, "POST");
 				hlist_mod(newreq->headers, "Referer", request->url, 1);
 				hlist_mod(newreq->headers, "Content-Type", "application/x-www-form-urlencoded", 1);
 				hlist_mod(newreq->headers, "Content-Length", tmp, 1);
 				free(tmp);
 
-				nc = proxy_connect(credentials, newreq->url, newreq->hostname);
+				nc = proxy_connect(credentials, newreq->url, newreq->hostname, NULL, NULL);
 				c = proxy_authenticate(&nc, newreq, newres, credentials);
 				if (c && newres->code == 407) {
 					if (debug)
@@ -242,7 +241,7 @@ int scanner_hook(rr_data_const_t request, rr_data_t response, struct auth_s *cre
 				} else {
 					if (debug)
 						printf("scanner_hook: Authentication failed or refused!\n");
-					close(nc);
+					so_close(nc);
 					nc = 0;
 				}
 
@@ -270,7 +269,7 @@ int scanner_hook(rr_data_const_t request, rr_data_t response, struct auth_s *cre
 					 */
 					newres->skip_http = headers_initiated;
 					copy_rr_data(response, newres);
-					close(*sd);
+					so_close(*sd);
 					*sd = nc;
 
 					len = 0;
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -32,27 +33,307 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "utils.h"
+#include "socket.h"
+#include "dns.h"
 
 extern int debug;
 
 /*
- * getaddrinfo() wrapper. Return 1 if OK, otherwise 0.
- * Important: Caller is responsible for freeing addresses via freeaddrinfo()!
+ * Read buffers of connected sockets, indexed by descriptor. HTTP is both
+ * line and block oriented, so so_recvln() reads ahead in big chunks and
+ * keeps what's left after the line for the next so_recvln() or so_read().
+ *
+ * The table has two levels, the second one allocated on demand, so that
+ * we don't need to know the descriptor limit in advance. The buffers are
+ * allocated on first use and freed by so_close(). A descriptor is used by
+ * one thread at a time, the buffers need no locking.
+ *
+ * so_fill() grows a buffer up to SO_HEADMAX to hold a whole header block,
+ * its callers can't wait for the rest like so_recvhead() does.
  */
-int so_resolv(struct addrinfo **addresses, const char *hostname, const int port) {
-	struct addrinfo hints, *p;
-	char buf[6];
+#define SO_BUFSIZE	8192
+#define SO_HEADMAX	(64 * SO_BUFSIZE)
+#define SO_BUFS_L2	1024
+#define SO_BUFS_L1	1024
+
+struct so_buf_s {
+	char *data;
+	int size;
+	int start;
+	int end;
+};
+
+static struct so_buf_s *so_bufs[SO_BUFS_L1];
+
+static struct so_buf_s *so_buf(int fd, int create) {
+	struct so_buf_s *block;
+	struct so_buf_s *expected = NULL;
+
+	if (fd < 0 || fd >= SO_BUFS_L1 * SO_BUFS_L2)
+		return NULL;
+
+	block = __atomic_load_n(&so_bufs[fd / SO_BUFS_L2], __ATOMIC_ACQUIRE);
+	if (!block) {
+		if (!create)
+			return NULL;
+
+		block = (struct so_buf_s *)zmalloc(SO_BUFS_L2 * sizeof(struct so_buf_s));
+		if (!__atomic_compare_exchange_n(&so_bufs[fd / SO_BUFS_L2], &expected, block, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(block);
+			block = expected;
+		}
+	}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_socktype = SOCK_STREAM;
+	return &block[fd % SO_BUFS_L2];
+}
 
-	snprintf(buf, sizeof(buf), "%d", port);
-	int rc = getaddrinfo(hostname, buf, &hints, addresses);
-	if (rc != 0) {
+/*
+ * Drop any data read ahead from the descriptor.
+ */
+static void so_discard(int fd) {
+	struct so_buf_s *b = so_buf(fd, 0);
+
+	if (b && b->data) {
+		free(b->data);
+		b->data = NULL;
+		b->size = b->start = b->end = 0;
+	}
+}
+
+/*
+ * Number of bytes read ahead and not consumed yet.
+ */
+int so_pending(int fd) {
+	const struct so_buf_s *b = so_buf(fd, 0);
+
+	return b ? b->end - b->start : 0;
+}
+
+/*
+ * read() replacement, which returns the buffered data first. Once the
+ * buffer is empty, we read straight from the socket.
+ */
+ssize_t so_read(int fd, void *buf, size_t len) {
+	struct so_buf_s *b = so_buf(fd, 0);
+	size_t n;
+
+	if (b && b->end > b->start) {
+		n = MIN(len, (size_t)(b->end - b->start));
+		memcpy(buf, b->data + b->start, n);
+		b->start += n;
+		return n;
+	}
+
+	return read(fd, buf, len);
+}
+
+/*
+ * Look for the empty line ending a header block in buf[0..len). The scan
+ * resumes at *scanned, which is updated for the next call.
+ *
+ * Returns: length of the block including the empty line, 0 if incomplete.
+ */
+static int so_headend(const char *buf, int len, int *scanned) {
+	const char *end = buf + len;
+	const char *p = buf + *scanned;
+
+	while ((p = memchr(p, '\n', end - p))) {
+		p++;
+		if (p < end && *p == '\n')
+			return p + 1 - buf;
+		if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+			return p + 2 - buf;
+	}
+
+	/*
+	 * The last two bytes may be the start of the empty line
+	 */
+	*scanned = MAX(len - 2, 0);
+
+	return 0;
+}
+
+/*
+ * Receive the whole HTTP header block, up to and including the empty line,
+ * and return it NUL-terminated in "arena", to be parsed in place. Nothing
+ * past the header block is consumed.
+ *
+ * Headers normally fit in the read buffer and are copied just once. Longer
+ * ones are collected in a temporary buffer.
+ *
+ * Returns: length of the block, 0 on EOF or connection reset before any
+ * data, -1 on other errors or EOF inside the headers.
+ */
+int so_recvhead(int fd, struct arena_s *arena, char **head) {
+	struct so_buf_s *b;
+	char *spill = NULL;
+	char *tmp;
+	int spill_len = 0;
+	int spill_size = 0;
+	int scanned = 0;
+	int n;
+	int r;
+
+	b = so_buf(fd, 1);
+	if (!b) {
+		syslog(LOG_ERR, "so_recvhead: descriptor %d out of range\n", fd);
+		return -1;
+	}
+
+	if (!b->data) {
+		b->data = zmalloc(SO_BUFSIZE);
+		b->size = SO_BUFSIZE;
+		b->start = b->end = 0;
+	}
+
+	while (!spill) {
+		n = so_headend(b->data + b->start, b->end - b->start, &scanned);
+		if (n) {
+			*head = arena_strndup(arena, b->data + b->start, n);
+			b->start += n;
+			return n;
+		}
+
+		if (b->start > 0) {
+			memmove(b->data, b->data + b->start, b->end - b->start);
+			b->end -= b->start;
+			b->start = 0;
+		}
+
+		if (b->end == b->size) {
+			spill_size = 2 * b->size;
+			spill = malloc(spill_size);
+			if (!spill)
+				return -1;
+			memcpy(spill, b->data, b->end);
+			spill_len = b->end;
+			b->start = b->end = 0;
+			if (debug)
+				printf("so_recvhead(%d): headers over %d bytes\n", fd, b->size);
+			break;
+		}
+
+		r = read(fd, b->data + b->end, b->size - b->end);
+		if (r <= 0)
+			return ((r == 0 || errno == ECONNRESET) && b->end == 0 ? 0 : -1);
+		b->end += r;
+	}
+
+	for (;;) {
+		n = so_headend(spill, spill_len, &scanned);
+		if (n) {
+			*head = arena_strndup(arena, spill, n);
+
+			/*
+			 * What we read past the headers came with the last read(),
+			 * so it fits in the read buffer.
+			 */
+			memcpy(b->data, spill + n, spill_len - n);
+			b->start = 0;
+			b->end = spill_len - n;
+			free(spill);
+			return n;
+		}
+
+		if (spill_len == spill_size) {
+			spill_size *= 2;
+			tmp = realloc(spill, spill_size);
+			if (!tmp)
+				break;
+			spill = tmp;
+		}
+
+		r = read(fd, spill + spill_len, MIN(spill_size - spill_len, SO_BUFSIZE));
+		if (r <= 0)
+			break;
+		spill_len += r;
+	}
+
+	free(spill);
+
+	return -1;
+}
+
+/*
+ * Read whatever a non-blocking socket has into its read buffer. Callers
+ * driven by readiness events use this until so_headready(), after which
+ * so_recvhead() returns the headers without blocking.
+ *
+ * Returns: number of bytes read, 0 on EOF, -1 on error (EAGAIN if there
+ * is nothing to read yet) and -2 if the buffer is full at SO_HEADMAX.
+ */
+int so_fill(int fd) {
+	struct so_buf_s *b;
+	char *tmp;
+	int r;
+
+	b = so_buf(fd, 1);
+	if (!b) {
+		syslog(LOG_ERR, "so_fill: descriptor %d out of range\n", fd);
+		return -1;
+	}
+
+	if (!b->data) {
+		b->data = zmalloc(SO_BUFSIZE);
+		b->size = SO_BUFSIZE;
+		b->start = b->end = 0;
+	}
+
+	if (b->start > 0) {
+		memmove(b->data, b->data + b->start, b->end - b->start);
+		b->end -= b->start;
+		b->start = 0;
+	}
+
+	if (b->end == b->size) {
+		if (b->size >= SO_HEADMAX)
+			return -2;
+		tmp = realloc(b->data, 2 * b->size);
+		if (!tmp)
+			return -2;
+		b->data = tmp;
+		b->size *= 2;
+	}
+
+	r = read(fd, b->data + b->end, b->size - b->end);
+	if (r > 0)
+		b->end += r;
+
+	return r;
+}
+
+/*
+ * Return 1 if a whole header block is waiting in the read buffer.
+ */
+int so_headready(int fd) {
+	const struct so_buf_s *b = so_buf(fd, 0);
+	int scanned = 0;
+
+	return b && b->data && so_headend(b->data + b->start, b->end - b->start, &scanned) > 0;
+}
+
+/*
+ * Close the socket along with its read buffer. Use this instead of
+ * close() for all connected sockets.
+ */
+int so_close(int fd) {
+	so_discard(fd);
+	return close(fd);
+}
+
+/*
+ * Name resolution through the DNS cache. Return 1 if OK, otherwise 0.
+ * Important: Caller is responsible for freeing addresses via so_freeaddr()!
+ */
+int so_resolv(struct addrinfo **addresses, const char *hostname, const int port) {
+	struct addrinfo *p;
+
+	if (!dns_resolve(hostname, port, addresses)) {
 		if (debug)
-			printf("so_resolv: %s failed: %s (%d)\n", hostname, gai_strerror(rc), rc);
+			printf("so_resolv: %s failed\n", hostname);
 		return 0;
 	}
 
@@ -72,11 +353,13 @@ int so_resolv(struct addrinfo **addresses, const char *hostname, const int port)
  * getaddrinfo() wrapper, wildcard mode. If "gateway" is 0 the network address
  * will be set to the loopback interface address, otherwise it will contain
  * the "wildcard address" (gateway mode).
- * Important: Caller is responsible for freeing addresses via freeaddrinfo()!
+ * Important: Caller is responsible for freeing addresses via so_freeaddr()!
  */
 int so_resolv_wildcard(struct addrinfo **addresses, const int port, int gateway) {
 	struct addrinfo hints;
+	struct addrinfo *res;
 	char buf[6];
+	int rc;
 
 	snprintf(buf, sizeof(buf), "%d", port);
 
@@ -86,123 +369,333 @@ int so_resolv_wildcard(struct addrinfo **addresses, const int port, int gateway)
 		hints.ai_flags = AI_PASSIVE;
 	}
 
-	return getaddrinfo(NULL, buf, &hints, addresses);
+	*addresses = NULL;
+	rc = getaddrinfo(NULL, buf, &hints, &res);
+	if (rc == 0) {
+		*addresses = dns_copy(res);
+		freeaddrinfo(res);
+	}
+
+	return rc;
+}
+
+void so_freeaddr(struct addrinfo *addresses) {
+	dns_free(addresses);
 }
 
 /*
- * Connect to a host.
- * Returns: socket descriptor
+ * Milliseconds on a monotonic clock, for connect timeouts.
  */
-int so_connect(struct addrinfo *addresses) {
-	int fd = -1;
-	int rc;
-	struct addrinfo *p;
+static long long so_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Start a non-blocking connect() to one address.
+ *
+ * Returns: descriptor (connected if *done is set, in progress otherwise)
+ * or -1 on immediate failure.
+ */
+static int so_connect_start(struct addrinfo *p, int *done) {
 	char s[INET6_ADDRSTRLEN] = {0};
+	int flags;
+	int fd;
 
-	for (p = addresses; p != NULL; p = p->ai_next) {
-		int flags;
-		if ((fd = socket(p->ai_family, SOCK_STREAM, 0)) < 0) {
-			if (debug)
-				printf("so_connect: create: %s\n", strerror(errno));
-			return -1;
-		}
+	*done = 0;
+	if ((fd = socket(p->ai_family, SOCK_STREAM, 0)) < 0) {
+		if (debug)
+			printf("so_connect: create: %s\n", strerror(errno));
+		return -1;
+	}
 
-		if (debug) {
-			INET_NTOP(p->ai_addr, s, INET6_ADDRSTRLEN);
-			unsigned short port = INET_PORT(p->ai_addr);
+	if (debug) {
+		INET_NTOP(p->ai_addr, s, INET6_ADDRSTRLEN);
+		unsigned short port = INET_PORT(p->ai_addr);
+
+		printf("so_connect: %s : %i \n", s, ntohs(port));
+	}
+
+	if ((flags = fcntl(fd, F_GETFL, 0)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		if (debug)
+			printf("so_connect: set non-blocking: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (!connect(fd, p->ai_addr, p->ai_addrlen)) {
+		*done = 1;
+	} else if (errno != EINPROGRESS) {
+		if (debug)
+			printf("so_connect: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Connect to one of the addresses, racing them Happy Eyeballs style
+ * (RFC 8305): attempts start CONNECT_DELAY apart, alternating between
+ * address families, and the first one to connect wins. A dead or
+ * blackholed address thus costs us CONNECT_DELAY, not the SYN timeout.
+ *
+ * The whole thing gives up after "timeout" seconds (0 = no limit).
+ *
+ * Returns: connected blocking descriptor or -1 (errno set).
+ */
+int so_connect(struct addrinfo *addresses, int timeout) {
+	struct addrinfo **cand;
+	struct addrinfo *p;
+	struct pollfd *pfd;
+	long long deadline;
+	long long next;
+	long long now;
+	int count;
+	int started = 0;
+	int active = 0;
+	int fd = -1;
+	int err = ECONNREFUSED;
+	int done;
+	int wait;
+	int family;
+	int i;
+	int j;
+	int rc;
+
+	for (count = 0, p = addresses; p != NULL; p = p->ai_next)
+		count++;
+	if (!count) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
 
-			printf("so_connect: %s : %i \n", s, ntohs(port));
+	cand = (struct addrinfo **)zmalloc(count * sizeof(struct addrinfo *));
+	pfd = (struct pollfd *)zmalloc(count * sizeof(struct pollfd));
+
+	/*
+	 * Interleave address families, keeping the resolver's preference
+	 * within each family and for the first attempt
+	 */
+	family = addresses->ai_family;
+	for (i = 0; i < count; ) {
+		for (p = addresses; p != NULL; p = p->ai_next) {
+			for (j = 0; j < i && cand[j] != p; ++j)
+				;
+			if (j == i && (p->ai_family == family || family == AF_UNSPEC))
+				break;
 		}
+		if (p) {
+			cand[i++] = p;
+			family = (p->ai_family == AF_INET6 ? AF_INET : AF_INET6);
+		} else {
+			family = AF_UNSPEC;
+		}
+	}
 
-		if ((flags = fcntl(fd, F_GETFL, 0)) < 0) {
+	now = so_clock();
+	deadline = (timeout > 0 ? now + timeout * 1000LL : -1);
+	next = now;
+
+	while (fd < 0) {
+		now = so_clock();
+		if (deadline >= 0 && now >= deadline) {
 			if (debug)
-				printf("so_connect: get flags: %s\n", strerror(errno));
-			close(fd);
-			continue;
+				printf("so_connect: timeout after %d s\n", timeout);
+			err = ETIMEDOUT;
+			break;
 		}
 
-		/* NON-BLOCKING connect with timeout
-		if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
-			if (debug)
-				printf("so_connect: set non-blocking: %s\n", strerror(errno));
-			close(fd);
+		/*
+		 * Time for a new attempt?
+		 */
+		if (started < count && (!active || now >= next)) {
+			i = so_connect_start(cand[started++], &done);
+			if (i < 0) {
+				err = errno;
+				continue;
+			}
+			if (done) {
+				fd = i;
+				break;
+			}
+			pfd[active].fd = i;
+			pfd[active].events = POLLOUT;
+			pfd[active].revents = 0;
+			active++;
+			next = now + CONNECT_DELAY;
 			continue;
 		}
-		*/
 
-		rc = connect(fd, p->ai_addr, p->ai_addrlen);
+		if (!active)
+			break;
 
-		if (rc < 0) {
-			if (debug)
-				printf("so_connect: %s\n", strerror(errno));
-			close(fd);
-			fd = -1;
-			continue;
+		wait = -1;
+		if (started < count)
+			wait = (int)MAX(next - now, 0);
+		if (deadline >= 0 && (wait < 0 || deadline - now < wait))
+			wait = (int)(deadline - now);
+
+		rc = poll(pfd, active, wait);
+		if (rc < 0 && errno != EINTR) {
+			err = errno;
+			break;
 		}
 
-		if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		for (i = 0; rc > 0 && i < active; ++i) {
+			int soerr = 0;
+			socklen_t len = sizeof(soerr);
+
+			if (!pfd[i].revents)
+				continue;
+			rc--;
+
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0)
+				soerr = errno;
+			if (!soerr) {
+				fd = pfd[i].fd;
+				pfd[i] = pfd[--active];
+				break;
+			}
+
 			if (debug)
-				printf("so_connect: set blocking: %s\n", strerror(errno));
-			close(fd);
-			fd = -1;
-			continue;
+				printf("so_connect: %s\n", strerror(soerr));
+			err = soerr;
+			close(pfd[i].fd);
+			pfd[i--] = pfd[--active];
+
+			/*
+			 * Failed, no need to wait with the next one
+			 */
+			next = now;
 		}
+	}
 
-		break;
+	for (i = 0; i < active; ++i)
+		close(pfd[i].fd);
+	free(pfd);
+	free(cand);
+
+	if (fd < 0) {
+		errno = err;
+		return -1;
+	}
+
+	if ((i = fcntl(fd, F_GETFL, 0)) < 0 || fcntl(fd, F_SETFL, i & ~O_NONBLOCK) < 0) {
+		if (debug)
+			printf("so_connect: set blocking: %s\n", strerror(errno));
+		close(fd);
+		return -1;
 	}
 
+	so_discard(fd);
+
 	return fd;
 }
 
 /*
- * Bind the specified port and listen on it.
- * Retruns: number of successful binds
+ * Create a listening socket bound to the given address. With reuseport,
+ * SO_REUSEPORT is set as well, so that several sockets can share the same
+ * address and the kernel balances new connections across them.
+ *
+ * Returns: socket descriptor or -1 on error.
  */
-int so_listen(plist_t *list, struct addrinfo *addresses, void *aux) {
-	socklen_t clen;
-	struct addrinfo *p;
+int so_bind(struct sockaddr *addr, socklen_t addrlen, int reuseport) {
 	char s[INET6_ADDRSTRLEN] = {0};
-	int count = 0;
+	socklen_t clen;
+	int fd;
 
-	for (p = addresses; p != NULL; p = p->ai_next) {
-		int fd = socket(p->ai_family, SOCK_STREAM, 0);
-		if (fd < 0) {
-			if (debug)
-				printf("so_listen: new socket: %s\n", strerror(errno));
-			close(fd);
-			continue;
-		}
+	fd = socket(addr->sa_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		if (debug)
+			printf("so_bind: new socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	clen = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &clen, sizeof(clen)) != 0) {
+		syslog(LOG_WARNING, "setsockopt() (option: SO_REUSEADDR, value: 1) failed: %s\n", strerror(errno));
+	}
+
+#ifdef SO_REUSEPORT
+	clen = 1;
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &clen, sizeof(clen)) != 0) {
+		syslog(LOG_ERR, "setsockopt() (option: SO_REUSEPORT, value: 1) failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+#else
+	if (reuseport) {
+		syslog(LOG_ERR, "SO_REUSEPORT is not supported on this system\n");
+		close(fd);
+		return -1;
+	}
+#endif
 
+	if (addr->sa_family == AF_INET6) {
 		clen = 1;
-		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &clen, sizeof(clen)) != 0) {
-			syslog(LOG_WARNING, "setsockopt() (option: SO_REUSEADDR, value: 1) failed: %s\n", strerror(errno));
+		if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &clen, sizeof(clen)) != 0) {
+			syslog(LOG_WARNING, "setsockopt() (option: IPV6_V6ONLY, value: 1) failed: %s\n", strerror(errno));
 		}
+	}
 
-		if (p->ai_family == AF_INET6) {
-			clen = 1;
-			if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &clen, sizeof(clen)) != 0) {
-				syslog(LOG_WARNING, "setsockopt() (option: IPV6_V6ONLY, value: 1) failed: %s\n", strerror(errno));
-			}
-		}
+	if (bind(fd, addr, addrlen)) {
+		INET_NTOP(addr, s, INET6_ADDRSTRLEN);
+		unsigned short port = INET_PORT(addr);
+		syslog(LOG_ERR, "Cannot bind address %s port %d: %s!\n", s, ntohs(port), strerror(errno));
+		close(fd);
+		return -1;
+	}
 
-		INET_NTOP(p->ai_addr, s, INET6_ADDRSTRLEN);
-		unsigned short port = INET_PORT(p->ai_addr);
+	if (listen(fd, SOMAXCONN)) {
+		close(fd);
+		return -1;
+	}
 
-		if (bind(fd, p->ai_addr, p->ai_addrlen)) {
-			syslog(LOG_ERR, "Cannot bind address %s port %d: %s!\n", s, ntohs(port), strerror(errno));
-			close(fd);
-			continue;
-		}
+	return fd;
+}
+
+/*
+ * Bind the specified addresses and listen on them, with "shards"
+ * SO_REUSEPORT sockets per address if more than one.
+ * Returns: number of successfully bound addresses
+ */
+int so_listen(plist_t *list, struct addrinfo *addresses, void *aux, int shards) {
+	struct addrinfo *p;
+	char s[INET6_ADDRSTRLEN] = {0};
+	int count = 0;
+	int *fds;
+	int i;
 
-		if (listen(fd, SOMAXCONN)) {
-			close(fd);
+	fds = (int *)malloc(shards * sizeof(int));
+	for (p = addresses; p != NULL; p = p->ai_next) {
+		/*
+		 * All shards of an address or none, so that the n-th socket of
+		 * the list belongs to shard n % shards.
+		 */
+		for (i = 0; i < shards; ++i) {
+			fds[i] = so_bind(p->ai_addr, p->ai_addrlen, shards > 1);
+			if (fds[i] < 0)
+				break;
+		}
+		if (i < shards) {
+			while (i--)
+				close(fds[i]);
 			continue;
 		}
 
-		*list = plist_add(*list, fd, aux);
+		INET_NTOP(p->ai_addr, s, INET6_ADDRSTRLEN);
+		unsigned short port = INET_PORT(p->ai_addr);
+
+		for (i = 0; i < shards; ++i)
+			*list = plist_add(*list, fds[i], aux);
 		syslog(LOG_INFO, "so_listen: listening on %s:%d\n", s, ntohs(port));
 		++count;
 	}
+	free(fds);
 
 	return count;
 }
@@ -233,7 +726,7 @@ int so_recvtest(int fd) {
  * Return true if there are some data on the socket
  */
 int so_dataready(int fd) {
-	return so_recvtest(fd) > 0;
+	return so_pending(fd) > 0 || so_recvtest(fd) > 0;
 }
 
 /*
@@ -246,47 +739,77 @@ int so_closed(int fd) {
 	if (fd == -1)
 		return 1;
 
+	if (so_pending(fd) > 0)
+		return 0;
+
 	i = so_recvtest(fd);
 	return (i == 0 || (i == -1 && errno != EAGAIN && errno != ENOENT));   /* ENOENT, you ask? Perhaps AIX devels could explain! :-( */
 }
 
 /*
- * Receive a single line from the socket. This is no super-efficient
- * implementation, but more than we need to read in a few headers.
- * What's more, the data is actually recv'd from a socket buffer.
+ * Receive a single line from the socket. We read ahead as much as the
+ * socket has (up to SO_BUFSIZE), look for the end of line in what we've
+ * got and keep the rest in the descriptor's buffer.
+ *
+ * The line, including EOL, is returned NUL-terminated in *buf, which
+ * is enlarged as needed (*size is updated).
  *
- * I had to time this in comparison to recv with block read :) and
- * the performance was very similar. Given the fact that it keeps us
- * from creating a whole buffering scheme around the socket (HTTP
- * connection is both line and block oriented, switching back and forth),
- * it is actually OK.
+ * Returns: 1 if a whole line was read, 0 on EOF and -1 on error. In
+ * the latter two cases, *buf holds what we got before.
  */
 int so_recvln(int fd, char **buf, int *size) {
+	struct so_buf_s *b;
+	const char *eol;
+	char *tmp;
 	int len = 0;
+	int n;
 	int r = 1;
-	char c = 0;
-	char *tmp;
 
-	while (len < *size-1 && c != '\n') {
-		r = read(fd, &c, 1);
-		if (r <= 0)
-			break;
+	b = so_buf(fd, 1);
+	if (!b) {
+		syslog(LOG_ERR, "so_recvln: descriptor %d out of range\n", fd);
+		return -1;
+	}
 
-		(*buf)[len++] = c;
+	for (;;) {
+		if (b->start == b->end) {
+			if (!b->data) {
+				b->data = zmalloc(SO_BUFSIZE);
+				b->size = SO_BUFSIZE;
+			}
+			b->start = b->end = 0;
+
+			r = read(fd, b->data, SO_BUFSIZE);
+			if (r <= 0)
+				break;
+			b->end = r;
+			r = 1;
+		}
+
+		eol = memchr(b->data + b->start, '\n', b->end - b->start);
+		n = (eol ? eol + 1 - b->data : b->end) - b->start;
 
 		/*
-		 * End of buffer, still no EOL? Resize the buffer
+		 * Make room for the line so far and the terminating NUL
 		 */
-		if (len == *size-1 && c != '\n') {
+		if (len + n >= *size) {
+			while (len + n >= *size)
+				*size *= 2;
 			if (debug)
-				printf("so_recvln(%d): realloc %d\n", fd, *size*2);
-			*size *= 2;
+				printf("so_recvln(%d): realloc %d\n", fd, *size);
 			tmp = realloc(*buf, *size);
 			if (tmp == NULL)
 				return -1;
 			else
 				*buf = tmp;
 		}
+
+		memcpy(*buf + len, b->data + b->start, n);
+		b->start += n;
+		len += n;
+
+		if (eol)
+			break;
 	}
 	(*buf)[len] = 0;
 
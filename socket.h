@@ -29,16 +29,30 @@
 #include "config/config.h"
 #include "utils.h"
 
+/*
+ * Happy Eyeballs attempt delay (ms) and default overall timeout (s)
+ */
+#define CONNECT_DELAY		250
+#define DEFAULT_CONNECT_TIMEOUT	10
+
 #if config_socklen_t != 1
 #define socklen_t uint32_t
 #endif
 
 extern int so_resolv(struct addrinfo **addresses, const char *hostname, const int port);
 extern int so_resolv_wildcard(struct addrinfo **addresses, const int port, int gateway);
-extern int so_connect(struct addrinfo *adresses);
-extern int so_listen(plist_t *list, struct addrinfo *adresses, void *aux);
+extern void so_freeaddr(struct addrinfo *addresses);
+extern int so_connect(struct addrinfo *adresses, int timeout);
+extern int so_bind(struct sockaddr *addr, socklen_t addrlen, int reuseport);
+extern int so_listen(plist_t *list, struct addrinfo *adresses, void *aux, int shards);
 extern int so_dataready(int fd);
 extern int so_closed(int fd);
 extern int so_recvln(int fd, char **buf, int *size);
+extern int so_recvhead(int fd, struct arena_s *arena, char **head);
+extern int so_fill(int fd);
+extern int so_headready(int fd);
+extern int so_pending(int fd);
+extern ssize_t so_read(int fd, void *buf, size_t len);
+extern int so_close(int fd);
 
 #endif /* _SOCKET_H */
@@ -0,0 +1,562 @@
+/*
+ * These are the io_uring I/O routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "utils.h"
+#include "uring.h"
+
+extern int debug;
+
+/*
+ * Optional io_uring engine behind tunnel() and data_send(), enabled with
+ * "IOEngine io_uring". We talk to the kernel directly, there's no need for
+ * liburing for the handful of operations we use.
+ *
+ * Connections are served by threads, so each thread gets a small ring of
+ * its own, created on first use and destroyed when the thread exits. The
+ * ring has four registered buffers, two for each direction: while one is
+ * being written out, the other can already be filled. All reads and writes
+ * which can proceed are submitted together with waiting for the next
+ * completion, in one io_uring_enter() call - instead of a read() and a
+ * write() for every block.
+ */
+
+#define URING_ENTRIES	8
+#define URING_BUFS	4
+#define URING_BUFSIZE	16384
+#define URING_CANCEL	0xFFFFFFFFULL
+
+struct uring_s {
+	int fd;
+	int fixed;				/* buffers registered */
+	unsigned int entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+	unsigned int tail;			/* SQ tail, published on submit */
+	unsigned int queued;			/* SQEs not submitted yet */
+	char *bufs;
+	struct uring_s *next;			/* on the retired list */
+};
+
+/*
+ * One direction of a relay, double-buffered.
+ */
+struct relay_s {
+	int from;
+	int to;
+	length_t left;				/* to read, -1 until EOF */
+	int eof;
+	int reading;				/* buffer being read into, or -1 */
+	int writing;				/* buffer being written from, or -1 */
+	int rnext;
+	int wnext;
+	int len[2];
+	int off[2];
+};
+
+static int enabled = 0;
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Rings dropped with operations still in the kernel, see uring_retire()
+ */
+static struct uring_s *retired = NULL;
+static pthread_mutex_t retired_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_free(struct uring_s *r) {
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+		munmap(r->sq_ptr, r->sq_len);
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r->bufs);
+	free(r);
+}
+
+static void uring_destroy(void *data) {
+	uring_free((struct uring_s *)data);
+}
+
+/*
+ * Take the ring away from the calling thread after io_uring_enter() failed.
+ * With "pending" operations submitted and not completed, the kernel may
+ * still read or write our buffers, even after the ring is closed, so we
+ * keep both as they are for good. We can't submit cancellations on a ring
+ * which doesn't take them anymore. To bound the leak, io_uring is switched
+ * off for new relays.
+ */
+static void uring_retire(struct uring_s *r, int pending) {
+	pthread_setspecific(uring_key, NULL);
+	__atomic_store_n(&enabled, 0, __ATOMIC_RELAXED);
+
+	if (!pending) {
+		uring_free(r);
+		return;
+	}
+
+	syslog(LOG_WARNING, "Parking io_uring ring with %d operation(s) in flight, using blocking I/O from now on\n", pending);
+	pthread_mutex_lock(&retired_mtx);
+	r->next = retired;
+	retired = r;
+	pthread_mutex_unlock(&retired_mtx);
+}
+
+static struct uring_s *uring_create(void) {
+	struct io_uring_params p;
+	struct iovec iov[URING_BUFS];
+	struct uring_s *r;
+	char *sq;
+	char *cq;
+	int i;
+
+	r = (struct uring_s *)zmalloc(sizeof(struct uring_s));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (r->fd < 0) {
+		if (debug)
+			printf("uring_create: io_uring_setup: %s\n", strerror(errno));
+		uring_free(r);
+		return NULL;
+	}
+
+	r->entries = p.sq_entries;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_len = r->cq_len = MAX(r->sq_len, r->cq_len);
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		uring_free(r);
+		return NULL;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			uring_free(r);
+			return NULL;
+		}
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		uring_free(r);
+		return NULL;
+	}
+
+	sq = r->sq_ptr;
+	cq = r->cq_ptr;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->tail = *r->sq_tail;
+
+	/*
+	 * Registered buffers spare the kernel mapping them for each operation.
+	 * If we can't register them (e.g. RLIMIT_MEMLOCK), plain reads and
+	 * writes work just as well.
+	 */
+	r->bufs = zmalloc(URING_BUFS * URING_BUFSIZE);
+	for (i = 0; i < URING_BUFS; ++i) {
+		iov[i].iov_base = r->bufs + i * URING_BUFSIZE;
+		iov[i].iov_len = URING_BUFSIZE;
+	}
+	r->fixed = !sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS);
+	if (debug && !r->fixed)
+		printf("uring_create: cannot register buffers: %s\n", strerror(errno));
+
+	return r;
+}
+
+static void uring_key_create(void) {
+	pthread_key_create(&uring_key, uring_destroy);
+}
+
+/*
+ * Ring of the calling thread.
+ */
+static struct uring_s *uring_get(void) {
+	struct uring_s *r;
+
+	pthread_once(&uring_once, uring_key_create);
+	r = pthread_getspecific(uring_key);
+	if (!r) {
+		r = uring_create();
+		if (r)
+			pthread_setspecific(uring_key, r);
+	}
+
+	return r;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring_s *r) {
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int idx;
+
+	head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	tail = r->tail;
+	if (tail - head >= r->entries)
+		return NULL;
+
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->tail++;
+	r->queued++;
+
+	return sqe;
+}
+
+static int uring_rw(struct uring_s *r, int write, int fd, int buf, int off, int len, unsigned long long tag) {
+	struct io_uring_sqe *sqe = uring_sqe(r);
+
+	if (!sqe)
+		return 0;
+
+	if (r->fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = buf;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)(r->bufs + buf * URING_BUFSIZE + off);
+	sqe->len = len;
+	sqe->user_data = tag;
+
+	return 1;
+}
+
+static int uring_cancel(struct uring_s *r, unsigned long long tag) {
+	struct io_uring_sqe *sqe = uring_sqe(r);
+
+	if (!sqe)
+		return 0;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = tag;
+	sqe->user_data = URING_CANCEL;
+
+	return 1;
+}
+
+/*
+ * Operation tags: direction, buffer of the direction and read/write.
+ */
+#define TAG(dir, b, write)	((unsigned long long)(((dir) << 2) | ((b) << 1) | (write)))
+
+/*
+ * Queue whatever the direction can do now: a read into the next free
+ * buffer (unless we're just flushing) and a write of the oldest filled
+ * one. At most one of each is in flight, so the data can't get reordered.
+ *
+ * Returns: number of operations queued.
+ */
+static int relay_schedule(struct uring_s *r, struct relay_s *d, int dir, int flush) {
+	int n = 0;
+	int b;
+
+	b = d->rnext;
+	if (!flush && d->reading < 0 && !d->eof && d->left && d->len[b] == 0 && d->writing != b) {
+		if (uring_rw(r, 0, d->from, dir * 2 + b, 0, d->left < 0 ? URING_BUFSIZE : (int)MIN(d->left, URING_BUFSIZE), TAG(dir, b, 0))) {
+			d->reading = b;
+			n++;
+		}
+	}
+
+	b = d->wnext;
+	if (d->writing < 0 && d->len[b] > 0) {
+		if (uring_rw(r, 1, d->to, dir * 2 + b, d->off[b], d->len[b] - d->off[b], TAG(dir, b, 1))) {
+			d->writing = b;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Apply a completion to its direction.
+ *
+ * Returns: 1 if OK, 0 on EOF and -1 on error.
+ */
+static int relay_complete(struct relay_s *d, int b, int write, int res) {
+	if (res < 0) {
+		if (write)
+			d->writing = -1;
+		else
+			d->reading = -1;
+		if (debug && res != -ECANCELED)
+			printf("uring_relay: %s %d failed: %s\n", write ? "write" : "read", write ? d->to : d->from, strerror(-res));
+		return -1;
+	}
+
+	if (write) {
+		d->writing = -1;
+		d->off[b] += res;
+		if (d->off[b] >= d->len[b]) {
+			d->len[b] = d->off[b] = 0;
+			d->wnext ^= 1;
+		}
+		return 1;
+	}
+
+	d->reading = -1;
+	if (res == 0) {
+		d->eof = 1;
+		return 0;
+	}
+
+	d->len[b] = res;
+	d->off[b] = 0;
+	if (d->left > 0)
+		d->left -= res;
+	d->rnext ^= 1;
+
+	return 1;
+}
+
+static int relay_flushed(const struct relay_s *d) {
+	return d->reading < 0 && d->writing < 0 && !d->len[0] && !d->len[1];
+}
+
+/*
+ * Run "n" relay directions until one of them reaches EOF (or the end of
+ * its length) and all it got is written, or until an error. Data the
+ * other directions have read by then is still written out, unless there
+ * was an error.
+ *
+ * Returns: 1 on success, 0 on error.
+ */
+static int uring_relay(struct uring_s *r, struct relay_s *dirs, int n) {
+	struct io_uring_cqe *cqe;
+	unsigned long long tag;
+	unsigned int head;
+	unsigned int tail;
+	int inflight = 0;
+	int cancelled = 0;
+	int stop = 0;
+	int rc = 1;
+	int i;
+	int k;
+
+	for (;;) {
+		if (rc) {
+			for (i = 0; i < n; ++i)
+				inflight += relay_schedule(r, &dirs[i], i, stop);
+		}
+
+		if (!inflight)
+			break;
+
+		__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+		do {
+			i = sys_io_uring_enter(r->fd, r->queued, 1, IORING_ENTER_GETEVENTS);
+		} while (i < 0 && errno == EINTR);
+		if (i < 0) {
+			/*
+			 * The ring is unusable. What we queued in this call never
+			 * got to the kernel, the rest did and is still running.
+			 */
+			syslog(LOG_ERR, "io_uring_enter failed: %s\n", strerror(errno));
+			uring_retire(r, inflight - (int)r->queued);
+			return 0;
+		}
+		r->queued -= i;
+
+		head = *r->cq_head;
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			tag = cqe->user_data;
+			inflight--;
+			if (tag == URING_CANCEL)
+				continue;
+
+			i = (int)(tag >> 2);
+			k = relay_complete(&dirs[i], (tag >> 1) & 1, tag & 1, cqe->res);
+			if (k < 0 && !stop) {
+				stop = 1;
+				rc = 0;
+			}
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+		/*
+		 * A direction is done once it has read all there was to read and
+		 * written it out. That ends the whole relay, like in tunnel().
+		 */
+		for (i = 0; !stop && i < n; ++i) {
+			if ((dirs[i].eof || !dirs[i].left) && relay_flushed(&dirs[i])) {
+				stop = 1;
+				if (dirs[i].eof && dirs[i].left > 0)
+					rc = 0;
+			}
+		}
+
+		/*
+		 * Stopping, cancel reads still waiting for data (and writes, if
+		 * something failed). We have to reap all operations before the
+		 * buffers can be used again.
+		 */
+		if (stop && !cancelled) {
+			for (i = 0; i < n; ++i) {
+				if (dirs[i].reading >= 0 && uring_cancel(r, TAG(i, dirs[i].reading, 0)))
+					inflight++;
+				if (!rc && dirs[i].writing >= 0 && uring_cancel(r, TAG(i, dirs[i].writing, 1)))
+					inflight++;
+			}
+			cancelled = 1;
+		}
+	}
+
+	return rc;
+}
+
+static void relay_init(struct relay_s *d, int from, int to, length_t len) {
+	memset(d, 0, sizeof(*d));
+	d->from = from;
+	d->to = to;
+	d->left = len;
+	d->reading = d->writing = -1;
+}
+
+/*
+ * Check that io_uring works here (kernel support, seccomp, sysctl) and
+ * enable it for the I/O routines.
+ *
+ * Returns: 1 if enabled, 0 otherwise.
+ */
+int uring_init(void) {
+	struct uring_s *r;
+
+	r = uring_create();
+	if (!r)
+		return 0;
+
+	syslog(LOG_INFO, "Using io_uring I/O engine%s\n", r->fixed ? "" : " (no registered buffers)");
+	uring_free(r);
+	enabled = 1;
+
+	return 1;
+}
+
+int uring_enabled(void) {
+	return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+/*
+ * io_uring version of tunnel().
+ *
+ * Returns: like tunnel() or -2 if this thread has no ring and the caller
+ * should use the blocking path.
+ */
+int uring_tunnel(int cd, int sd) {
+	struct relay_s dirs[2];
+	struct uring_s *r;
+
+	if (!(r = uring_get()))
+		return -2;
+
+	if (debug)
+		printf("uring_tunnel: cli: %d, srv: %d\n", cd, sd);
+
+	relay_init(&dirs[0], cd, sd, -1);
+	relay_init(&dirs[1], sd, cd, -1);
+
+	return uring_relay(r, dirs, 2);
+}
+
+/*
+ * io_uring version of data_send() for dst >= 0.
+ *
+ * Returns: like data_send() or -2 if this thread has no ring and the
+ * caller should use the blocking path.
+ */
+int uring_data_send(int dst, int src, length_t len) {
+	struct relay_s dir;
+	struct uring_s *r;
+
+	if (!len)
+		return 1;
+
+	if (!(r = uring_get()))
+		return -2;
+
+	if (debug)
+		printf("uring_data_send: fds %d:%d len %lld\n", dst, src, len);
+
+	relay_init(&dir, src, dst, len);
+
+	return uring_relay(r, &dir, 1);
+}
@@ -0,0 +1,30 @@
+/*
+ * These are the io_uring I/O routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include "http.h"
+
+extern int uring_init(void);
+extern int uring_enabled(void);
+extern int uring_tunnel(int cd, int sd);
+extern int uring_data_send(int dst, int src, length_t len);
+
+#endif /* _URING_H */
@@ -200,7 +200,7 @@ int plist_pop(plist_t *list, void **aux) {
 		tmp = t->next;
 
 		if (so_closed(id)) {
-			close(id);
+			so_close(id);
 			if (t->aux)
 				free(t->aux);
 		} else
@@ -253,6 +253,255 @@ plist_t plist_free(plist_t list) {
 	return NULL;
 }
 
+/*
+ * Arenas hold the many small strings and list nodes of a request/response
+ * (see rr_data_s), which all live and die together. Allocation is a pointer
+ * bump, freeing is done all at once by arena_reset(). Memory handed out is
+ * aligned for any basic type.
+ */
+#define ARENA_ALIGN(n)	(((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+void arena_init(struct arena_s *arena, char *block, size_t size) {
+	arena->first = arena->pos = block;
+	arena->first_end = arena->end = block + size;
+	arena->chunks = NULL;
+}
+
+void *arena_alloc(struct arena_s *arena, size_t size) {
+	struct arena_chunk_s *chunk;
+	size_t chunk_size;
+	char *p;
+
+	size = ARENA_ALIGN(size);
+	if ((size_t)(arena->end - arena->pos) < size) {
+		chunk_size = MAX(size + ARENA_ALIGN(sizeof(struct arena_chunk_s)), (size_t)ARENA_CHUNK);
+		chunk = (struct arena_chunk_s *)malloc(chunk_size);
+		if (!chunk)
+			return NULL;
+		chunk->end = (char *)chunk + chunk_size;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->pos = (char *)chunk + ARENA_ALIGN(sizeof(struct arena_chunk_s));
+		arena->end = chunk->end;
+	}
+
+	p = arena->pos;
+	arena->pos += size;
+
+	return p;
+}
+
+char *arena_strndup(struct arena_s *arena, const char *src, size_t len) {
+	char *tmp;
+
+	tmp = (char *)arena_alloc(arena, len + 1);
+	if (tmp) {
+		memcpy(tmp, src, len);
+		tmp[len] = 0;
+	}
+
+	return tmp;
+}
+
+/*
+ * Does "ptr" point into memory of the arena? Used by the free routines,
+ * which have to skip such memory.
+ */
+int arena_owns(const struct arena_s *arena, const void *ptr) {
+	const struct arena_chunk_s *chunk;
+	const char *p = (const char *)ptr;
+
+	if (!arena || !p)
+		return 0;
+
+	if (p >= arena->first && p < arena->first_end)
+		return 1;
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+		if (p > (const char *)chunk && p < chunk->end)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Release everything allocated from the arena, keeping just the first block.
+ */
+void arena_reset(struct arena_s *arena) {
+	struct arena_chunk_s *chunk;
+
+	while (arena->chunks) {
+		chunk = arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks = chunk;
+	}
+
+	arena->pos = arena->first;
+	arena->end = arena->first_end;
+}
+
+/*
+ * Free a string unless it belongs to the arena.
+ */
+static void arena_free(const struct arena_s *arena, char *ptr) {
+	if (ptr && !arena_owns(arena, ptr))
+		free(ptr);
+}
+
+/*
+ * Well-known header names, interned to the HDR_* IDs (see utils.h). Lists
+ * of a request/response keep an index by these IDs, so that the headers
+ * we care about are found without walking and comparing the whole list.
+ */
+static const char *hlist_names[HDR_COUNT] = {
+	NULL,
+	"Host",
+	"Connection",
+	"Proxy-Connection",
+	"Keep-Alive",
+	"Content-Length",
+	"Content-Type",
+	"Transfer-Encoding",
+	"Proxy-Authorization",
+	"Proxy-Authenticate",
+	"Authorization",
+	"WWW-Authenticate",
+	"User-Agent",
+	"Referer",
+	"Upgrade",
+	"TE",
+	"Trailer",
+	"Expect",
+	"Accept",
+	"Accept-Encoding",
+	"Cookie",
+	"Set-Cookie",
+	"Location",
+	"Server",
+	"Date",
+	"Cache-Control",
+};
+
+#define HLIST_SLOTS	64
+
+static unsigned char hlist_slots[HLIST_SLOTS];
+static pthread_once_t hlist_once = PTHREAD_ONCE_INIT;
+
+static unsigned int hlist_hash(const char *key, size_t len) {
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)tolower((unsigned char)key[i])) * 16777619u;
+
+	return h;
+}
+
+static void hlist_slots_init(void) {
+	unsigned int slot;
+	int i;
+
+	for (i = 1; i < HDR_COUNT; ++i) {
+		slot = hlist_hash(hlist_names[i], strlen(hlist_names[i])) % HLIST_SLOTS;
+		while (hlist_slots[slot])
+			slot = (slot + 1) % HLIST_SLOTS;
+		hlist_slots[slot] = i;
+	}
+}
+
+/*
+ * Map a header name (not necessarily terminated) to its HDR_* ID.
+ * Returns: HDR_UNKNOWN for names we don't track.
+ */
+int hlist_id(const char *key, size_t len) {
+	unsigned int slot;
+	int id;
+
+	pthread_once(&hlist_once, hlist_slots_init);
+
+	slot = hlist_hash(key, len) % HLIST_SLOTS;
+	while ((id = hlist_slots[slot])) {
+		if (strlen(hlist_names[id]) == len && !strncasecmp(hlist_names[id], key, len))
+			return id;
+		slot = (slot + 1) % HLIST_SLOTS;
+	}
+
+	return HDR_UNKNOWN;
+}
+
+/*
+ * Link a new node at the end of the list, updating the index, if any.
+ */
+static hlist_t hlist_link(hlist_t list, hlist_t tmp) {
+	struct hlist_index_s *index = tmp->index;
+	hlist_t t = list;
+
+	tmp->next = NULL;
+	tmp->same = NULL;
+	tmp->islist = 0;
+
+	if (index) {
+		tmp->id = hlist_id(tmp->key, strlen(tmp->key));
+		if (tmp->id) {
+			if (index->last[tmp->id])
+				index->last[tmp->id]->same = tmp;
+			else
+				index->first[tmp->id] = tmp;
+			index->last[tmp->id] = tmp;
+		}
+		t = index->tail;
+		index->tail = tmp;
+	} else {
+		tmp->id = HDR_UNKNOWN;
+		while (t && t->next)
+			t = t->next;
+	}
+
+	tmp->prev = t;
+	if (list == NULL)
+		return tmp;
+
+	t->next = tmp;
+
+	return list;
+}
+
+/*
+ * Find the first item with the key.
+ */
+static hlist_const_t hlist_find(hlist_const_t list, const char *key) {
+	hlist_const_t t = list;
+	int id;
+
+	if (list && list->index) {
+		id = hlist_id(key, strlen(key));
+		if (id)
+			return list->index->first[id];
+	}
+
+	while (t) {
+		if (!strcasecmp(t->key, key))
+			break;
+		t = t->next;
+	}
+
+	return t;
+}
+
+/*
+ * The same, for lists we are going to modify.
+ */
+static hlist_t hlist_find_mod(hlist_t list, const char *key) {
+	hlist_const_t t;
+
+	t = hlist_find(list, key);
+	if (t == NULL)
+		return NULL;
+
+	return (t->prev ? t->prev->next : list);
+}
+
 /*
  * The same as plist_add. Here we have two other arguments.
  * They are boolean flags - HLIST_ALLOC means to duplicate a
@@ -267,26 +516,54 @@ plist_t plist_free(plist_t list) {
  */
 hlist_t hlist_add(hlist_t list, char *key, char *value, hlist_add_t allockey, hlist_add_t allocvalue) {
 	hlist_t tmp;
-	hlist_t t = list;
+	struct arena_s *arena = (list ? list->arena : NULL);
 
 	if (key == NULL || value == NULL)
 		return list;
 
-	tmp = malloc(sizeof(struct hlist_s));
-	tmp->key = (allockey == HLIST_ALLOC ? strdup(key) : key);
-	tmp->value = (allocvalue == HLIST_ALLOC ? strdup(value) : value);
-	tmp->next = NULL;
-	tmp->islist = 0;
+	/*
+	 * Lists of a request/response grow within its arena
+	 */
+	if (arena) {
+		tmp = (hlist_t)arena_alloc(arena, sizeof(struct hlist_s));
+		tmp->key = (allockey == HLIST_ALLOC ? arena_strndup(arena, key, strlen(key)) : key);
+		tmp->value = (allocvalue == HLIST_ALLOC ? arena_strndup(arena, value, strlen(value)) : value);
+	} else {
+		tmp = malloc(sizeof(struct hlist_s));
+		tmp->key = (allockey == HLIST_ALLOC ? strdup(key) : key);
+		tmp->value = (allocvalue == HLIST_ALLOC ? strdup(value) : value);
+	}
+	tmp->arena = arena;
+	tmp->index = (list ? list->index : NULL);
 
-	if (list == NULL)
-		return tmp;
+	return hlist_link(list, tmp);
+}
 
-	while (t->next)
-		t = t->next;
+/*
+ * Add key and value, allocating the node from "arena". With HLIST_ALLOC,
+ * key and value are copied to the arena, otherwise they must already be
+ * there. A list started this way is indexed, and hlist_add() and
+ * hlist_mod() use the arena as well.
+ */
+hlist_t hlist_add_arena(hlist_t list, struct arena_s *arena, char *key, char *value, hlist_add_t alloc) {
+	hlist_t tmp;
 
-	t->next = tmp;
+	if (key == NULL || value == NULL)
+		return list;
 
-	return list;
+	tmp = (hlist_t)arena_alloc(arena, sizeof(struct hlist_s));
+	tmp->key = (alloc == HLIST_ALLOC ? arena_strndup(arena, key, strlen(key)) : key);
+	tmp->value = (alloc == HLIST_ALLOC ? arena_strndup(arena, value, strlen(value)) : value);
+	tmp->arena = arena;
+
+	if (list) {
+		tmp->index = list->index;
+	} else {
+		tmp->index = (struct hlist_index_s *)arena_alloc(arena, sizeof(struct hlist_index_s));
+		memset(tmp->index, 0, sizeof(struct hlist_index_s));
+	}
+
+	return hlist_link(list, tmp);
 }
 
 /*
@@ -294,10 +571,18 @@ hlist_t hlist_add(hlist_t list, char *key, char *value, hlist_add_t allockey, hl
  */
 hlist_t hlist_dup(hlist_const_t list) {
 	hlist_t tmp = NULL;
+	hlist_t last = NULL;
 	hlist_const_t t = list;
 
 	while (t) {
-		tmp = hlist_add(tmp, t->key, t->value, HLIST_ALLOC, HLIST_ALLOC);
+		/*
+		 * Append right behind the last one, no need to walk the copy
+		 */
+		last = hlist_add(last, t->key, t->value, HLIST_ALLOC, HLIST_ALLOC);
+		if (!tmp)
+			tmp = last;
+		if (last->next)
+			last = last->next;
 		t = t->next;
 	}
 
@@ -308,52 +593,48 @@ hlist_t hlist_dup(hlist_const_t list) {
  * Remove an item from the list.
  */
 hlist_t hlist_del(hlist_t list, const char *key) {
-	hlist_t ot = NULL;
-	hlist_t t = list;
-
-	while (t) {
-		if (!strcasecmp(t->key, key))
-			break;
-		ot = t;
-		t = t->next;
-	}
+	struct hlist_index_s *index;
+	hlist_t t;
 
+	t = hlist_find_mod(list, key);
 	if (t) {
-		hlist_t tmp = t->next;
-
-		free(t->key);
-		free(t->value);
-		free(t);
-
-		if (ot == NULL)
-			return tmp;
+		index = t->index;
+		if (index) {
+			if (t->id) {
+				index->first[t->id] = t->same;
+				if (index->last[t->id] == t)
+					index->last[t->id] = NULL;
+			}
+			if (index->tail == t)
+				index->tail = t->prev;
+		}
 
-		ot->next = tmp;
+		if (t->next)
+			t->next->prev = t->prev;
+		if (t->prev)
+			t->prev->next = t->next;
+		else
+			list = t->next;
+
+		arena_free(t->arena, t->key);
+		arena_free(t->arena, t->value);
+		if (!t->arena)
+			free(t);
 	}
 
 	return list;
 }
 
 /*
- * Change the value of a key. If add is true, we store it in the
- * list if the key is not found. Unlike hlist_add, which offers
- * pointer storage or memory duplication for both the key and the
- * value separately, hlist_mod always duplicates.
- *
- * Used to add a header, which might already be present.
+ * Replace key/value pair in the list, or add it if missing.
  */
 hlist_t hlist_mod(hlist_t list, char *key, char *value, int add) {
-	hlist_t t = list;
-
-	while (t) {
-		if (!strcasecmp(t->key, key))
-			break;
-		t = t->next;
-	}
+	hlist_t t;
 
+	t = hlist_find_mod(list, key);
 	if (t) {
-		free(t->value);
-		t->value = strdup(value);
+		arena_free(t->arena, t->value);
+		t->value = (t->arena ? arena_strndup(t->arena, value, strlen(value)) : strdup(value));
 	} else if (add) {
 		list = hlist_add(list, key, value, HLIST_ALLOC, HLIST_ALLOC);
 	}
@@ -362,18 +643,10 @@ hlist_t hlist_mod(hlist_t list, char *key, char *value, int add) {
 }
 
 /*
- * Return true if the key is in the list.
+ * Is the key in the list?
  */
 int hlist_in(hlist_const_t list, const char *key) {
-	hlist_const_t t = list;
-
-	while (t) {
-		if (!strcasecmp(t->key, key))
-			break;
-		t = t->next;
-	}
-
-	return (t != NULL);
+	return (hlist_find(list, key) != NULL);
 }
 
 /*
@@ -395,38 +668,37 @@ int hlist_count(hlist_const_t list) {
  * Return the value for the key.
  */
 char *hlist_get(hlist_const_t list, const char *key) {
-	hlist_const_t t = list;
+	hlist_const_t t;
 
-	while (t) {
-		if (!strcasecmp(t->key, key))
-			break;
-		t = t->next;
-	}
+	t = hlist_find(list, key);
 
 	return (t == NULL ? NULL : t->value);
 }
 
+/*
+ * Case-insensitive strstr(), without copying either string.
+ */
+static int subcasecmp(const char *str, const char *substr) {
+	size_t len = strlen(substr);
+
+	for (; *str; ++str) {
+		if (!strncasecmp(str, substr, len))
+			return 1;
+	}
+
+	return !len;
+}
+
 /*
  * Test if substr is part of the header's value.
  * Both case-insensitive.
  */
 int hlist_subcmp(hlist_const_t list, const char *key, const char *substr) {
-	int found = 0;
-	char *tmp;
-	char *low;
+	const char *tmp;
 
-	lowercase(low = strdup(substr));
 	tmp = hlist_get(list, key);
-	if (tmp) {
-		lowercase(tmp = strdup(tmp));
-		if (strstr(tmp, low))
-			found = 1;
 
-		free(tmp);
-	}
-
-	free(low);
-	return found;
+	return (tmp && subcasecmp(tmp, substr));
 }
 
 /*
@@ -434,28 +706,24 @@ int hlist_subcmp(hlist_const_t list, const char *key, const char *substr) {
  * Both case-insensitive, checks all headers, not just first one.
  */
 int hlist_subcmp_all(hlist_const_t list, const char *key, const char *substr) {
-	hlist_const_t t = list;
-	int found = 0;
-	char *tmp;
-	char *low;
+	hlist_const_t t;
+	int id = HDR_UNKNOWN;
 
 	assert(key != NULL);
 	assert(substr != NULL);
 
-	lowercase(low = strdup(substr));
-	while (t) {
-		if (!strcasecmp(t->key, key)) {
-			lowercase(tmp = strdup(t->value));
-			if (strstr(tmp, low))
-				found = 1;
+	/*
+	 * Known headers of indexed lists are chained in their order
+	 */
+	if (list && list->index)
+		id = hlist_id(key, strlen(key));
 
-			free(tmp);
-		}
-		t = t->next;
+	for (t = hlist_find(list, key); t; t = (id ? t->same : t->next)) {
+		if ((id || !strcasecmp(t->key, key)) && subcasecmp(t->value, substr))
+			return 1;
 	}
 
-	free(low);
-	return found;
+	return 0;
 }
 
 /*
@@ -468,9 +736,10 @@ hlist_t hlist_free(hlist_t list) {
 	while (list) {
 		t = list->next;
 
-		free(list->key);
-		free(list->value);
-		free(list);
+		arena_free(list->arena, list->key);
+		arena_free(list->arena, list->value);
+		if (!list->arena)
+			free(list);
 
 		list = t;
 	}
@@ -517,17 +786,20 @@ char *substr(const char *src, int pos, int len) {
 }
 
 /*
- * Allocate memory and initialize a new rr_data_t structure.
+ * Allocate memory and initialize a new rr_data_t structure. The first
+ * block of its arena comes in the same allocation, right behind it.
  */
 rr_data_t new_rr_data(void) {
 	rr_data_t data;
 
-	data = malloc(sizeof(struct rr_data_s));
+	data = malloc(sizeof(struct rr_data_s) + RR_ARENA_SIZE);
+	arena_init(&data->arena, (char *)(data + 1), RR_ARENA_SIZE);
 	data->req = 0;
 	data->code = 0;
 	data->skip_http = 0;
 	data->body_len = 0;
 	data->empty = 1;
+	data->closed = 0;
 	data->port = 0;
 	data->http_version = -1;
 	data->headers = NULL;
@@ -564,25 +836,23 @@ rr_data_t copy_rr_data(rr_data_t dst, const rr_data_const_t src) {
 	dst->skip_http = src->skip_http;
 	dst->body_len = src->body_len;
 	dst->empty = src->empty;
+	dst->closed = src->closed;
 	dst->port = src->port;
 	dst->http_version = src->http_version;
 
-	if (src->headers)
-		dst->headers = hlist_dup(src->headers);
-	if (src->method)
-		dst->method = strdup(src->method);
-	if (src->url)
-		dst->url = strdup(src->url);
-	if (src->rel_url)
-		dst->rel_url = strdup(src->rel_url);
-	if (src->hostname)
-		dst->hostname = strdup(src->hostname);
-	if (src->http)
-		dst->http = strdup(src->http);
-	if (src->msg)
-		dst->msg = strdup(src->msg);
+	hlist_const_t t;
+
+	for (t = src->headers; t; t = t->next)
+		dst->headers = hlist_add_arena(dst->headers, &dst->arena, t->key, t->value, HLIST_ALLOC);
+
+	dst->method = rr_strdup(dst, src->method);
+	dst->url = rr_strdup(dst, src->url);
+	dst->rel_url = rr_strdup(dst, src->rel_url);
+	dst->hostname = rr_strdup(dst, src->hostname);
+	dst->http = rr_strdup(dst, src->http);
+	dst->msg = rr_strdup(dst, src->msg);
 	if (src->body && src->body_len > 0) {
-		dst->body = zmalloc(src->body_len);
+		dst->body = arena_alloc(&dst->arena, src->body_len);
 		memcpy(dst->body, src->body, src->body_len);
 	}
 
@@ -620,17 +890,22 @@ rr_data_t reset_rr_data(rr_data_t data) {
 	data->skip_http = 0;
 	data->body_len = 0;
 	data->empty = 1;
+	data->closed = 0;
 	data->port = 0;
 	data->http_version = -1;
 
+	/*
+	 * Only what was set from outside the arena needs to be freed
+	 */
 	if (data->headers) hlist_free(data->headers);
-	if (data->method) free(data->method);
-	if (data->url) free(data->url);
-	if (data->rel_url) free(data->rel_url);
-	if (data->hostname) free(data->hostname);
-	if (data->http) free(data->http);
-	if (data->msg) free(data->msg);
-	if (data->body) free(data->body);
+	arena_free(&data->arena, data->method);
+	arena_free(&data->arena, data->url);
+	arena_free(&data->arena, data->rel_url);
+	arena_free(&data->arena, data->hostname);
+	arena_free(&data->arena, data->http);
+	arena_free(&data->arena, data->msg);
+	arena_free(&data->arena, data->body);
+	arena_reset(&data->arena);
 
 	data->headers = NULL;
 	data->method = NULL;
@@ -659,17 +934,39 @@ void free_rr_data(rr_data_t * pdata) {
 	if (data == NULL)
 		return;
 
+	/*
+	 * Only what was set from outside the arena needs to be freed
+	 */
 	if (data->headers) hlist_free(data->headers);
-	if (data->method) free(data->method);
-	if (data->url) free(data->url);
-	if (data->rel_url) free(data->rel_url);
-	if (data->hostname) free(data->hostname);
-	if (data->http) free(data->http);
-	if (data->msg) free(data->msg);
-	if (data->body) free(data->body);
+	arena_free(&data->arena, data->method);
+	arena_free(&data->arena, data->url);
+	arena_free(&data->arena, data->rel_url);
+	arena_free(&data->arena, data->hostname);
+	arena_free(&data->arena, data->http);
+	arena_free(&data->arena, data->msg);
+	arena_free(&data->arena, data->body);
+	arena_reset(&data->arena);
 	memset(data, 0, sizeof(struct rr_data_s));
 	free(data);
-	data = NULL;
+	*pdata = NULL;
+}
+
+/*
+ * Duplicate a string into the arena of "data". NULL stays NULL.
+ */
+char *rr_strdup(rr_data_t data, const char *src) {
+	if (!src)
+		return NULL;
+
+	return arena_strndup(&data->arena, src, strlen(src));
+}
+
+/*
+ * Replace one of the string fields of "data" with a copy of "src".
+ */
+void rr_strset(rr_data_t data, char **field, const char *src) {
+	arena_free(&data->arena, *field);
+	*field = rr_strdup(data, src);
 }
 
 /*
@@ -50,6 +50,26 @@
 # define LOG_PERROR	LOG_CONS
 #endif
 
+/*
+ * Bump allocator, see arena_alloc(). The first block is supplied by the
+ * owner (usually embedded in the same allocation), further ones are
+ * malloc'd on demand and released by arena_reset().
+ */
+#define ARENA_CHUNK		4096
+
+struct arena_chunk_s {
+	struct arena_chunk_s *next;
+	char *end;
+};
+
+struct arena_s {
+	char *pos;
+	char *end;
+	char *first;
+	char *first_end;
+	struct arena_chunk_s *chunks;
+};
+
 /*
  * Two single-linked list types. First is for storing headers,
  * second keeps a list of finished threads or cached connections.
@@ -61,9 +81,58 @@ struct hlist_s {
 	char *key;
 	char *value;
 	int islist;
+	int id;					/* HDR_* of the key, if indexed */
+	struct arena_s *arena;			/* owner of the node, NULL if malloc'd */
+	struct hlist_index_s *index;		/* shared by all nodes of the list */
+	struct hlist_s *same;			/* next one with the same id */
+	struct hlist_s *prev;
 	struct hlist_s *next;
 };
 
+/*
+ * Interned names of the headers we look for, see hlist_id()
+ */
+enum {
+	HDR_UNKNOWN = 0,
+	HDR_HOST,
+	HDR_CONNECTION,
+	HDR_PROXY_CONNECTION,
+	HDR_KEEP_ALIVE,
+	HDR_CONTENT_LENGTH,
+	HDR_CONTENT_TYPE,
+	HDR_TRANSFER_ENCODING,
+	HDR_PROXY_AUTHORIZATION,
+	HDR_PROXY_AUTHENTICATE,
+	HDR_AUTHORIZATION,
+	HDR_WWW_AUTHENTICATE,
+	HDR_USER_AGENT,
+	HDR_REFERER,
+	HDR_UPGRADE,
+	HDR_TE,
+	HDR_TRAILER,
+	HDR_EXPECT,
+	HDR_ACCEPT,
+	HDR_ACCEPT_ENCODING,
+	HDR_COOKIE,
+	HDR_SET_COOKIE,
+	HDR_LOCATION,
+	HDR_SERVER,
+	HDR_DATE,
+	HDR_CACHE_CONTROL,
+	HDR_COUNT
+};
+
+/*
+ * Index of a request/response header list: the last node, and the first
+ * and last node for each known header, so that lookups, appends and
+ * deletions don't walk the list.
+ */
+struct hlist_index_s {
+	struct hlist_s *tail;
+	struct hlist_s *first[HDR_COUNT];
+	struct hlist_s *last[HDR_COUNT];
+};
+
 typedef struct plist_s *plist_t;
 typedef const struct plist_s *plist_const_t;
 struct plist_s {
@@ -90,6 +159,7 @@ struct rr_data_s {
 	int skip_http;
 	int body_len;
 	int empty;
+	int closed;				/* headers_recv() met EOF or reset before any byte */
 	int port;
 	int http_version;
 	char *method;
@@ -100,8 +170,14 @@ struct rr_data_s {
 	char *msg;
 	char *body;
 	char *errmsg;
+	struct arena_s arena;			/* owns the strings and headers */
 };
 
+/*
+ * Size of the arena block allocated together with each rr_data_s
+ */
+#define RR_ARENA_SIZE		2048
+
 /*
  * This structure can represent a sockaddr or
  * an AF_INET (ipv4) sockaddr or an AF_INET6 (ipv6) sockaddr
@@ -119,6 +195,7 @@ struct thread_arg_s {
 	int fd;
 	char *target;
 	union sock_addr addr;
+	rr_data_t request;		/* already read by the request engine */
 };
 
 /*
@@ -150,7 +227,15 @@ extern int plist_pop(plist_t *list, void **aux);
 extern int plist_count(plist_const_t list) __attribute__((warn_unused_result));
 extern plist_t plist_free(plist_t list);
 
+extern void arena_init(struct arena_s *arena, char *block, size_t size);
+extern void *arena_alloc(struct arena_s *arena, size_t size) __attribute__((warn_unused_result, malloc, alloc_size(2)));
+extern char *arena_strndup(struct arena_s *arena, const char *src, size_t len) __attribute__((warn_unused_result));
+extern int arena_owns(const struct arena_s *arena, const void *ptr) __attribute__((warn_unused_result));
+extern void arena_reset(struct arena_s *arena);
+
+extern int hlist_id(const char *key, size_t len) __attribute__((warn_unused_result));
 extern hlist_t hlist_add(hlist_t list, char *key, char *value, hlist_add_t allockey, hlist_add_t allocvalue);
+extern hlist_t hlist_add_arena(hlist_t list, struct arena_s *arena, char *key, char *value, hlist_add_t alloc);
 extern hlist_t hlist_dup(hlist_const_t list) __attribute__((warn_unused_result));
 extern hlist_t hlist_del(hlist_t list, const char *key);
 extern hlist_t hlist_mod(hlist_t list, char *key, char *value, int add);
@@ -181,6 +266,8 @@ extern rr_data_t copy_rr_data(rr_data_t dst, const rr_data_const_t src);
 extern rr_data_t dup_rr_data(const rr_data_const_t data) __attribute__((warn_unused_result));
 extern rr_data_t reset_rr_data(rr_data_t data);
 extern void free_rr_data(rr_data_t * data);
+extern char *rr_strdup(rr_data_t data, const char *src) __attribute__((warn_unused_result));
+extern void rr_strset(rr_data_t data, char **field, const char *src);
 
 extern char *printmem(const char * const src, const size_t len, const int bitwidth) __attribute__((warn_unused_result));
 extern char *scanmem(const char * const src, const int bitwidth) __attribute__((warn_unused_result));
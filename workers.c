@@ -0,0 +1,335 @@
+/*
+ * These are the worker pool routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE				/* pthread_attr_setaffinity_np() */
+#include <sched.h>
+#endif
+
+#include <pthread.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <syslog.h>
+
+#include "utils.h"
+#include "workers.h"
+
+extern int debug;
+
+/*
+ * Accepted connections are handed to a set of pre-spawned workers through
+ * a bounded lock-free MPMC queue (sequence-numbered ring, D. Vyukov style).
+ *
+ * A submitter first claims one of the idle workers by decrementing "avail";
+ * only then it enqueues the job, so the queue never holds more jobs than
+ * there are workers and pushing cannot fail. When all workers are busy -
+ * typically serving long-lived keep-alive connections or CONNECT tunnels -
+ * the job gets a detached thread of its own. This way a slow client can
+ * never starve the others. Once done, the overflow thread joins the pool,
+ * as long as it has less than "workers_max" threads, so that the pool grows
+ * to the number of concurrent clients instead of starting a thread for
+ * each connection above it.
+ *
+ * The mutex and condition are only used to park idle workers; the fast path
+ * (a worker finishing a job and finding another one queued) is lock-free.
+ */
+
+struct job_s {
+	void *(*fn)(void *);
+	void *arg;
+};
+
+struct cell_s {
+	unsigned long seq;
+	struct job_s job;
+};
+
+static struct cell_s *queue = NULL;
+static unsigned long queue_mask = 0;
+static unsigned long enqueue_pos = 0;
+static unsigned long dequeue_pos = 0;
+
+static int workers_count = 0;
+static int workers_max = 0;
+static int avail = 0;				/* idle workers not yet claimed */
+static int busy = 0;
+static int queued = 0;
+static int sleepers = 0;
+static int stopping = 0;
+static unsigned long completed = 0;
+static unsigned long overflow = 0;
+
+static pthread_attr_t workers_attr;
+static pthread_mutex_t workers_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_cond = PTHREAD_COND_INITIALIZER;
+
+static int queue_push(const struct job_s *job) {
+	struct cell_s *cell;
+	unsigned long pos;
+	unsigned long seq;
+	long diff;
+
+	pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &queue[pos & queue_mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->job = *job;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+static int queue_pop(struct job_s *job) {
+	struct cell_s *cell;
+	unsigned long pos;
+	unsigned long seq;
+	long diff;
+
+	pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &queue[pos & queue_mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	*job = cell->job;
+	__atomic_store_n(&cell->seq, pos + queue_mask + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+static void *worker_thread(void *unused) {
+	struct job_s job;
+
+	(void)unused;
+	for (;;) {
+		if (queue_pop(&job)) {
+			__atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&busy, 1, __ATOMIC_RELAXED);
+
+			job.fn(job.arg);
+
+			__atomic_sub_fetch(&busy, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&completed, 1, __ATOMIC_RELEASE);
+			__atomic_add_fetch(&avail, 1, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		/*
+		 * Nothing to do, park. We announce ourselves in "sleepers" before
+		 * checking "queued", while workers_submit() bumps "queued" before
+		 * checking "sleepers" - so at least one side sees the other and
+		 * the wakeup can't get lost.
+		 */
+		pthread_mutex_lock(&workers_mtx);
+		__atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+		while (!stopping && __atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0)
+			pthread_cond_wait(&workers_cond, &workers_mtx);
+		__atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&workers_mtx);
+
+		if (stopping && __atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Body of an overflow thread, used when no pooled worker was idle. It
+ * stays on as a worker afterwards, if there's room in the pool.
+ */
+static void *overflow_thread(void *data) {
+	struct job_s job = *(struct job_s *)data;
+	int n;
+
+	free(data);
+	job.fn(job.arg);
+	__atomic_add_fetch(&completed, 1, __ATOMIC_RELEASE);
+
+	n = __atomic_load_n(&workers_count, __ATOMIC_RELAXED);
+	while (n < workers_max && !__atomic_compare_exchange_n(&workers_count, &n, n + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	if (n >= workers_max)
+		return NULL;
+
+	if (debug)
+		printf("Worker pool grown to %d threads\n", n + 1);
+	__atomic_add_fetch(&avail, 1, __ATOMIC_RELEASE);
+
+	return worker_thread(NULL);
+}
+
+/*
+ * Pre-spawn "count" workers, the pool can grow to "max". All threads,
+ * pooled or overflow, are detached and use the given stack size.
+ *
+ * Returns: number of workers started.
+ */
+int workers_start(int count, int max, size_t stacksize) {
+	pthread_t pthr;
+	unsigned long size;
+	int i;
+	int rc;
+
+	if (count < 0)
+		count = 0;
+	workers_max = MAX(count, max);
+
+	/*
+	 * Jobs are only queued for claimed workers, so this is enough
+	 */
+	size = 1;
+	while (size < (unsigned long)workers_max)
+		size <<= 1;
+
+	queue = (struct cell_s *)zmalloc(size * sizeof(struct cell_s));
+	queue_mask = size - 1;
+	for (i = 0; i < (int)size; ++i)
+		queue[i].seq = i;
+
+	pthread_attr_init(&workers_attr);
+	pthread_attr_setstacksize(&workers_attr, MAX(stacksize, (size_t)PTHREAD_STACK_MIN));
+	pthread_attr_setdetachstate(&workers_attr, PTHREAD_CREATE_DETACHED);
+#ifndef __CYGWIN__
+	pthread_attr_setguardsize(&workers_attr, 256);
+#endif
+#ifdef __linux__
+	/*
+	 * Overflow threads are started by acceptors, which may be pinned to
+	 * a single CPU. Don't let them inherit that.
+	 */
+	{
+		cpu_set_t cpus;
+
+		if (!sched_getaffinity(0, sizeof(cpus), &cpus))
+			pthread_attr_setaffinity_np(&workers_attr, sizeof(cpus), &cpus);
+	}
+#endif
+
+	for (i = 0; i < count; ++i) {
+		rc = pthread_create(&pthr, &workers_attr, worker_thread, NULL);
+		if (rc) {
+			syslog(LOG_ERR, "Cannot start worker thread: %d\n", rc);
+			break;
+		}
+		__atomic_add_fetch(&workers_count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&avail, 1, __ATOMIC_RELEASE);
+	}
+
+	if (debug)
+		printf("Started %d worker threads, up to %d\n", workers_count, workers_max);
+
+	return workers_count;
+}
+
+/*
+ * Run fn(arg) on an idle worker, or on a new thread if there's none.
+ *
+ * Returns: 0 on success, otherwise pthread_create() error code. On error,
+ * the job was not run and the caller still owns arg.
+ */
+int workers_submit(void *(*fn)(void *), void *arg) {
+	struct job_s job;
+	struct job_s *copy;
+	pthread_t pthr;
+	int n;
+	int rc;
+
+	job.fn = fn;
+	job.arg = arg;
+
+	n = __atomic_load_n(&avail, __ATOMIC_ACQUIRE);
+	while (n > 0 && !__atomic_compare_exchange_n(&avail, &n, n - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		;
+
+	if (n > 0) {
+		if (queue_push(&job)) {
+			__atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0) {
+				pthread_mutex_lock(&workers_mtx);
+				pthread_cond_signal(&workers_cond);
+				pthread_mutex_unlock(&workers_mtx);
+			}
+			return 0;
+		}
+		__atomic_add_fetch(&avail, 1, __ATOMIC_RELEASE);
+	}
+
+	copy = (struct job_s *)malloc(sizeof(struct job_s));
+	if (!copy)
+		return -1;
+	*copy = job;
+
+	rc = pthread_create(&pthr, &workers_attr, overflow_thread, (void *)copy);
+	if (rc) {
+		free(copy);
+		return rc;
+	}
+	__atomic_add_fetch(&overflow, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ * Let idle workers exit. Busy ones finish their job first.
+ */
+void workers_stop(void) {
+	pthread_mutex_lock(&workers_mtx);
+	stopping = 1;
+	pthread_cond_broadcast(&workers_cond);
+	pthread_mutex_unlock(&workers_mtx);
+}
+
+/*
+ * Number of jobs finished so far, used by the main loop to find out how
+ * many connections are still active.
+ */
+unsigned long workers_completed(void) {
+	return __atomic_load_n(&completed, __ATOMIC_ACQUIRE);
+}
+
+void workers_stats(struct workers_stats_s *stats) {
+	stats->workers = __atomic_load_n(&workers_count, __ATOMIC_RELAXED);
+	stats->busy = __atomic_load_n(&busy, __ATOMIC_RELAXED);
+	stats->queued = __atomic_load_n(&queued, __ATOMIC_RELAXED);
+	stats->completed = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+	stats->overflow = __atomic_load_n(&overflow, __ATOMIC_RELAXED);
+}
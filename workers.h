@@ -0,0 +1,45 @@
+/*
+ * These are the worker pool routines for the main module of CNTLM
+ *
+ * CNTLM is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * CNTLM is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+ * St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _WORKERS_H
+#define _WORKERS_H
+
+#include <stddef.h>
+
+#define DEFAULT_WORKERS		16
+#define DEFAULT_WORKERS_MAX	256
+
+/*
+ * Snapshot of the pool state, see workers_stats().
+ */
+struct workers_stats_s {
+	unsigned int workers;			/* pooled worker threads, pre-spawned and grown */
+	unsigned int busy;			/* workers running a job */
+	unsigned int queued;			/* jobs handed to a worker, not picked up yet */
+	unsigned long completed;		/* finished jobs, pool and overflow */
+	unsigned long overflow;			/* jobs which got a thread of their own */
+};
+
+extern int workers_start(int count, int max, size_t stacksize);
+extern int workers_submit(void *(*fn)(void *), void *arg);
+extern void workers_stop(void);
+extern unsigned long workers_completed(void);
+extern void workers_stats(struct workers_stats_s *stats);
+
+#endif /* _WORKERS_H */